@@ -18,9 +18,62 @@ PLEASE FILL OUT THIS SECTION PRIOR TO SUBMISSION
 */
 
 #include <iostream>
+#include <algorithm>
+#include <atomic>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <iomanip>
+#include <iterator>
+#include <map>
 #include <vector>
 #include <fstream>
 #include <cmath>
+#include <csignal>
+#include <chrono>
+#include <climits>
+#include <condition_variable>
+#include <cctype>
+#include <cerrno>
+#include <cstring>
+#include <ctime>
+#include <deque>
+#include <functional>
+#include <future>
+#include <memory>
+#include <mutex>
+#include <new>
+#include <set>
+#include <sstream>
+#include <thread>
+#include <dirent.h>
+#include <fcntl.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+#include <sys/un.h>
+#include <unistd.h>
+#ifdef __linux__
+#include <linux/fs.h>
+#if defined(__has_include)
+#if __has_include(<linux/io_uring.h>) && defined(__NR_io_uring_setup)
+#define IMAGE_EDITOR_IO_URING
+#include <linux/io_uring.h>
+#endif
+#endif
+#endif
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define IMAGE_EDITOR_X86_SIMD
+#include <immintrin.h>
+#endif
+#ifdef __GLIBC__
+#include <malloc.h>
+#endif
 
 using namespace std;
 
@@ -238,370 +291,8432 @@ bool write_image(string filename, const vector<vector<Pixel>>& image)
 //
 // YOUR FUNCTION DEFINITIONS HERE
 //
-    
-// Adds vignette effect to image (dark corners)
-vector<vector<Pixel>> process_1(const vector<vector<Pixel>>& image)
+
+// Instrumentation for --profile and --trace. Scoped spans around loading,
+// filtering and writing record wall time, bytes, pixels, allocations and how
+// busy the thread pool was; with neither flag given a span costs one load.
+static atomic<bool> profiling(false);
+static atomic<long long> allocation_count(0);
+static atomic<long long> allocation_bytes(0);
+static atomic<long long> pool_busy_ns(0);
+static atomic<int> profiled_pool_threads(1);
+
+// Counts every allocation made while profiling is switched on. Every form of
+// operator new and operator delete is replaced together, so memory is always
+// taken with malloc() (or posix_memalign()) and given back with free().
+
+/**
+ * Allocates memory the way the standard operator new does: on failure the
+ * new handler is called and the allocation retried until it succeeds or
+ * there is no handler left
+ * @param bytes     Size of the allocation
+ * @param alignment Required alignment, or 0 for what malloc() gives
+ * @return the memory (throws bad_alloc if it can't be had)
+ */
+void* allocate_counted(size_t bytes, size_t alignment)
+{
+    if (profiling.load(memory_order_relaxed))
+    {
+        allocation_count.fetch_add(1, memory_order_relaxed);
+        allocation_bytes.fetch_add((long long)bytes, memory_order_relaxed);
+    }
+    if (bytes == 0)
+    {
+        bytes = 1;
+    }
+    while (true)
+    {
+        void* memory = nullptr;
+        if (alignment <= alignof(max_align_t))
+        {
+            memory = malloc(bytes);
+        }
+        else if (posix_memalign(&memory, alignment, bytes) != 0)
+        {
+            memory = nullptr;
+        }
+        if (memory != nullptr)
+        {
+            return memory;
+        }
+        new_handler handler = get_new_handler();
+        if (handler == nullptr)
+        {
+            throw bad_alloc();
+        }
+        handler();
+    }
+}
+
+// Once these are inlined, GCC 11 and later warn about free() on memory from
+// operator new. Every form below allocates with malloc() or posix_memalign(), so
+// the pairing is right.
+#if defined(__GNUC__) && !defined(__clang__) && __GNUC__ >= 11
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wmismatched-new-delete"
+#endif
+
+void* operator new(size_t bytes)
+{
+    return allocate_counted(bytes, 0);
+}
+
+void* operator new[](size_t bytes)
+{
+    return allocate_counted(bytes, 0);
+}
+
+void* operator new(size_t bytes, const nothrow_t&) noexcept
+{
+    try
+    {
+        return allocate_counted(bytes, 0);
+    }
+    catch (...)
+    {
+        return nullptr;
+    }
+}
+
+void* operator new[](size_t bytes, const nothrow_t&) noexcept
+{
+    return operator new(bytes, nothrow);
+}
+
+void operator delete(void* memory) noexcept
+{
+    free(memory);
+}
+
+void operator delete[](void* memory) noexcept
+{
+    free(memory);
+}
+
+void operator delete(void* memory, const nothrow_t&) noexcept
+{
+    free(memory);
+}
+
+void operator delete[](void* memory, const nothrow_t&) noexcept
+{
+    free(memory);
+}
+
+#ifdef __cpp_sized_deallocation
+void operator delete(void* memory, size_t) noexcept
+{
+    free(memory);
+}
+
+void operator delete[](void* memory, size_t) noexcept
+{
+    free(memory);
+}
+#endif
+
+#ifdef __cpp_aligned_new
+void* operator new(size_t bytes, align_val_t alignment)
+{
+    return allocate_counted(bytes, (size_t)alignment);
+}
+
+void* operator new[](size_t bytes, align_val_t alignment)
+{
+    return allocate_counted(bytes, (size_t)alignment);
+}
+
+void* operator new(size_t bytes, align_val_t alignment, const nothrow_t&) noexcept
+{
+    try
+    {
+        return allocate_counted(bytes, (size_t)alignment);
+    }
+    catch (...)
+    {
+        return nullptr;
+    }
+}
+
+void* operator new[](size_t bytes, align_val_t alignment, const nothrow_t&) noexcept
+{
+    return operator new(bytes, alignment, nothrow);
+}
+
+void operator delete(void* memory, align_val_t) noexcept
+{
+    free(memory);
+}
+
+void operator delete[](void* memory, align_val_t) noexcept
+{
+    free(memory);
+}
+
+void operator delete(void* memory, align_val_t, const nothrow_t&) noexcept
+{
+    free(memory);
+}
+
+void operator delete[](void* memory, align_val_t, const nothrow_t&) noexcept
+{
+    free(memory);
+}
+
+void operator delete(void* memory, size_t, align_val_t) noexcept
+{
+    free(memory);
+}
+
+void operator delete[](void* memory, size_t, align_val_t) noexcept
+{
+    free(memory);
+}
+#endif
+
+#if defined(__GNUC__) && !defined(__clang__) && __GNUC__ >= 11
+#pragma GCC diagnostic pop
+#endif
+
+struct TraceEvent
+{
+    string name;
+    string category;          // "io", "filter", "pipeline", "batch" or "pool"
+    int thread;               // Small id of the thread that recorded the span
+    double start_us;          // Microseconds since the program started
+    double duration_us;
+    long long bytes_read;
+    long long bytes_written;
+    long long pixels;
+    long long allocations;    // Allocations made by any thread during the span
+    long long allocated_bytes;
+    double pool_use;          // Fraction of the pool's thread time spent on bands
+};
+
+static mutex trace_mutex;
+static vector<TraceEvent> trace_events;
+static const chrono::steady_clock::time_point trace_epoch = chrono::steady_clock::now();
+static bool profile_summary = false;
+static string trace_file;
+
+/**
+ * Gives each thread a small number for the trace, in order of first use
+ * @return the id of the calling thread
+ */
+int trace_thread_id()
+{
+    static atomic<int> next_id(0);
+    static thread_local int id = next_id++;
+    return id;
+}
+
+// Records one span from construction to destruction
+class ScopedTrace
+{
+public:
+    ScopedTrace(const char* name, const char* category, long long pixels = 0)
+        : active_(profiling.load(memory_order_relaxed))
+    {
+        if (!active_)
+        {
+            return;
+        }
+        event_.name = name;
+        event_.category = category;
+        event_.bytes_read = 0;
+        event_.bytes_written = 0;
+        event_.pixels = pixels;
+        allocations_ = allocation_count.load(memory_order_relaxed);
+        allocated_bytes_ = allocation_bytes.load(memory_order_relaxed);
+        busy_ns_ = pool_busy_ns.load(memory_order_relaxed);
+        start_ = chrono::steady_clock::now();
+    }
+
+    ~ScopedTrace()
+    {
+        if (!active_)
+        {
+            return;
+        }
+        chrono::steady_clock::time_point end = chrono::steady_clock::now();
+        event_.thread = trace_thread_id();
+        event_.start_us = chrono::duration<double, micro>(start_ - trace_epoch).count();
+        event_.duration_us = chrono::duration<double, micro>(end - start_).count();
+        event_.allocations = allocation_count.load(memory_order_relaxed) - allocations_;
+        event_.allocated_bytes = allocation_bytes.load(memory_order_relaxed) - allocated_bytes_;
+        double busy_us = (pool_busy_ns.load(memory_order_relaxed) - busy_ns_) / 1000.0;
+        double capacity_us = event_.duration_us * profiled_pool_threads.load(memory_order_relaxed);
+        event_.pool_use = capacity_us > 0 ? min(1.0, busy_us / capacity_us) : 0;
+
+        lock_guard<mutex> lock(trace_mutex);
+        trace_events.push_back(event_);
+    }
+
+    void add_bytes_read(long long bytes) { event_.bytes_read += bytes; }
+    void add_bytes_written(long long bytes) { event_.bytes_written += bytes; }
+    void set_pixels(long long pixels) { event_.pixels = pixels; }
+
+private:
+    ScopedTrace(const ScopedTrace&);
+    ScopedTrace& operator=(const ScopedTrace&);
+
+    bool active_;
+    TraceEvent event_;
+    long long allocations_;
+    long long allocated_bytes_;
+    long long busy_ns_;
+    chrono::steady_clock::time_point start_;
+};
+
+/**
+ * Runs body over [first_row, last_row), adding the time it took to the pool's
+ * busy time when profiling
+ * @param body Function processing the rows [first_row, last_row)
+ * @param first_row First row to process
+ * @param last_row One past the last row to process
+ * @return nothing
+ */
+void run_timed(const function<void(int, int)>& body, int first_row, int last_row)
+{
+    if (!profiling.load(memory_order_relaxed))
+    {
+        body(first_row, last_row);
+        return;
+    }
+    ScopedTrace trace("band", "pool");
+    chrono::steady_clock::time_point start = chrono::steady_clock::now();
+    body(first_row, last_row);
+    pool_busy_ns.fetch_add(chrono::duration_cast<chrono::nanoseconds>(chrono::steady_clock::now() - start).count(),
+                           memory_order_relaxed);
+}
+
+/**
+ * Escapes a string for use inside a JSON string literal
+ * @param text The string to escape
+ * @return text with quotes, backslashes and control characters escaped
+ */
+string json_escape(const string& text)
+{
+    string escaped;
+    for (size_t i = 0; i < text.size(); i++)
+    {
+        char c = text[i];
+        if (c == '"' || c == '\\')
+        {
+            escaped += '\\';
+            escaped += c;
+        }
+        else if ((unsigned char)c < 0x20)
+        {
+            char code[8];
+            snprintf(code, sizeof(code), "\\u%04x", c);
+            escaped += code;
+        }
+        else
+        {
+            escaped += c;
+        }
+    }
+    return escaped;
+}
+
+/**
+ * Prints one line per span name with its totals over the whole run
+ * @param events The recorded spans
+ * @return nothing
+ */
+void print_profile_summary(const vector<TraceEvent>& events)
+{
+    struct Totals
+    {
+        string name;
+        int calls;
+        double us;
+        long long bytes_read;
+        long long bytes_written;
+        long long pixels;
+        long long allocations;
+        long long allocated_bytes;
+        double pool_us; // Span time weighted by pool use
+    };
+    vector<Totals> totals;
+    map<string, size_t> index;
+    for (size_t i = 0; i < events.size(); i++)
+    {
+        const TraceEvent& event = events[i];
+        if (index.find(event.name) == index.end())
+        {
+            index[event.name] = totals.size();
+            Totals entry = {event.name, 0, 0, 0, 0, 0, 0, 0, 0};
+            totals.push_back(entry);
+        }
+        Totals& entry = totals[index[event.name]];
+        entry.calls++;
+        entry.us += event.duration_us;
+        entry.bytes_read += event.bytes_read;
+        entry.bytes_written += event.bytes_written;
+        entry.pixels += event.pixels;
+        entry.allocations += event.allocations;
+        entry.allocated_bytes += event.allocated_bytes;
+        entry.pool_us += event.duration_us * event.pool_use;
+    }
+
+    cout << left << setw(20) << "stage" << right << setw(7) << "calls" << setw(11) << "total ms"
+         << setw(10) << "mean ms" << setw(10) << "read MB" << setw(10) << "write MB" << setw(10) << "Mpixels"
+         << setw(9) << "Mpix/s" << setw(10) << "allocs" << setw(10) << "alloc MB" << setw(9) << "pool %" << "\n";
+    cout << fixed;
+    for (size_t i = 0; i < totals.size(); i++)
+    {
+        const Totals& entry = totals[i];
+        double ms = entry.us / 1000;
+        cout << left << setw(20) << entry.name << right << setw(7) << entry.calls
+             << setprecision(2) << setw(11) << ms << setw(10) << ms / entry.calls
+             << setprecision(1) << setw(10) << entry.bytes_read / 1e6 << setw(10) << entry.bytes_written / 1e6
+             << setw(10) << entry.pixels / 1e6 << setw(9) << (entry.us > 0 ? entry.pixels / entry.us : 0)
+             << setw(10) << entry.allocations << setw(10) << entry.allocated_bytes / 1e6
+             << setw(9) << (entry.us > 0 ? 100 * entry.pool_us / entry.us : 0) << "\n";
+    }
+    cout.unsetf(ios::floatfield);
+    cout << setprecision(6);
+}
+
+/**
+ * Writes the spans in the Chrome trace event format, for chrome://tracing or Perfetto
+ * @param filename Name of the JSON file to write
+ * @param events The recorded spans
+ * @return true if the file was written
+ */
+bool write_trace_json(const string& filename, const vector<TraceEvent>& events)
+{
+    ofstream out(filename);
+    if (!out)
+    {
+        return false;
+    }
+    out << "{\"displayTimeUnit\": \"ms\", \"traceEvents\": [\n";
+    out << fixed << setprecision(3);
+    for (size_t i = 0; i < events.size(); i++)
+    {
+        const TraceEvent& event = events[i];
+        out << "  {\"name\": \"" << json_escape(event.name) << "\", \"cat\": \"" << json_escape(event.category)
+            << "\", \"ph\": \"X\", \"pid\": 1, \"tid\": " << event.thread
+            << ", \"ts\": " << event.start_us << ", \"dur\": " << event.duration_us
+            << ", \"args\": {\"bytes_read\": " << event.bytes_read << ", \"bytes_written\": " << event.bytes_written
+            << ", \"pixels\": " << event.pixels << ", \"allocations\": " << event.allocations
+            << ", \"allocated_bytes\": " << event.allocated_bytes << ", \"pool_use\": " << event.pool_use << "}}"
+            << (i + 1 < events.size() ? ",\n" : "\n");
+    }
+    out << "]}\n";
+    return (bool)out;
+}
+
+/**
+ * Prints the summary and writes the trace requested on the command line; run at exit
+ * @return nothing
+ */
+void finish_profiling()
+{
+    profiling = false;
+    vector<TraceEvent> events;
+    {
+        lock_guard<mutex> lock(trace_mutex);
+        events.swap(trace_events);
+    }
+    if (profile_summary)
+    {
+        print_profile_summary(events);
+    }
+    if (!trace_file.empty())
+    {
+        if (write_trace_json(trace_file, events))
+        {
+            cout << "Wrote " << events.size() << " trace events to " << trace_file << "\n";
+        }
+        else
+        {
+            cout << "Could not write " << trace_file << "\n";
+        }
+    }
+}
+
+// Alignment of image buffers: a cache line, which also suits any vector load
+const size_t IMAGE_BUFFER_ALIGNMENT = 64;
+
+// Free image buffers kept for reuse unless --buffer-pool says otherwise
+const size_t DEFAULT_BUFFER_POOL_BYTES = (size_t)256 << 20;
+
+// Recycles the pixel buffers of images. Sizes are rounded up to a size class
+// (at most 1/32 larger than asked for) so images of nearly the same size share
+// buffers. A released buffer is kept for the next image of its class while the
+// free buffers fit the pool's limit, the oldest being freed first. A batch of
+// same-sized images then reuses a few buffers instead of mapping fresh memory,
+// and page faulting it in, for every image.
+class BufferPool
+{
+public:
+    explicit BufferPool(size_t limit) : limit_(limit), free_bytes_(0) {}
+
+    /**
+     * Rounds a buffer size up to its size class
+     * @param bytes The size asked for
+     * @return the size of the buffer handed out (throws bad_alloc if that doesn't fit a size_t)
+     */
+    static size_t size_class(size_t bytes)
+    {
+        if (bytes <= 1024)
+        {
+            return (bytes + IMAGE_BUFFER_ALIGNMENT - 1) / IMAGE_BUFFER_ALIGNMENT * IMAGE_BUFFER_ALIGNMENT;
+        }
+        // Compared by dividing, so sizes near SIZE_MAX don't overflow
+        size_t step = IMAGE_BUFFER_ALIGNMENT;
+        while (step <= bytes / 32)
+        {
+            step <<= 1;
+        }
+        if (bytes > SIZE_MAX - (step - 1))
+        {
+            throw bad_alloc();
+        }
+        return (bytes + step - 1) / step * step;
+    }
+
+    /**
+     * Hands out a buffer, recycled if one of the right class is free
+     * @param bytes    Number of bytes needed
+     * @param capacity Set to the size of the buffer, to be passed back to release()
+     * @return the buffer, aligned to IMAGE_BUFFER_ALIGNMENT and with undefined contents
+     */
+    unsigned char* acquire(size_t bytes, size_t& capacity)
+    {
+        capacity = size_class(bytes);
+        {
+            lock_guard<mutex> lock(mutex_);
+            for (size_t i = free_.size(); i-- > 0;)
+            {
+                if (free_[i].first == capacity)
+                {
+                    unsigned char* data = free_[i].second;
+                    free_.erase(free_.begin() + i);
+                    free_bytes_ -= capacity;
+                    return data;
+                }
+            }
+        }
+        if (profiling.load(memory_order_relaxed))
+        {
+            allocation_count.fetch_add(1, memory_order_relaxed);
+            allocation_bytes.fetch_add((long long)capacity, memory_order_relaxed);
+        }
+        void* data = nullptr;
+        if (posix_memalign(&data, IMAGE_BUFFER_ALIGNMENT, capacity) != 0)
+        {
+            throw bad_alloc();
+        }
+        return (unsigned char*)data;
+    }
+
+    /**
+     * Takes a buffer back for reuse, or frees it if the pool is full
+     * @param data     The buffer (may be null)
+     * @param capacity Its size, as set by acquire()
+     * @return nothing
+     */
+    void release(unsigned char* data, size_t capacity)
+    {
+        if (data == nullptr)
+        {
+            return;
+        }
+        vector<unsigned char*> unused;
+        {
+            lock_guard<mutex> lock(mutex_);
+            free_.push_back(make_pair(capacity, data));
+            free_bytes_ += capacity;
+            trim(unused);
+        }
+        for (size_t i = 0; i < unused.size(); i++)
+        {
+            free(unused[i]);
+        }
+    }
+
+    /**
+     * Changes how many bytes of free buffers the pool keeps
+     * @param limit The new limit (0 to free every buffer as soon as it is released)
+     * @return nothing
+     */
+    void set_limit(size_t limit)
+    {
+        vector<unsigned char*> unused;
+        {
+            lock_guard<mutex> lock(mutex_);
+            limit_ = limit;
+            trim(unused);
+        }
+        for (size_t i = 0; i < unused.size(); i++)
+        {
+            free(unused[i]);
+        }
+    }
+
+private:
+    // Takes the oldest free buffers out of the pool until it fits its limit
+    void trim(vector<unsigned char*>& unused)
+    {
+        while (free_bytes_ > limit_)
+        {
+            unused.push_back(free_.front().second);
+            free_bytes_ -= free_.front().first;
+            free_.pop_front();
+        }
+    }
+
+    mutex mutex_;
+    deque<pair<size_t, unsigned char*>> free_; // (capacity, buffer), oldest first
+    size_t limit_;
+    size_t free_bytes_;
+};
+
+/**
+ * Gets the pool every image takes its buffer from
+ * @return the pool
+ */
+BufferPool& buffer_pool()
+{
+    // Never destroyed, so images released while the program exits still have a pool to go back to
+    static BufferPool* pool = new BufferPool(DEFAULT_BUFFER_POOL_BYTES);
+    return *pool;
+}
+
+// Memory layout of the channels of an Image
+enum ImageLayout
+{
+    LAYOUT_INTERLEAVED, // Each row holds blue, green, red for one pixel after another (like a BMP scanline)
+    LAYOUT_PLANAR       // All blue rows, then all green rows, then all red rows
+};
+
+// What a new Image's pixels start out as
+enum ImageFill
 {
-    int width = image.size();
-    int height = image[0].size();
+    FILL_ZERO,         // Every byte zero
+    FILL_UNINITIALIZED // Only the row padding zeroed, for filters that write every pixel
+};
+
+// Image stored in one contiguous buffer of 8-bit channels, rows top to bottom.
+// Every row starts on a 4 byte boundary, so an interleaved row has exactly the
+// size and layout of a BMP scanline (padding bytes are kept at zero). Buffers
+// come from buffer_pool() and go back to it when the image is destroyed.
+class Image
+{
+public:
+    Image() : width_(0), height_(0), stride_(0), layout_(LAYOUT_INTERLEAVED), data_(nullptr), bytes_(0), capacity_(0) {}
+
+    Image(int width, int height, ImageLayout layout = LAYOUT_INTERLEAVED, ImageFill fill = FILL_ZERO)
+        : width_(width), height_(height), stride_(0), layout_(layout), data_(nullptr), bytes_(0), capacity_(0)
+    {
+        // A negative size, or rows too long for an int stride, makes an empty image
+        if (width < 0 || height < 0 || width > (INT_MAX - 3) / 3)
+        {
+            width_ = height_ = 0;
+            return;
+        }
+        int row_bytes = layout == LAYOUT_INTERLEAVED ? width * 3 : width;
+        stride_ = (row_bytes + 3) / 4 * 4;
+        int planes = layout == LAYOUT_INTERLEAVED ? 1 : 3;
+        allocate((size_t)stride_ * height * planes);
+        if (fill == FILL_ZERO)
+        {
+            memset(data_, 0, bytes_);
+            return;
+        }
+        for (size_t offset = row_bytes; offset < bytes_; offset += stride_)
+        {
+            memset(data_ + offset, 0, stride_ - row_bytes);
+        }
+    }
+
+    Image(const Image& other)
+        : width_(other.width_), height_(other.height_), stride_(other.stride_), layout_(other.layout_),
+          data_(nullptr), bytes_(0), capacity_(0)
+    {
+        allocate(other.bytes_);
+        if (bytes_ > 0)
+        {
+            memcpy(data_, other.data_, bytes_);
+        }
+    }
+
+    Image(Image&& other) noexcept
+        : width_(other.width_), height_(other.height_), stride_(other.stride_), layout_(other.layout_),
+          data_(other.data_), bytes_(other.bytes_), capacity_(other.capacity_)
+    {
+        other.width_ = other.height_ = other.stride_ = 0;
+        other.data_ = nullptr;
+        other.bytes_ = other.capacity_ = 0;
+    }
+
+    // Copies or moves by swapping with a by-value copy; the old buffer goes back to the pool
+    Image& operator=(Image other) noexcept
+    {
+        swap(width_, other.width_);
+        swap(height_, other.height_);
+        swap(stride_, other.stride_);
+        swap(layout_, other.layout_);
+        swap(data_, other.data_);
+        swap(bytes_, other.bytes_);
+        swap(capacity_, other.capacity_);
+        return *this;
+    }
+
+    ~Image()
+    {
+        buffer_pool().release(data_, capacity_);
+    }
+
+    int width() const { return width_; }
+    int height() const { return height_; }
+    int stride() const { return stride_; }
+    ImageLayout layout() const { return layout_; }
+    bool empty() const { return width_ <= 0 || height_ <= 0; }
+    size_t size_bytes() const { return bytes_; }
+
+    // Interleaved BGR row, 0 being the top row
+    unsigned char* row(int y) { return data_ + (size_t)y * stride_; }
+    const unsigned char* row(int y) const { return data_ + (size_t)y * stride_; }
+
+    // Planar row of one channel (0 = blue, 1 = green, 2 = red)
+    unsigned char* plane_row(int channel, int y) { return data_ + ((size_t)channel * height_ + y) * stride_; }
+    const unsigned char* plane_row(int channel, int y) const { return data_ + ((size_t)channel * height_ + y) * stride_; }
+
+    // Reads one pixel in either layout
+    Pixel get(int x, int y) const
+    {
+        Pixel pixel;
+        if (layout_ == LAYOUT_INTERLEAVED)
+        {
+            const unsigned char* p = row(y) + x * 3;
+            pixel.blue = p[0];
+            pixel.green = p[1];
+            pixel.red = p[2];
+        }
+        else
+        {
+            pixel.blue = plane_row(0, y)[x];
+            pixel.green = plane_row(1, y)[x];
+            pixel.red = plane_row(2, y)[x];
+        }
+        return pixel;
+    }
+
+    // Writes one pixel in either layout (values are stored modulo 256, as write_image() does)
+    void set(int x, int y, const Pixel& pixel)
+    {
+        if (layout_ == LAYOUT_INTERLEAVED)
+        {
+            unsigned char* p = row(y) + x * 3;
+            p[0] = pixel.blue;
+            p[1] = pixel.green;
+            p[2] = pixel.red;
+        }
+        else
+        {
+            plane_row(0, y)[x] = pixel.blue;
+            plane_row(1, y)[x] = pixel.green;
+            plane_row(2, y)[x] = pixel.red;
+        }
+    }
+
+    // Returns a copy of the image in the requested layout
+    Image to_layout(ImageLayout layout) const
+    {
+        if (layout == layout_)
+        {
+            return *this;
+        }
+        Image converted(width_, height_, layout);
+        for (int y = 0; y < height_; y++)
+        {
+            for (int x = 0; x < width_; x++)
+            {
+                converted.set(x, y, get(x, y));
+            }
+        }
+        return converted;
+    }
+
+private:
+    void allocate(size_t bytes)
+    {
+        bytes_ = bytes;
+        data_ = bytes > 0 ? buffer_pool().acquire(bytes, capacity_) : nullptr;
+    }
+
+    int width_;
+    int height_;
+    int stride_;
+    ImageLayout layout_;
+    unsigned char* data_;
+    size_t bytes_;
+    size_t capacity_;
+};
+
+/**
+ * Converts an image from read_image() into an interleaved Image
+ * @param pixels The image as a vector of vector of Pixels
+ * @return the same image as an Image
+ */
+Image image_from_pixels(const vector<vector<Pixel>>& pixels)
+{
+    if (pixels.empty() || pixels[0].empty())
+    {
+        return Image();
+    }
+    Image image(pixels[0].size(), pixels.size());
+    for (int y = 0; y < image.height(); y++)
+    {
+        for (int x = 0; x < image.width(); x++)
+        {
+            image.set(x, y, pixels[y][x]);
+        }
+    }
+    return image;
+}
+
+/**
+ * Converts an Image into the vector of vector of Pixels used by write_image()
+ * @param image The image to convert
+ * @return the same image as a vector of vector of Pixels
+ */
+vector<vector<Pixel>> pixels_from_image(const Image& image)
+{
+    vector<vector<Pixel>> pixels(image.height(), vector<Pixel>(image.width()));
+    for (int y = 0; y < image.height(); y++)
+    {
+        for (int x = 0; x < image.width(); x++)
+        {
+            pixels[y][x] = image.get(x, y);
+        }
+    }
+    return pixels;
+}
+
+// Pool of worker threads that runs the row bands of a filter in parallel.
+// Every call to parallel_for() deals the bands out to one queue per thread;
+// a thread works through its own queue front to back and, once it runs dry,
+// steals bands from the back of the other queues.
+class ThreadPool
+{
+public:
+    explicit ThreadPool(int threads)
+        : threads_(max(1, threads)), queues_(threads_), generation_(0), stopping_(false)
+    {
+        profiled_pool_threads = threads_;
+        // The thread calling parallel_for() works too, so start one fewer
+        for (int i = 1; i < threads_; i++)
+        {
+            workers_.push_back(thread(&ThreadPool::worker_loop, this, i));
+        }
+    }
+
+    ~ThreadPool()
+    {
+        {
+            lock_guard<mutex> lock(state_mutex_);
+            stopping_ = true;
+        }
+        wake_.notify_all();
+        for (size_t i = 0; i < workers_.size(); i++)
+        {
+            workers_[i].join();
+        }
+    }
+
+    int size() const { return threads_; }
+
+    /**
+     * Runs body(first_row, last_row) over the rows [0, rows) split into bands,
+     * returning once every band has been processed. Calls made from inside a
+     * band, or while another caller is using the pool, run serially instead.
+     * @param rows Number of rows to cover
+     * @param body Function processing the rows [first_row, last_row)
+     * @return nothing
+     */
+    void parallel_for(int rows, const function<void(int, int)>& body)
+    {
+        if (rows <= 0)
+        {
+            return;
+        }
+        if (in_pool_thread())
+        {
+            body(0, rows);
+            return;
+        }
+        if (threads_ == 1 || rows == 1)
+        {
+            run_timed(body, 0, rows);
+            return;
+        }
+        unique_lock<mutex> job_lock(job_mutex_, try_to_lock);
+        if (!job_lock.owns_lock())
+        {
+            run_timed(body, 0, rows);
+            return;
+        }
+
+        Job job;
+        job.body = &body;
+
+        // Several bands per thread leaves room to even out uneven rows
+        int bands = min(rows, threads_ * 8);
+        job.remaining = bands;
+        for (int band = 0; band < bands; band++)
+        {
+            Band entry;
+            entry.job = &job;
+            entry.first = (int)((long long)rows * band / bands);
+            entry.last = (int)((long long)rows * (band + 1) / bands);
+            BandQueue& queue = queues_[band % threads_];
+            lock_guard<mutex> lock(queue.lock);
+            queue.bands.push_back(entry);
+        }
+        {
+            lock_guard<mutex> lock(state_mutex_);
+            generation_++;
+        }
+        wake_.notify_all();
+
+        in_pool_thread() = true;
+        run_bands(0);
+        in_pool_thread() = false;
+
+        // Wait for the bands other threads are still working on
+        unique_lock<mutex> lock(state_mutex_);
+        done_.wait(lock, [&job] { return job.remaining == 0; });
+    }
+
+private:
+    struct Job
+    {
+        const function<void(int, int)>* body;
+        int remaining; // Bands not yet finished, guarded by state_mutex_
+    };
+
+    struct Band
+    {
+        Job* job;  // The parallel_for() call this band belongs to
+        int first; // First row of the band
+        int last;  // One past the last row of the band
+    };
+
+    struct BandQueue
+    {
+        mutex lock;
+        deque<Band> bands;
+    };
+
+    static bool& in_pool_thread()
+    {
+        static thread_local bool inside = false;
+        return inside;
+    }
+
+    // Takes the next band from this thread's queue, or steals one from another queue
+    bool next_band(int self, Band& band)
+    {
+        for (int i = 0; i < threads_; i++)
+        {
+            BandQueue& queue = queues_[(self + i) % threads_];
+            lock_guard<mutex> lock(queue.lock);
+            if (queue.bands.empty())
+            {
+                continue;
+            }
+            if (i == 0)
+            {
+                band = queue.bands.front();
+                queue.bands.pop_front();
+            }
+            else
+            {
+                band = queue.bands.back();
+                queue.bands.pop_back();
+            }
+            return true;
+        }
+        return false;
+    }
+
+    void run_bands(int self)
+    {
+        Band band;
+        while (next_band(self, band))
+        {
+            run_timed(*band.job->body, band.first, band.last);
+
+            lock_guard<mutex> lock(state_mutex_);
+            band.job->remaining--;
+            if (band.job->remaining == 0)
+            {
+                done_.notify_all();
+            }
+        }
+    }
+
+    void worker_loop(int self)
+    {
+        in_pool_thread() = true;
+        unsigned long long seen = 0;
+        unique_lock<mutex> lock(state_mutex_);
+        while (true)
+        {
+            wake_.wait(lock, [this, seen] { return stopping_ || generation_ != seen; });
+            if (stopping_)
+            {
+                return;
+            }
+            seen = generation_;
+            lock.unlock();
+            run_bands(self);
+            lock.lock();
+        }
+    }
+
+    int threads_;
+    vector<BandQueue> queues_;
+    vector<thread> workers_;
+    mutex job_mutex_;   // Held by the caller for the duration of parallel_for()
+    mutex state_mutex_; // Guards generation_, stopping_ and Job::remaining
+    condition_variable wake_;
+    condition_variable done_;
+    unsigned long long generation_;
+    bool stopping_;
+};
+
+// Number of threads filters run on (0 means one per hardware thread)
+static int filter_thread_count = 0;
+static unique_ptr<ThreadPool> filter_thread_pool;
+static mutex filter_thread_pool_mutex;
+
+/**
+ * Sets the number of threads filters run on. Takes effect on the next filter.
+ * @param threads Number of threads, or 0 for one per hardware thread
+ * @return nothing
+ */
+void set_thread_count(int threads)
+{
+    lock_guard<mutex> lock(filter_thread_pool_mutex);
+    filter_thread_count = max(0, threads);
+    filter_thread_pool.reset();
+}
+
+/**
+ * Gets the shared pool filters run on, starting it on first use
+ * @return the filter thread pool
+ */
+ThreadPool& filter_pool()
+{
+    lock_guard<mutex> lock(filter_thread_pool_mutex);
+    if (!filter_thread_pool)
+    {
+        int threads = filter_thread_count;
+        if (threads == 0)
+        {
+            threads = max(1u, thread::hardware_concurrency());
+        }
+        filter_thread_pool.reset(new ThreadPool(threads));
+    }
+    return *filter_thread_pool;
+}
+
+/**
+ * Runs a filter's row loop in bands on the filter thread pool.
+ * Each row must only depend on the input, so the result matches a serial run.
+ * @param rows Number of rows in the output
+ * @param body Function processing the rows [first_row, last_row)
+ * @return nothing
+ */
+void parallel_rows(int rows, const function<void(int, int)>& body)
+{
+    filter_pool().parallel_for(rows, body);
+}
+
+// Load statistics filled in by read_image_fast()
+struct LoadStats
+{
+    long long bytes_read;        // Header plus pixel array bytes
+    double seconds;              // Wall time spent loading
+    double megabytes_per_second; // Throughput of the load
+};
+
+/**
+ * Reads the BMP image specified and returns the resulting image.
+ * Performs the same header checks as read_image(), but reads the pixel array
+ * a scanline at a time instead of seeking per pixel. 24-bit scanlines are read
+ * straight into the image rows, which share the BMP scanline layout.
+ * @param filename BMP image filename
+ * @param stats    Optional load statistics to fill in (may be nullptr)
+ * @return the image (empty if invalid)
+ */
+Image read_image_fast(string filename, LoadStats* stats = nullptr)
+{
+    auto load_start = chrono::steady_clock::now();
+    ScopedTrace trace("read_image_fast", "io");
+
+    // Open the binary file
+    fstream stream;
+    stream.open(filename, ios::in | ios::binary);
+    if (!stream.is_open())
+    {
+        return Image();
+    }
+
+    // Get the image properties
+    int file_size = get_int(stream, 2, 4);
+    int start = get_int(stream, 10, 4);
+    int width = get_int(stream, 18, 4);
+    int height = get_int(stream, 22, 4);
+    int bits_per_pixel = get_int(stream, 28, 2);
+    int bytes_per_pixel = bits_per_pixel / 8;
+
+    // Scan lines must occupy multiples of four bytes
+    int scanline_size = width * bytes_per_pixel;
+    int padding = 0;
+    if (scanline_size % 4 != 0)
+    {
+        padding = 4 - scanline_size % 4;
+    }
+
+    // Return an empty image if this is not a valid image
+    if (bytes_per_pixel < 3 || width <= 0 || height <= 0 ||
+        file_size != start + (scanline_size + padding) * height)
+    {
+        return Image();
+    }
+
+    // Create an image the size of the input image (every row is read in below)
+    Image image(width, height, LAYOUT_INTERLEAVED, FILL_UNINITIALIZED);
+
+    // Reusable buffer for scanlines that need converting (32-bit BGRA)
+    vector<unsigned char> row_buffer;
+    if (bytes_per_pixel != 3)
+    {
+        row_buffer.resize(scanline_size + padding);
+    }
+
+    // Rows are stored back to back, so one seek to the pixel array is enough
+    stream.seekg(start);
+
+    // BMP files store pixels from bottom to top
+    for (int i = height - 1; i >= 0; i--)
+    {
+        if (bytes_per_pixel == 3)
+        {
+            // The scanline, padding included, is exactly one image row
+            if (!stream.read((char*)image.row(i), image.stride()))
+            {
+                return Image();
+            }
+            continue;
+        }
+
+        if (!stream.read((char*)row_buffer.data(), row_buffer.size()))
+        {
+            return Image();
+        }
+
+        // Drop the alpha channel while copying the scanline into the row
+        const unsigned char* src = row_buffer.data();
+        unsigned char* dst = image.row(i);
+        for (int j = 0; j < width; j++)
+        {
+            dst[0] = src[0];
+            dst[1] = src[1];
+            dst[2] = src[2];
+            src += bytes_per_pixel;
+            dst += 3;
+        }
+    }
+
+    stream.close();
+    trace.add_bytes_read(file_size);
+    trace.set_pixels((long long)width * height);
+
+    if (stats != nullptr)
+    {
+        chrono::duration<double> elapsed = chrono::steady_clock::now() - load_start;
+        stats->bytes_read = file_size;
+        stats->seconds = elapsed.count();
+        stats->megabytes_per_second = 0;
+        if (stats->seconds > 0)
+        {
+            stats->megabytes_per_second = file_size / (1024.0 * 1024.0) / stats->seconds;
+        }
+    }
+    return image;
+}
+
+// Layout of a BMP file's pixel array, with 64-bit sizes for files beyond 2 GB
+struct BmpInfo
+{
+    int width;           // Width in pixels
+    int height;          // Height in pixels
+    int bytes_per_pixel; // 3 for BGR, 4 for BGRA
+    off_t pixel_offset;  // Start of the (bottom-up) pixel array
+    size_t row_size;     // Scanline size in bytes, including padding
+};
+
+/**
+ * Reads and checks the header of an open BMP file like read_image() does.
+ * A file too large for the header's 32-bit size field is accepted when it
+ * holds every scanline, whatever that field says.
+ * @param fd   File descriptor of the BMP file
+ * @param info The layout to fill in
+ * @return True if the file is a valid image and false otherwise
+ */
+bool read_bmp_info(int fd, BmpInfo& info)
+{
+    unsigned char bytes[54];
+    struct stat file_info;
+    if (pread(fd, bytes, sizeof(bytes), 0) != (ssize_t)sizeof(bytes) || fstat(fd, &file_info) != 0)
+    {
+        return false;
+    }
+    unsigned int file_size = bytes[2] | bytes[3] << 8 | bytes[4] << 16 | (unsigned int)bytes[5] << 24;
+    unsigned int start = bytes[10] | bytes[11] << 8 | bytes[12] << 16 | (unsigned int)bytes[13] << 24;
+    info.width = bytes[18] | bytes[19] << 8 | bytes[20] << 16 | bytes[21] << 24;
+    info.height = bytes[22] | bytes[23] << 8 | bytes[24] << 16 | bytes[25] << 24;
+    info.bytes_per_pixel = (bytes[28] | bytes[29] << 8) / 8;
+    if (info.bytes_per_pixel < 3 || info.width <= 0 || info.height <= 0)
+    {
+        return false;
+    }
+
+    // Scan lines must occupy multiples of four bytes
+    info.row_size = ((size_t)info.width * info.bytes_per_pixel + 3) / 4 * 4;
+    info.pixel_offset = start;
+    unsigned long long expected = start + (unsigned long long)info.row_size * info.height;
+    return expected <= (unsigned long long)file_info.st_size &&
+           (expected > 0xFFFFFFFFu || file_size == expected);
+}
+
+/**
+ * Loads the image for a menu option and reports the load throughput
+ * @param location BMP image filename
+ * @return the image (empty if invalid)
+ */
+Image load_image(string location)
+{
+    LoadStats stats;
+    Image image = read_image_fast(location, &stats);
+    if (image.empty())
+    {
+        cout << "Could not read a valid BMP image from " << location << "\n";
+    }
+    else
+    {
+        cout << "Loaded " << stats.bytes_read / (1024.0 * 1024.0) << " MB in "
+             << stats.seconds * 1000 << " ms (" << stats.megabytes_per_second << " MB/s)" << "\n";
+    }
+    return image;
+}
+    
+// How write_image_fast() hands the encoded pixel array to the operating system
+enum WriteMode
+{
+    WRITE_SCANLINES, // Encode ~1 MB batches of scanlines into a reusable buffer
+    WRITE_WHOLE,     // Encode the entire pixel array, then issue a single write
+    WRITE_GATHER     // Encode the entire pixel array, then writev() it with the headers
+};
+
+/**
+ * Builds the 54 byte BMP and DIB headers exactly as write_image() does.
+ * Files too large for the 32-bit size fields get 0 in both of them.
+ * @param header        Array of at least 54 bytes to fill in
+ * @param width_pixels  Width of the image in pixels
+ * @param height_pixels Height of the image in pixels
+ * @return the size of the pixel array in bytes, including padding
+ */
+size_t build_bmp_header(unsigned char header[], int width_pixels, int height_pixels)
+{
+    // Calculate the width in bytes incorporating padding (4 byte alignment)
+    size_t width_bytes = (size_t)width_pixels * 3;
+    size_t padding_bytes = (4 - width_bytes % 4) % 4;
+    width_bytes = width_bytes + padding_bytes;
+
+    // Pixel array size in bytes, including padding
+    size_t array_bytes = width_bytes * height_pixels;
+    bool fits = array_bytes + 54 <= 0xFFFFFFFFu;
+
+    const int BMP_HEADER_SIZE = 14;
+    const int DIB_HEADER_SIZE = 40;
+    memset(header, 0, BMP_HEADER_SIZE + DIB_HEADER_SIZE);
+    unsigned char* bmp_header = header;
+    unsigned char* dib_header = header + BMP_HEADER_SIZE;
+
+    // BMP Header
+    set_bytes(bmp_header,  0, 1, 'B');              // ID field
+    set_bytes(bmp_header,  1, 1, 'M');              // ID field
+    set_bytes(bmp_header,  2, 4, fits ? (int)(BMP_HEADER_SIZE+DIB_HEADER_SIZE+array_bytes) : 0); // Size of BMP file
+    set_bytes(bmp_header,  6, 2, 0);                // Reserved
+    set_bytes(bmp_header,  8, 2, 0);                // Reserved
+    set_bytes(bmp_header, 10, 4, BMP_HEADER_SIZE+DIB_HEADER_SIZE); // Pixel array offset
+
+    // DIB Header
+    set_bytes(dib_header,  0, 4, DIB_HEADER_SIZE);  // DIB header size
+    set_bytes(dib_header,  4, 4, width_pixels);     // Width of bitmap in pixels
+    set_bytes(dib_header,  8, 4, height_pixels);    // Height of bitmap in pixels
+    set_bytes(dib_header, 12, 2, 1);                // Number of color planes
+    set_bytes(dib_header, 14, 2, 24);               // Number of bits per pixel
+    set_bytes(dib_header, 16, 4, 0);                // Compression method (0=BI_RGB)
+    set_bytes(dib_header, 20, 4, fits ? (int)array_bytes : 0); // Size of raw bitmap data (including padding)
+    set_bytes(dib_header, 24, 4, 2835);             // Print resolution of image (2835 pixels/meter)
+    set_bytes(dib_header, 28, 4, 2835);             // Print resolution of image (2835 pixels/meter)
+    set_bytes(dib_header, 32, 4, 0);                // Number of colors in palette
+    set_bytes(dib_header, 36, 4, 0);                // Number of important colors
+
+    return array_bytes;
+}
+
+/**
+ * Writes a whole buffer to a file descriptor, retrying short writes
+ * @param fd    File descriptor to write to
+ * @param data  Bytes to write
+ * @param bytes Number of bytes to write
+ * @return True if every byte was written and false otherwise
+ */
+bool write_all(int fd, const unsigned char* data, size_t bytes)
+{
+    while (bytes > 0)
+    {
+        ssize_t written = write(fd, data, bytes);
+        if (written <= 0)
+        {
+            return false;
+        }
+        data += written;
+        bytes -= written;
+    }
+    return true;
+}
+
+/**
+ * Reads exactly the requested number of bytes at an offset, retrying short reads
+ * @param fd     File descriptor to read from
+ * @param data   Where to store the bytes
+ * @param bytes  Number of bytes to read
+ * @param offset Position in the file to read from
+ * @return True if every byte was read and false otherwise
+ */
+bool pread_all(int fd, unsigned char* data, size_t bytes, off_t offset)
+{
+    while (bytes > 0)
+    {
+        ssize_t got = pread(fd, data, bytes, offset);
+        if (got <= 0)
+        {
+            return false;
+        }
+        data += got;
+        bytes -= got;
+        offset += got;
+    }
+    return true;
+}
+
+/**
+ * Writes a whole buffer at an offset, retrying short writes
+ * @param fd     File descriptor to write to
+ * @param data   Bytes to write
+ * @param bytes  Number of bytes to write
+ * @param offset Position in the file to write at
+ * @return True if every byte was written and false otherwise
+ */
+bool pwrite_all(int fd, const unsigned char* data, size_t bytes, off_t offset)
+{
+    while (bytes > 0)
+    {
+        ssize_t written = pwrite(fd, data, bytes, offset);
+        if (written <= 0)
+        {
+            return false;
+        }
+        data += written;
+        bytes -= written;
+        offset += written;
+    }
+    return true;
+}
+
+/**
+ * Encodes one image row as a padded BGR scanline
+ * @param row           The interleaved image row to encode
+ * @param width_pixels  Width of the row in pixels
+ * @param dst           Destination with room for the padded scanline
+ * @param padding_bytes Number of zero bytes to append
+ * @return nothing
+ */
+inline void encode_scanline(const unsigned char* row, int width_pixels, unsigned char* dst, int padding_bytes)
+{
+    memcpy(dst, row, (size_t)width_pixels * 3);
+    memset(dst + (size_t)width_pixels * 3, 0, padding_bytes);
+}
+
+/**
+ * Write the input image to a BMP file name specified, producing the same bytes
+ * as write_image() but with a few large writes instead of one per pixel
+ * @param filename The BMP file name to save the image to
+ * @param image    The input image to save
+ * @param mode     How to batch the writes (see WriteMode)
+ * @return True if successful and false otherwise
+ */
+bool write_image_fast(string filename, const Image& image, WriteMode mode = WRITE_SCANLINES)
+{
+    if (image.empty())
+    {
+        return false;
+    }
+    if (image.layout() != LAYOUT_INTERLEAVED)
+    {
+        return write_image_fast(filename, image.to_layout(LAYOUT_INTERLEAVED), mode);
+    }
+
+    int width_pixels = image.width();
+    int height_pixels = image.height();
+    int padding_bytes = (4 - width_pixels * 3 % 4) % 4;
+    int width_bytes = width_pixels * 3 + padding_bytes;
+
+    unsigned char header[54];
+    size_t array_bytes = build_bmp_header(header, width_pixels, height_pixels);
+
+    ScopedTrace trace("write_image_fast", "io", (long long)width_pixels * height_pixels);
+    trace.add_bytes_written(sizeof(header) + array_bytes);
+
+    int fd = open(filename.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0)
+    {
+        return false;
+    }
+
+    bool ok = true;
+    if (mode == WRITE_SCANLINES)
+    {
+        // Batch as many scanlines as fit in roughly 1 MB, with the headers in front of the first batch
+        int rows_per_batch = min(height_pixels, max(1, (1 << 20) / width_bytes));
+        vector<unsigned char> buffer(sizeof(header) + (size_t)rows_per_batch * width_bytes);
+        memcpy(buffer.data(), header, sizeof(header));
+        size_t used = sizeof(header);
+
+        // Pixel Array (Left to right, bottom to top, with padding)
+        for (int h = height_pixels - 1; h >= 0 && ok; h--)
+        {
+            if (used + width_bytes > buffer.size())
+            {
+                ok = write_all(fd, buffer.data(), used);
+                used = 0;
+            }
+            encode_scanline(image.row(h), width_pixels, buffer.data() + used, padding_bytes);
+            used += width_bytes;
+        }
+        ok = ok && write_all(fd, buffer.data(), used);
+    }
+    else
+    {
+        vector<unsigned char> pixel_array(array_bytes);
+        unsigned char* dst = pixel_array.data();
+        for (int h = height_pixels - 1; h >= 0; h--)
+        {
+            encode_scanline(image.row(h), width_pixels, dst, padding_bytes);
+            dst += width_bytes;
+        }
+
+        if (mode == WRITE_GATHER)
+        {
+            // Hand both headers and the pixel array to the kernel in one call
+            struct iovec parts[2];
+            parts[0].iov_base = header;
+            parts[0].iov_len = sizeof(header);
+            parts[1].iov_base = pixel_array.data();
+            parts[1].iov_len = array_bytes;
+            ssize_t written = writev(fd, parts, 2);
+            if (written < 0)
+            {
+                ok = false;
+            }
+            else if ((size_t)written < sizeof(header) + array_bytes)
+            {
+                // Finish a short gather write with plain writes
+                size_t done = written;
+                if (done < sizeof(header))
+                {
+                    ok = write_all(fd, header + done, sizeof(header) - done);
+                    done = sizeof(header);
+                }
+                done -= sizeof(header);
+                ok = ok && write_all(fd, pixel_array.data() + done, array_bytes - done);
+            }
+        }
+        else
+        {
+            ok = write_all(fd, header, sizeof(header)) &&
+                 write_all(fd, pixel_array.data(), array_bytes);
+        }
+    }
+
+    if (close(fd) != 0)
+    {
+        ok = false;
+    }
+    return ok;
+}
+
+// Table mapping every 8-bit channel value to its new value
+struct ToneCurve
+{
+    unsigned char table[256];
+
+    // When fixed_point is set, the table is also exactly
+    // table[c] == fixed_point_channel(c, slope, offset), a Q0.16 slope and a
+    // Q8.8 offset that SIMD kernels apply 16 channels at a time with no lookups
+    bool fixed_point;
+    unsigned short slope;
+    unsigned short offset;
+};
+
+/**
+ * Evaluates a fixed point tone curve the way the SIMD kernels do: the
+ * channel times a Q0.16 slope, truncated to Q8.8, plus a Q8.8 offset
+ * @param value  Channel value (0-255)
+ * @param slope  Slope in Q0.16
+ * @param offset Offset in Q8.8
+ * @return the curve's value in Q8.8, before dropping the fraction
+ */
+inline int fixed_point_sum(int value, int slope, int offset)
+{
+    return (int)((unsigned)(value * 256) * slope >> 16) + offset;
+}
+
+/**
+ * Looks for a fixed point form of a tone curve of the form
+ * floor(offset + value * slope), which lighten and darken are. Every
+ * candidate near the exact slope and offset is checked against the whole
+ * table, so a curve only gets a fixed point form when it reproduces the
+ * floating point result bit for bit (an error bound of zero); otherwise the
+ * kernels keep using the table.
+ * @param curve  The compiled curve; its fixed point fields are filled in
+ * @param slope  The curve's slope, usable when in [0, 1)
+ * @param offset The curve's value at 0, usable when in [0, 256)
+ * @return true if a fixed point form was found
+ */
+bool fit_fixed_point(ToneCurve& curve, double slope, double offset)
+{
+    curve.fixed_point = false;
+    if (!(slope >= 0 && slope < 1 && offset >= 0 && offset < 256))
+    {
+        return false;
+    }
+
+    // Truncating each step moves the sum by at most a couple of units, so a small window suffices
+    long base_slope = lround(slope * 65536);
+    long base_offset = lround(offset * 256);
+    for (long s = base_slope - 4; s <= base_slope + 4; s++)
+    {
+        for (long o = base_offset - 4; o <= base_offset + 4; o++)
+        {
+            if (s < 0 || s > 65535 || o < 0 || o > 65535)
+            {
+                continue;
+            }
+            int value = 0;
+            for (; value < 256; value++)
+            {
+                int sum = fixed_point_sum(value, s, o);
+                if (sum > 65535 || sum >> 8 != curve.table[value])
+                {
+                    break;
+                }
+            }
+            if (value == 256)
+            {
+                curve.fixed_point = true;
+                curve.slope = s;
+                curve.offset = o;
+                return true;
+            }
+        }
+    }
+    return false;
+}
+
+/**
+ * Compiles a per-channel function into a tone curve by evaluating it once for
+ * every channel value. Results are stored modulo 256, as write_image() does.
+ * @param curve Function from a channel value (0-255) to its new value
+ * @return the compiled tone curve
+ */
+ToneCurve compile_tone_curve(const function<int(int)>& curve)
+{
+    ToneCurve compiled;
+    for (int value = 0; value < 256; value++)
+    {
+        compiled.table[value] = curve(value);
+    }
+    compiled.fixed_point = false;
+    compiled.slope = 0;
+    compiled.offset = 0;
+    return compiled;
+}
+
+/**
+ * Builds a tone curve through the given control points, interpolating linearly
+ * between them and holding the end values outside them
+ * @param points (input, output) pairs sorted by input value
+ * @return the compiled tone curve (the identity if there are no points)
+ */
+ToneCurve piecewise_linear_curve(const vector<pair<int, int>>& points)
+{
+    return compile_tone_curve([&points](int value)
+    {
+        if (points.empty())
+        {
+            return value;
+        }
+        if (value <= points.front().first)
+        {
+            return points.front().second;
+        }
+        for (size_t i = 1; i < points.size(); i++)
+        {
+            if (value <= points[i].first)
+            {
+                double t = double(value - points[i - 1].first) / (points[i].first - points[i - 1].first);
+                return (int)lround(points[i - 1].second + t * (points[i].second - points[i - 1].second));
+            }
+        }
+        return points.back().second;
+    });
+}
+
+// Scaling curves the lighten, darken and clarendon filters are built from
+enum ToneCurveKind
+{
+    CURVE_LIGHTEN, // 255 - (255 - c) * scaling_factor
+    CURVE_DARKEN   // c * scaling_factor
+};
+
+/**
+ * Gets the tone curve for a scaling filter, compiling it on first use.
+ * Curves are cached per (kind, scaling factor) for the life of the program.
+ * @param kind           Which scaling curve
+ * @param scaling_factor The filter's scaling factor
+ * @return the compiled tone curve
+ */
+ToneCurve scaling_curve(ToneCurveKind kind, double scaling_factor)
+{
+    static map<pair<int, double>, ToneCurve> cache;
+    static mutex cache_mutex;
+
+    lock_guard<mutex> lock(cache_mutex);
+    pair<int, double> key(kind, scaling_factor);
+    map<pair<int, double>, ToneCurve>::iterator found = cache.find(key);
+    if (found != cache.end())
+    {
+        return found->second;
+    }
+
+    // Interactive and batch use only ever see a handful of factors; keep it that way
+    if (cache.size() >= 256)
+    {
+        cache.clear();
+    }
+
+    ToneCurve curve;
+    if (kind == CURVE_LIGHTEN)
+    {
+        curve = compile_tone_curve([scaling_factor](int c) { return (int)(255 - ((255 - c) * scaling_factor)); });
+        fit_fixed_point(curve, scaling_factor, 255 * (1 - scaling_factor));
+    }
+    else
+    {
+        curve = compile_tone_curve([scaling_factor](int c) { return (int)(c * scaling_factor); });
+        fit_fixed_point(curve, scaling_factor, 0);
+    }
+    cache[key] = curve;
+    return curve;
+}
+
+// Instruction sets the point filter kernels can use, from slowest to fastest
+enum SimdLevel
+{
+    SIMD_SCALAR,
+    SIMD_SSSE3,
+    SIMD_AVX2
+};
+
+// Row kernels behind the point filters. Each one works on interleaved BGR
+// bytes and may run in place (src == dst).
+struct PointKernels
+{
+    void (*tone_curve)(const unsigned char* src, unsigned char* dst, int bytes, const ToneCurve& curve);
+    void (*grayscale)(const unsigned char* src, unsigned char* dst, int pixels);
+    void (*high_contrast)(const unsigned char* src, unsigned char* dst, int pixels);
+    void (*clarendon)(const unsigned char* src, unsigned char* dst, int pixels, const ToneCurve& light, const ToneCurve& dark);
+    void (*five_color)(const unsigned char* src, unsigned char* dst, int pixels);
+
+    // Not a point filter, but picked the same way: the vertical pass of resize_image()
+    void (*resample_vertical)(const unsigned char* const* rows, const short* weights, int taps, unsigned char* dst, int first, int last);
+};
+
+// Maps every byte through a tone curve
+void tone_curve_scalar(const unsigned char* src, unsigned char* dst, int bytes, const ToneCurve& curve)
+{
+    for (int i = 0; i < bytes; i++)
+    {
+        dst[i] = curve.table[src[i]];
+    }
+}
+
+// Sets every channel to the average of the pixel's channels
+void grayscale_scalar(const unsigned char* src, unsigned char* dst, int pixels)
+{
+    for (int p = 0; p < pixels; p++)
+    {
+        int gray_value = (src[0] + src[1] + src[2]) / 3;
+        dst[0] = gray_value;
+        dst[1] = gray_value;
+        dst[2] = gray_value;
+        src += 3;
+        dst += 3;
+    }
+}
+
+// Sets every pixel to white if its gray value is at least 127, black otherwise
+void high_contrast_scalar(const unsigned char* src, unsigned char* dst, int pixels)
+{
+    for (int p = 0; p < pixels; p++)
+    {
+        int gray_value = (src[0] + src[1] + src[2]) / 3;
+        int value = 0;
+        if (gray_value >= 255 / 2)
+        {
+            value = 255;
+        }
+        dst[0] = value;
+        dst[1] = value;
+        dst[2] = value;
+        src += 3;
+        dst += 3;
+    }
+}
+
+// Reduces every pixel to black, white, red, green or blue (the five colour filter)
+void five_color_scalar(const unsigned char* src, unsigned char* dst, int pixels)
+{
+    for (int p = 0; p < pixels; p++)
+    {
+        int blue_color = src[0];
+        int green_color = src[1];
+        int red_color = src[2];
+
+        // Get max/largest color number
+        int max_color = red_color;
+        if (green_color > max_color)
+        {
+            max_color = green_color;
+        }
+        if (blue_color > max_color)
+        {
+            max_color = blue_color;
+        }
+
+        // Set the blue, green and red color values at each pixel location
+        int sum = red_color + green_color + blue_color;
+        if (sum >= 550)
+        {
+            dst[0] = 255;
+            dst[1] = 255;
+            dst[2] = 255;
+        }
+        else if (sum <= 150)
+        {
+            dst[0] = 0;
+            dst[1] = 0;
+            dst[2] = 0;
+        }
+        else if (max_color == red_color)
+        {
+            dst[0] = 0;
+            dst[1] = 0;
+            dst[2] = 255;
+        }
+        else if (max_color == green_color)
+        {
+            dst[0] = 0;
+            dst[1] = 255;
+            dst[2] = 0;
+        }
+        else
+        {
+            dst[0] = 255;
+            dst[1] = 0;
+            dst[2] = 0;
+        }
+        src += 3;
+        dst += 3;
+    }
+}
+
+// Maps light pixels through one curve and dark pixels through another, leaving the middle band alone
+void clarendon_scalar(const unsigned char* src, unsigned char* dst, int pixels, const ToneCurve& light, const ToneCurve& dark)
+{
+    static const ToneCurve identity = compile_tone_curve([](int value) { return value; });
+
+    // Picking the table by band instead of branching keeps the loop free of mispredictions
+    const unsigned char* tables[3] = {identity.table, light.table, dark.table};
+    for (int p = 0; p < pixels; p++)
+    {
+        int average_value = (src[0] + src[1] + src[2]) / 3;
+        int band = (average_value >= 170) | (average_value < 90) << 1;
+        const unsigned char* table = tables[band];
+        dst[0] = table[src[0]];
+        dst[1] = table[src[1]];
+        dst[2] = table[src[2]];
+        src += 3;
+        dst += 3;
+    }
+}
+
+// Fractional bits of the resampling weights
+const int RESAMPLE_SHIFT = 14;
+
+// Clamps a resampled value to a byte
+inline unsigned char clamp_byte(int value)
+{
+    return value < 0 ? 0 : value > 255 ? 255 : value;
+}
+
+// Blends bytes first to last - 1 of several source rows into dst, one weight per row
+void resample_vertical_scalar(const unsigned char* const* rows, const short* weights, int taps, unsigned char* dst, int first, int last)
+{
+    for (int i = first; i < last; i++)
+    {
+        int sum = 1 << (RESAMPLE_SHIFT - 1);
+        for (int t = 0; t < taps; t++)
+        {
+            sum += rows[t][i] * weights[t];
+        }
+        dst[i] = clamp_byte(sum >> RESAMPLE_SHIFT);
+    }
+}
+
+#ifdef IMAGE_EDITOR_X86_SIMD
+
+// pshufb masks that split 16 interleaved BGR pixels (three 16 byte blocks)
+// into one register per channel, and spread one byte per pixel back out
+struct ShuffleMasks
+{
+    unsigned char split[3][3][16]; // [channel][block]
+    unsigned char spread[3][16];   // [block]
+    unsigned char merge[3][3][16]; // [channel][block], the inverse of split
+};
+
+ShuffleMasks build_shuffle_masks()
+{
+    ShuffleMasks masks;
+    for (int block = 0; block < 3; block++)
+    {
+        for (int i = 0; i < 16; i++)
+        {
+            for (int channel = 0; channel < 3; channel++)
+            {
+                // Byte i of a channel register comes from interleaved byte 3 * i + channel
+                int source = 3 * i + channel - 16 * block;
+                masks.split[channel][block][i] = (source >= 0 && source < 16) ? source : 0x80;
+            }
+            // Interleaved byte 16 * block + i belongs to pixel (16 * block + i) / 3
+            masks.spread[block][i] = (16 * block + i) / 3;
+            for (int channel = 0; channel < 3; channel++)
+            {
+                masks.merge[channel][block][i] = (16 * block + i) % 3 == channel ? (16 * block + i) / 3 : 0x80;
+            }
+        }
+    }
+    return masks;
+}
+
+inline const ShuffleMasks& shuffle_masks()
+{
+    static const ShuffleMasks masks = build_shuffle_masks();
+    return masks;
+}
+
+// Splits 16 interleaved pixels into one register per channel (blue, green, red)
+__attribute__((target("ssse3")))
+inline void split_channels_ssse3(const __m128i block[3], __m128i channels[3])
+{
+    const ShuffleMasks& masks = shuffle_masks();
+    for (int channel = 0; channel < 3; channel++)
+    {
+        channels[channel] = _mm_setzero_si128();
+        for (int b = 0; b < 3; b++)
+        {
+            __m128i mask = _mm_loadu_si128((const __m128i*)masks.split[channel][b]);
+            channels[channel] = _mm_or_si128(channels[channel], _mm_shuffle_epi8(block[b], mask));
+        }
+    }
+}
+
+// Interleaves one register per channel back into 16 pixels
+__attribute__((target("ssse3")))
+inline void merge_channels_ssse3(const __m128i channels[3], __m128i block[3])
+{
+    const ShuffleMasks& masks = shuffle_masks();
+    for (int b = 0; b < 3; b++)
+    {
+        block[b] = _mm_setzero_si128();
+        for (int channel = 0; channel < 3; channel++)
+        {
+            __m128i mask = _mm_loadu_si128((const __m128i*)masks.merge[channel][b]);
+            block[b] = _mm_or_si128(block[b], _mm_shuffle_epi8(channels[channel], mask));
+        }
+    }
+}
+
+// Returns the per-pixel channel sums of 16 pixels as two vectors of 8 16-bit sums
+__attribute__((target("ssse3")))
+inline void pixel_sums_ssse3(const __m128i block[3], __m128i& sum_lo, __m128i& sum_hi)
+{
+    __m128i zero = _mm_setzero_si128();
+    __m128i channels[3];
+    split_channels_ssse3(block, channels);
+    sum_lo = zero;
+    sum_hi = zero;
+    for (int channel = 0; channel < 3; channel++)
+    {
+        sum_lo = _mm_add_epi16(sum_lo, _mm_unpacklo_epi8(channels[channel], zero));
+        sum_hi = _mm_add_epi16(sum_hi, _mm_unpackhi_epi8(channels[channel], zero));
+    }
+}
+
+// Copies one byte per pixel to all three channels of 16 pixels
+__attribute__((target("ssse3")))
+inline void spread_ssse3(__m128i per_pixel, __m128i block[3])
+{
+    const ShuffleMasks& masks = shuffle_masks();
+    for (int b = 0; b < 3; b++)
+    {
+        block[b] = _mm_shuffle_epi8(per_pixel, _mm_loadu_si128((const __m128i*)masks.spread[b]));
+    }
+}
+
+__attribute__((target("ssse3")))
+void grayscale_ssse3(const unsigned char* src, unsigned char* dst, int pixels)
+{
+    // floor(sum / 3) == (sum * 0xAAAB) >> 17 for every sum of three bytes
+    __m128i third = _mm_set1_epi16((short)0xAAAB);
+    int p = 0;
+    for (; p + 16 <= pixels; p += 16)
+    {
+        __m128i block[3];
+        for (int b = 0; b < 3; b++)
+        {
+            block[b] = _mm_loadu_si128((const __m128i*)(src + 3 * p + 16 * b));
+        }
+        __m128i sum_lo, sum_hi;
+        pixel_sums_ssse3(block, sum_lo, sum_hi);
+        __m128i gray_lo = _mm_srli_epi16(_mm_mulhi_epu16(sum_lo, third), 1);
+        __m128i gray_hi = _mm_srli_epi16(_mm_mulhi_epu16(sum_hi, third), 1);
+        spread_ssse3(_mm_packus_epi16(gray_lo, gray_hi), block);
+        for (int b = 0; b < 3; b++)
+        {
+            _mm_storeu_si128((__m128i*)(dst + 3 * p + 16 * b), block[b]);
+        }
+    }
+    grayscale_scalar(src + 3 * p, dst + 3 * p, pixels - p);
+}
+
+__attribute__((target("ssse3")))
+void high_contrast_ssse3(const unsigned char* src, unsigned char* dst, int pixels)
+{
+    // sum / 3 >= 127 exactly when sum > 380
+    __m128i limit = _mm_set1_epi16(380);
+    int p = 0;
+    for (; p + 16 <= pixels; p += 16)
+    {
+        __m128i block[3];
+        for (int b = 0; b < 3; b++)
+        {
+            block[b] = _mm_loadu_si128((const __m128i*)(src + 3 * p + 16 * b));
+        }
+        __m128i sum_lo, sum_hi;
+        pixel_sums_ssse3(block, sum_lo, sum_hi);
+        __m128i white = _mm_packs_epi16(_mm_cmpgt_epi16(sum_lo, limit), _mm_cmpgt_epi16(sum_hi, limit));
+        spread_ssse3(white, block);
+        for (int b = 0; b < 3; b++)
+        {
+            _mm_storeu_si128((__m128i*)(dst + 3 * p + 16 * b), block[b]);
+        }
+    }
+    high_contrast_scalar(src + 3 * p, dst + 3 * p, pixels - p);
+}
+
+__attribute__((target("ssse3")))
+void five_color_ssse3(const unsigned char* src, unsigned char* dst, int pixels)
+{
+    // The branches of five_color_scalar() as masks: white when the sum is at
+    // least 550, black when it is at most 150, otherwise the largest channel,
+    // red winning ties and then green
+    __m128i zero = _mm_setzero_si128();
+    __m128i white_limit = _mm_set1_epi16(549);
+    __m128i black_limit = _mm_set1_epi16(151);
+    int p = 0;
+    for (; p + 16 <= pixels; p += 16)
+    {
+        __m128i block[3];
+        for (int b = 0; b < 3; b++)
+        {
+            block[b] = _mm_loadu_si128((const __m128i*)(src + 3 * p + 16 * b));
+        }
+        __m128i channels[3];
+        split_channels_ssse3(block, channels);
+        __m128i sum_lo = zero, sum_hi = zero;
+        for (int channel = 0; channel < 3; channel++)
+        {
+            sum_lo = _mm_add_epi16(sum_lo, _mm_unpacklo_epi8(channels[channel], zero));
+            sum_hi = _mm_add_epi16(sum_hi, _mm_unpackhi_epi8(channels[channel], zero));
+        }
+        __m128i white = _mm_packs_epi16(_mm_cmpgt_epi16(sum_lo, white_limit), _mm_cmpgt_epi16(sum_hi, white_limit));
+        __m128i black = _mm_packs_epi16(_mm_cmplt_epi16(sum_lo, black_limit), _mm_cmplt_epi16(sum_hi, black_limit));
+        __m128i colored = _mm_andnot_si128(_mm_or_si128(white, black), _mm_cmpeq_epi8(zero, zero));
+        __m128i largest = _mm_max_epu8(_mm_max_epu8(channels[0], channels[1]), channels[2]);
+        __m128i red = _mm_and_si128(_mm_cmpeq_epi8(channels[2], largest), colored);
+        __m128i green = _mm_andnot_si128(red, _mm_and_si128(_mm_cmpeq_epi8(channels[1], largest), colored));
+        __m128i blue = _mm_andnot_si128(_mm_or_si128(red, green), colored);
+        channels[0] = _mm_or_si128(white, blue);
+        channels[1] = _mm_or_si128(white, green);
+        channels[2] = _mm_or_si128(white, red);
+        merge_channels_ssse3(channels, block);
+        for (int b = 0; b < 3; b++)
+        {
+            _mm_storeu_si128((__m128i*)(dst + 3 * p + 16 * b), block[b]);
+        }
+    }
+    five_color_scalar(src + 3 * p, dst + 3 * p, pixels - p);
+}
+
+// Applies a fixed point tone curve (see fixed_point_sum) to 16 bytes
+__attribute__((target("ssse3")))
+inline __m128i fixed_point_curve_ssse3(__m128i bytes, __m128i slope, __m128i offset)
+{
+    // Unpacking under zero puts each byte in the high half, value * 256, ready for the Q0.16 multiply
+    __m128i zero = _mm_setzero_si128();
+    __m128i lo = _mm_add_epi16(_mm_mulhi_epu16(_mm_unpacklo_epi8(zero, bytes), slope), offset);
+    __m128i hi = _mm_add_epi16(_mm_mulhi_epu16(_mm_unpackhi_epi8(zero, bytes), slope), offset);
+    return _mm_packus_epi16(_mm_srli_epi16(lo, 8), _mm_srli_epi16(hi, 8));
+}
+
+__attribute__((target("ssse3")))
+void tone_curve_ssse3(const unsigned char* src, unsigned char* dst, int bytes, const ToneCurve& curve)
+{
+    if (!curve.fixed_point)
+    {
+        tone_curve_scalar(src, dst, bytes, curve);
+        return;
+    }
+    __m128i slope = _mm_set1_epi16((short)curve.slope);
+    __m128i offset = _mm_set1_epi16((short)curve.offset);
+    int i = 0;
+    for (; i + 16 <= bytes; i += 16)
+    {
+        __m128i values = _mm_loadu_si128((const __m128i*)(src + i));
+        _mm_storeu_si128((__m128i*)(dst + i), fixed_point_curve_ssse3(values, slope, offset));
+    }
+    tone_curve_scalar(src + i, dst + i, bytes - i, curve);
+}
+
+__attribute__((target("ssse3")))
+void clarendon_ssse3(const unsigned char* src, unsigned char* dst, int pixels, const ToneCurve& light, const ToneCurve& dark)
+{
+    if (!light.fixed_point || !dark.fixed_point)
+    {
+        clarendon_scalar(src, dst, pixels, light, dark);
+        return;
+    }
+    __m128i light_slope = _mm_set1_epi16((short)light.slope);
+    __m128i light_offset = _mm_set1_epi16((short)light.offset);
+    __m128i dark_slope = _mm_set1_epi16((short)dark.slope);
+    __m128i dark_offset = _mm_set1_epi16((short)dark.offset);
+
+    // sum / 3 >= 170 exactly when sum > 509, and sum / 3 < 90 exactly when sum < 270
+    __m128i light_limit = _mm_set1_epi16(509);
+    __m128i dark_limit = _mm_set1_epi16(270);
+    int p = 0;
+    for (; p + 16 <= pixels; p += 16)
+    {
+        __m128i block[3];
+        for (int b = 0; b < 3; b++)
+        {
+            block[b] = _mm_loadu_si128((const __m128i*)(src + 3 * p + 16 * b));
+        }
+        __m128i sum_lo, sum_hi;
+        pixel_sums_ssse3(block, sum_lo, sum_hi);
+        __m128i light_mask[3], dark_mask[3];
+        spread_ssse3(_mm_packs_epi16(_mm_cmpgt_epi16(sum_lo, light_limit), _mm_cmpgt_epi16(sum_hi, light_limit)), light_mask);
+        spread_ssse3(_mm_packs_epi16(_mm_cmplt_epi16(sum_lo, dark_limit), _mm_cmplt_epi16(sum_hi, dark_limit)), dark_mask);
+        for (int b = 0; b < 3; b++)
+        {
+            __m128i lighter = fixed_point_curve_ssse3(block[b], light_slope, light_offset);
+            __m128i darker = fixed_point_curve_ssse3(block[b], dark_slope, dark_offset);
+            __m128i middle = _mm_andnot_si128(_mm_or_si128(light_mask[b], dark_mask[b]), block[b]);
+            __m128i result = _mm_or_si128(middle, _mm_or_si128(_mm_and_si128(light_mask[b], lighter), _mm_and_si128(dark_mask[b], darker)));
+            _mm_storeu_si128((__m128i*)(dst + 3 * p + 16 * b), result);
+        }
+    }
+    clarendon_scalar(src + 3 * p, dst + 3 * p, pixels - p, light, dark);
+}
+
+// Packs two neighbouring resampling weights into each 32-bit lane for pmaddwd
+inline int weight_pair(const short* weights, int t, int taps)
+{
+    unsigned int second = t + 1 < taps ? (unsigned short)weights[t + 1] : 0;
+    return (int)((unsigned short)weights[t] | second << 16);
+}
+
+__attribute__((target("ssse3")))
+void resample_vertical_ssse3(const unsigned char* const* rows, const short* weights, int taps, unsigned char* dst, int first, int last)
+{
+    __m128i zero = _mm_setzero_si128();
+    int i = first;
+    for (; i + 8 <= last; i += 8)
+    {
+        __m128i sum_lo = _mm_set1_epi32(1 << (RESAMPLE_SHIFT - 1));
+        __m128i sum_hi = sum_lo;
+        for (int t = 0; t < taps; t += 2)
+        {
+            // Interleave two source rows so one multiply-add applies both of their weights
+            __m128i a = _mm_unpacklo_epi8(_mm_loadl_epi64((const __m128i*)(rows[t] + i)), zero);
+            __m128i b = t + 1 < taps ? _mm_unpacklo_epi8(_mm_loadl_epi64((const __m128i*)(rows[t + 1] + i)), zero) : zero;
+            __m128i pair = _mm_set1_epi32(weight_pair(weights, t, taps));
+            sum_lo = _mm_add_epi32(sum_lo, _mm_madd_epi16(_mm_unpacklo_epi16(a, b), pair));
+            sum_hi = _mm_add_epi32(sum_hi, _mm_madd_epi16(_mm_unpackhi_epi16(a, b), pair));
+        }
+        __m128i words = _mm_packs_epi32(_mm_srai_epi32(sum_lo, RESAMPLE_SHIFT), _mm_srai_epi32(sum_hi, RESAMPLE_SHIFT));
+        _mm_storel_epi64((__m128i*)(dst + i), _mm_packus_epi16(words, words));
+    }
+    resample_vertical_scalar(rows, weights, taps, dst, i, last);
+}
+
+// The AVX2 kernels handle 32 pixels at a time: pixels 0-15 in the low 128-bit
+// lanes and pixels 16-31 in the high lanes, so the in-lane shuffles above apply unchanged
+
+// Loads 32 pixels as three registers, pixels 16-31 going to the high lanes
+__attribute__((target("avx2")))
+inline void load_pixels_avx2(const unsigned char* src, __m256i block[3])
+{
+    for (int b = 0; b < 3; b++)
+    {
+        __m128i low = _mm_loadu_si128((const __m128i*)(src + 16 * b));
+        __m128i high = _mm_loadu_si128((const __m128i*)(src + 48 + 16 * b));
+        block[b] = _mm256_inserti128_si256(_mm256_castsi128_si256(low), high, 1);
+    }
+}
+
+// Stores 32 pixels loaded by load_pixels_avx2()
+__attribute__((target("avx2")))
+inline void store_pixels_avx2(unsigned char* dst, const __m256i block[3])
+{
+    for (int b = 0; b < 3; b++)
+    {
+        _mm_storeu_si128((__m128i*)(dst + 16 * b), _mm256_castsi256_si128(block[b]));
+        _mm_storeu_si128((__m128i*)(dst + 48 + 16 * b), _mm256_extracti128_si256(block[b], 1));
+    }
+}
+
+__attribute__((target("avx2")))
+inline __m256i load_mask_avx2(const unsigned char mask[16])
+{
+    return _mm256_broadcastsi128_si256(_mm_loadu_si128((const __m128i*)mask));
+}
+
+__attribute__((target("avx2")))
+inline void split_channels_avx2(const __m256i block[3], __m256i channels[3])
+{
+    const ShuffleMasks& masks = shuffle_masks();
+    for (int channel = 0; channel < 3; channel++)
+    {
+        channels[channel] = _mm256_setzero_si256();
+        for (int b = 0; b < 3; b++)
+        {
+            channels[channel] = _mm256_or_si256(channels[channel], _mm256_shuffle_epi8(block[b], load_mask_avx2(masks.split[channel][b])));
+        }
+    }
+}
+
+__attribute__((target("avx2")))
+inline void merge_channels_avx2(const __m256i channels[3], __m256i block[3])
+{
+    const ShuffleMasks& masks = shuffle_masks();
+    for (int b = 0; b < 3; b++)
+    {
+        block[b] = _mm256_setzero_si256();
+        for (int channel = 0; channel < 3; channel++)
+        {
+            block[b] = _mm256_or_si256(block[b], _mm256_shuffle_epi8(channels[channel], load_mask_avx2(masks.merge[channel][b])));
+        }
+    }
+}
+
+__attribute__((target("avx2")))
+inline void pixel_sums_avx2(const __m256i block[3], __m256i& sum_lo, __m256i& sum_hi)
+{
+    __m256i zero = _mm256_setzero_si256();
+    __m256i channels[3];
+    split_channels_avx2(block, channels);
+    sum_lo = zero;
+    sum_hi = zero;
+    for (int channel = 0; channel < 3; channel++)
+    {
+        sum_lo = _mm256_add_epi16(sum_lo, _mm256_unpacklo_epi8(channels[channel], zero));
+        sum_hi = _mm256_add_epi16(sum_hi, _mm256_unpackhi_epi8(channels[channel], zero));
+    }
+}
+
+__attribute__((target("avx2")))
+inline void spread_avx2(__m256i per_pixel, __m256i block[3])
+{
+    const ShuffleMasks& masks = shuffle_masks();
+    for (int b = 0; b < 3; b++)
+    {
+        block[b] = _mm256_shuffle_epi8(per_pixel, load_mask_avx2(masks.spread[b]));
+    }
+}
+
+__attribute__((target("avx2")))
+void grayscale_avx2(const unsigned char* src, unsigned char* dst, int pixels)
+{
+    __m256i third = _mm256_set1_epi16((short)0xAAAB);
+    int p = 0;
+    for (; p + 32 <= pixels; p += 32)
+    {
+        __m256i block[3];
+        load_pixels_avx2(src + 3 * p, block);
+        __m256i sum_lo, sum_hi;
+        pixel_sums_avx2(block, sum_lo, sum_hi);
+        __m256i gray_lo = _mm256_srli_epi16(_mm256_mulhi_epu16(sum_lo, third), 1);
+        __m256i gray_hi = _mm256_srli_epi16(_mm256_mulhi_epu16(sum_hi, third), 1);
+        spread_avx2(_mm256_packus_epi16(gray_lo, gray_hi), block);
+        store_pixels_avx2(dst + 3 * p, block);
+    }
+    grayscale_ssse3(src + 3 * p, dst + 3 * p, pixels - p);
+}
+
+__attribute__((target("avx2")))
+void high_contrast_avx2(const unsigned char* src, unsigned char* dst, int pixels)
+{
+    __m256i limit = _mm256_set1_epi16(380);
+    int p = 0;
+    for (; p + 32 <= pixels; p += 32)
+    {
+        __m256i block[3];
+        load_pixels_avx2(src + 3 * p, block);
+        __m256i sum_lo, sum_hi;
+        pixel_sums_avx2(block, sum_lo, sum_hi);
+        __m256i white = _mm256_packs_epi16(_mm256_cmpgt_epi16(sum_lo, limit), _mm256_cmpgt_epi16(sum_hi, limit));
+        spread_avx2(white, block);
+        store_pixels_avx2(dst + 3 * p, block);
+    }
+    high_contrast_ssse3(src + 3 * p, dst + 3 * p, pixels - p);
+}
+
+__attribute__((target("avx2")))
+void five_color_avx2(const unsigned char* src, unsigned char* dst, int pixels)
+{
+    __m256i zero = _mm256_setzero_si256();
+    __m256i white_limit = _mm256_set1_epi16(549);
+    __m256i black_limit = _mm256_set1_epi16(151);
+    int p = 0;
+    for (; p + 32 <= pixels; p += 32)
+    {
+        __m256i block[3];
+        load_pixels_avx2(src + 3 * p, block);
+        __m256i channels[3];
+        split_channels_avx2(block, channels);
+        __m256i sum_lo = zero, sum_hi = zero;
+        for (int channel = 0; channel < 3; channel++)
+        {
+            sum_lo = _mm256_add_epi16(sum_lo, _mm256_unpacklo_epi8(channels[channel], zero));
+            sum_hi = _mm256_add_epi16(sum_hi, _mm256_unpackhi_epi8(channels[channel], zero));
+        }
+        __m256i white = _mm256_packs_epi16(_mm256_cmpgt_epi16(sum_lo, white_limit), _mm256_cmpgt_epi16(sum_hi, white_limit));
+        __m256i black = _mm256_packs_epi16(_mm256_cmpgt_epi16(black_limit, sum_lo), _mm256_cmpgt_epi16(black_limit, sum_hi));
+        __m256i colored = _mm256_andnot_si256(_mm256_or_si256(white, black), _mm256_cmpeq_epi8(zero, zero));
+        __m256i largest = _mm256_max_epu8(_mm256_max_epu8(channels[0], channels[1]), channels[2]);
+        __m256i red = _mm256_and_si256(_mm256_cmpeq_epi8(channels[2], largest), colored);
+        __m256i green = _mm256_andnot_si256(red, _mm256_and_si256(_mm256_cmpeq_epi8(channels[1], largest), colored));
+        __m256i blue = _mm256_andnot_si256(_mm256_or_si256(red, green), colored);
+        channels[0] = _mm256_or_si256(white, blue);
+        channels[1] = _mm256_or_si256(white, green);
+        channels[2] = _mm256_or_si256(white, red);
+        merge_channels_avx2(channels, block);
+        store_pixels_avx2(dst + 3 * p, block);
+    }
+    five_color_ssse3(src + 3 * p, dst + 3 * p, pixels - p);
+}
+
+__attribute__((target("avx2")))
+inline __m256i fixed_point_curve_avx2(__m256i bytes, __m256i slope, __m256i offset)
+{
+    __m256i zero = _mm256_setzero_si256();
+    __m256i lo = _mm256_add_epi16(_mm256_mulhi_epu16(_mm256_unpacklo_epi8(zero, bytes), slope), offset);
+    __m256i hi = _mm256_add_epi16(_mm256_mulhi_epu16(_mm256_unpackhi_epi8(zero, bytes), slope), offset);
+    return _mm256_packus_epi16(_mm256_srli_epi16(lo, 8), _mm256_srli_epi16(hi, 8));
+}
+
+__attribute__((target("avx2")))
+void tone_curve_avx2(const unsigned char* src, unsigned char* dst, int bytes, const ToneCurve& curve)
+{
+    if (!curve.fixed_point)
+    {
+        tone_curve_scalar(src, dst, bytes, curve);
+        return;
+    }
+    __m256i slope = _mm256_set1_epi16((short)curve.slope);
+    __m256i offset = _mm256_set1_epi16((short)curve.offset);
+    int i = 0;
+    for (; i + 32 <= bytes; i += 32)
+    {
+        __m256i values = _mm256_loadu_si256((const __m256i*)(src + i));
+        _mm256_storeu_si256((__m256i*)(dst + i), fixed_point_curve_avx2(values, slope, offset));
+    }
+    tone_curve_ssse3(src + i, dst + i, bytes - i, curve);
+}
+
+__attribute__((target("avx2")))
+void clarendon_avx2(const unsigned char* src, unsigned char* dst, int pixels, const ToneCurve& light, const ToneCurve& dark)
+{
+    if (!light.fixed_point || !dark.fixed_point)
+    {
+        clarendon_scalar(src, dst, pixels, light, dark);
+        return;
+    }
+    __m256i light_slope = _mm256_set1_epi16((short)light.slope);
+    __m256i light_offset = _mm256_set1_epi16((short)light.offset);
+    __m256i dark_slope = _mm256_set1_epi16((short)dark.slope);
+    __m256i dark_offset = _mm256_set1_epi16((short)dark.offset);
+    __m256i light_limit = _mm256_set1_epi16(509);
+    __m256i dark_limit = _mm256_set1_epi16(270);
+    int p = 0;
+    for (; p + 32 <= pixels; p += 32)
+    {
+        __m256i block[3];
+        load_pixels_avx2(src + 3 * p, block);
+        __m256i sum_lo, sum_hi;
+        pixel_sums_avx2(block, sum_lo, sum_hi);
+        __m256i light_mask[3], dark_mask[3];
+        spread_avx2(_mm256_packs_epi16(_mm256_cmpgt_epi16(sum_lo, light_limit), _mm256_cmpgt_epi16(sum_hi, light_limit)), light_mask);
+        spread_avx2(_mm256_packs_epi16(_mm256_cmpgt_epi16(dark_limit, sum_lo), _mm256_cmpgt_epi16(dark_limit, sum_hi)), dark_mask);
+        for (int b = 0; b < 3; b++)
+        {
+            __m256i lighter = fixed_point_curve_avx2(block[b], light_slope, light_offset);
+            __m256i darker = fixed_point_curve_avx2(block[b], dark_slope, dark_offset);
+            __m256i middle = _mm256_andnot_si256(_mm256_or_si256(light_mask[b], dark_mask[b]), block[b]);
+            block[b] = _mm256_or_si256(middle, _mm256_or_si256(_mm256_and_si256(light_mask[b], lighter), _mm256_and_si256(dark_mask[b], darker)));
+        }
+        store_pixels_avx2(dst + 3 * p, block);
+    }
+    clarendon_ssse3(src + 3 * p, dst + 3 * p, pixels - p, light, dark);
+}
+
+__attribute__((target("avx2")))
+void resample_vertical_avx2(const unsigned char* const* rows, const short* weights, int taps, unsigned char* dst, int first, int last)
+{
+    int i = first;
+    for (; i + 16 <= last; i += 16)
+    {
+        // Bytes 0-7 widen into the low lane and 8-15 into the high lane
+        __m256i sum_lo = _mm256_set1_epi32(1 << (RESAMPLE_SHIFT - 1));
+        __m256i sum_hi = sum_lo;
+        for (int t = 0; t < taps; t += 2)
+        {
+            __m256i a = _mm256_cvtepu8_epi16(_mm_loadu_si128((const __m128i*)(rows[t] + i)));
+            __m256i b = t + 1 < taps ? _mm256_cvtepu8_epi16(_mm_loadu_si128((const __m128i*)(rows[t + 1] + i))) : _mm256_setzero_si256();
+            __m256i pair = _mm256_set1_epi32(weight_pair(weights, t, taps));
+            sum_lo = _mm256_add_epi32(sum_lo, _mm256_madd_epi16(_mm256_unpacklo_epi16(a, b), pair));
+            sum_hi = _mm256_add_epi32(sum_hi, _mm256_madd_epi16(_mm256_unpackhi_epi16(a, b), pair));
+        }
+        __m256i words = _mm256_packs_epi32(_mm256_srai_epi32(sum_lo, RESAMPLE_SHIFT), _mm256_srai_epi32(sum_hi, RESAMPLE_SHIFT));
+        __m256i packed = _mm256_permute4x64_epi64(_mm256_packus_epi16(words, words), 0x08);
+        _mm_storeu_si128((__m128i*)(dst + i), _mm256_castsi256_si128(packed));
+    }
+    resample_vertical_ssse3(rows, weights, taps, dst, i, last);
+}
+
+#endif
+
+/**
+ * Finds the best instruction set the point filter kernels can use on this CPU
+ * @return the detected SIMD level
+ */
+SimdLevel detect_simd_level()
+{
+#ifdef IMAGE_EDITOR_X86_SIMD
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2"))
+    {
+        return SIMD_AVX2;
+    }
+    if (__builtin_cpu_supports("ssse3"))
+    {
+        return SIMD_SSSE3;
+    }
+#endif
+    return SIMD_SCALAR;
+}
+
+/**
+ * Builds the kernel table for an instruction set
+ * @param level The SIMD level to use
+ * @return the point filter kernels for that level
+ */
+PointKernels make_point_kernels(SimdLevel level)
+{
+    // Table lookups stay scalar at every level: a 256 entry lookup built from
+    // pshufb needs 16 shuffles per vector and measured slower than plain loads.
+    // The SIMD curve kernels only vectorise curves with a fixed point form.
+    PointKernels kernels = {tone_curve_scalar, grayscale_scalar, high_contrast_scalar, clarendon_scalar, five_color_scalar,
+                            resample_vertical_scalar};
+#ifdef IMAGE_EDITOR_X86_SIMD
+    if (level >= SIMD_SSSE3)
+    {
+        kernels.tone_curve = tone_curve_ssse3;
+        kernels.grayscale = grayscale_ssse3;
+        kernels.high_contrast = high_contrast_ssse3;
+        kernels.clarendon = clarendon_ssse3;
+        kernels.five_color = five_color_ssse3;
+        kernels.resample_vertical = resample_vertical_ssse3;
+    }
+    if (level >= SIMD_AVX2)
+    {
+        kernels.tone_curve = tone_curve_avx2;
+        kernels.grayscale = grayscale_avx2;
+        kernels.high_contrast = high_contrast_avx2;
+        kernels.clarendon = clarendon_avx2;
+        kernels.five_color = five_color_avx2;
+        kernels.resample_vertical = resample_vertical_avx2;
+    }
+#else
+    (void)level;
+#endif
+    return kernels;
+}
+
+static SimdLevel active_simd_level = detect_simd_level();
+static PointKernels active_point_kernels = make_point_kernels(active_simd_level);
+
+/**
+ * Limits the point filter kernels to an instruction set (never above what the CPU supports)
+ * @param level The highest SIMD level to use
+ * @return the SIMD level now in use
+ */
+SimdLevel set_simd_level(SimdLevel level)
+{
+    active_simd_level = min(level, detect_simd_level());
+    active_point_kernels = make_point_kernels(active_simd_level);
+    return active_simd_level;
+}
+
+/**
+ * Gets the instruction set the point filter kernels use
+ * @return the active SIMD level
+ */
+inline SimdLevel simd_level()
+{
+    return active_simd_level;
+}
+
+/**
+ * Gets the point filter kernels picked for this CPU
+ * @return the active kernel table
+ */
+inline const PointKernels& point_kernels()
+{
+    return active_point_kernels;
+}
+
+/**
+ * Gets the vignette filter's brightness scale at one pixel, as the filter
+ * has always computed it (the centre is at column rows / 2, row cols / 2)
+ * @param row  Row of the pixel
+ * @param col  Column of the pixel
+ * @param rows Height of the image
+ * @param cols Width of the image
+ * @return the scale, 1 at the centre and falling off (past 0) with distance
+ */
+double vignette_scale(int row, int col, int rows, int cols)
+{
+    double distance = sqrt(pow((col - rows / 2), 2) + pow((row - cols / 2), 2));
+    return (cols - distance) / cols;
+}
+
+// Marks a mask weight that fixed point can't reproduce exactly
+const long long VIGNETTE_FALLBACK = LLONG_MIN;
+
+// Fractional bits of the mask weights; scales of 128 or more fall back to floating point
+const int VIGNETTE_SHIFT = 48;
+
+// Largest vignette mask built (about a 64 megapixel image); larger images compute each scale instead
+const size_t VIGNETTE_MASK_MAX_BYTES = (size_t)128 << 20;
+
+// Vignette scales for every pixel of one image size, as 16.48 fixed point.
+// The scale only depends on the horizontal and vertical distance to the
+// centre, so one quadrant of distances covers the whole image.
+struct VignetteMask
+{
+    int rows;
+    int cols;
+    int center_col;            // rows / 2
+    int center_row;            // cols / 2
+    int min_dx;                // Smallest horizontal distance to the centre in the image
+    int min_dy;                // Smallest vertical distance to the centre in the image
+    int mask_width;            // Number of horizontal distances
+    vector<long long> weights; // Indexed by (dy - min_dy) * mask_width + (dx - min_dx)
+};
+
+/**
+ * Scales one colour value by a fixed point weight, truncating towards zero
+ * like the (int) cast of the floating point filter
+ * @param value  Colour value (0 to 255)
+ * @param weight Scale in 16.48 fixed point
+ * @return the scaled value
+ */
+inline int vignette_channel(int value, long long weight)
+{
+    long long product = value * weight;
+    return product >= 0 ? (int)(product >> VIGNETTE_SHIFT) : -(int)((-product) >> VIGNETTE_SHIFT);
+}
+
+/**
+ * Finds the range of distances from positions 0 to size - 1 to a centre
+ * @param center   The centre position
+ * @param size     Number of positions
+ * @param min_dist Gets the smallest distance
+ * @param max_dist Gets the largest distance
+ * @return nothing
+ */
+void distance_range(int center, int size, int& min_dist, int& max_dist)
+{
+    min_dist = center >= size ? center - (size - 1) : 0;
+    max_dist = max(center, (size - 1) - center);
+}
+
+/**
+ * Builds the vignette mask for one image size. Each weight is the scale
+ * rounded up to 16.48 fixed point, which matches the floating point filter
+ * for every colour value unless value * scale lands almost exactly on a
+ * whole number. When the distance to the centre isn't a whole number that
+ * can't happen: value * scale is then at least 1 / (cols * (510 * distance + 1))
+ * away from one, far more than the rounding error for any sensible image
+ * size. The remaining weights are checked against all 255 colour values and
+ * the rare one that doesn't match is marked so the filter computes that
+ * pixel in floating point instead.
+ * @param rows Height of the image
+ * @param cols Width of the image
+ * @return the mask
+ */
+shared_ptr<VignetteMask> build_vignette_mask(int rows, int cols)
+{
+    shared_ptr<VignetteMask> mask = make_shared<VignetteMask>();
+    mask->rows = rows;
+    mask->cols = cols;
+    mask->center_col = rows / 2;
+    mask->center_row = cols / 2;
+    int max_dx, max_dy;
+    distance_range(mask->center_col, cols, mask->min_dx, max_dx);
+    distance_range(mask->center_row, rows, mask->min_dy, max_dy);
+    mask->mask_width = max_dx - mask->min_dx + 1;
+    int mask_height = max_dy - mask->min_dy + 1;
+    mask->weights.resize((size_t)mask->mask_width * mask_height);
+
+    // Worst case error of the fixed point and floating point products, against the smallest gap
+    double max_distance = sqrt((double)max_dx * max_dx + (double)max_dy * max_dy);
+    double max_scale = min(128.0, max(1.0, (max_distance - cols) / cols));
+    double error = ldexp(1.0, -40) + (1 + max_scale) * ldexp(1.0, -42);
+    bool check_all = 2 * error * cols * (510 * max_distance + 1) >= 1;
+
+    parallel_rows(mask_height, [&](int first_row, int last_row)
+    {
+        for (int y = first_row; y < last_row; y++)
+        {
+            long long* weights = &mask->weights[(size_t)y * mask->mask_width];
+            long long dy = mask->min_dy + y;
+            for (int x = 0; x < mask->mask_width; x++)
+            {
+                // Any pixel at this distance will do; pick the one right of and below the centre
+                long long dx = mask->min_dx + x;
+                double scale = vignette_scale(mask->center_row + (int)dy, mask->center_col + (int)dx, rows, cols);
+                if (fabs(scale) >= 128)
+                {
+                    weights[x] = VIGNETTE_FALLBACK;
+                    continue;
+                }
+                long long weight = (long long)ceil(ldexp(fabs(scale), VIGNETTE_SHIFT));
+                if (scale < 0)
+                {
+                    weight = -weight;
+                }
+
+                // Square roots of whole numbers this small are exact, or not whole
+                double distance = sqrt((double)(dx * dx + dy * dy));
+                if (check_all || distance == floor(distance))
+                {
+                    for (int value = 1; value < 256; value++)
+                    {
+                        if ((int)(value * scale) != vignette_channel(value, weight))
+                        {
+                            weight = VIGNETTE_FALLBACK;
+                            break;
+                        }
+                    }
+                }
+                weights[x] = weight;
+            }
+        }
+    });
+    return mask;
+}
+
+/**
+ * Works out how much memory the vignette mask for an image size takes
+ * @param rows Height of the image
+ * @param cols Width of the image
+ * @return the size of the mask's weights, in bytes
+ */
+size_t vignette_mask_bytes(int rows, int cols)
+{
+    // Same centre and distances as build_vignette_mask()
+    int min_dx, max_dx, min_dy, max_dy;
+    distance_range(rows / 2, cols, min_dx, max_dx);
+    distance_range(cols / 2, rows, min_dy, max_dy);
+    return (size_t)(max_dx - min_dx + 1) * (max_dy - min_dy + 1) * sizeof(long long);
+}
+
+/**
+ * Gets the vignette mask for an image size, building it on first use.
+ * Masks are cached, so a batch of same-sized images only builds one.
+ * @param rows Height of the image
+ * @param cols Width of the image
+ * @return the mask, or null if the image is too large for one (use vignette_span_unmasked())
+ */
+shared_ptr<const VignetteMask> vignette_mask(int rows, int cols)
+{
+    typedef shared_future<shared_ptr<const VignetteMask>> PendingMask;
+    static map<pair<int, int>, pair<PendingMask, size_t>> cache;
+    static mutex cache_mutex;
+
+    size_t bytes = vignette_mask_bytes(rows, cols);
+    if (bytes > VIGNETTE_MASK_MAX_BYTES)
+    {
+        return nullptr;
+    }
+
+    // The mask is built outside the lock; workers that need the same size wait for its future
+    pair<int, int> key(rows, cols);
+    promise<shared_ptr<const VignetteMask>> built;
+    PendingMask pending;
+    bool building = false;
+    {
+        lock_guard<mutex> lock(cache_mutex);
+        map<pair<int, int>, pair<PendingMask, size_t>>::iterator found = cache.find(key);
+        if (found != cache.end())
+        {
+            pending = found->second.first;
+        }
+        else
+        {
+            // A mask holds an 8 byte weight for about a quarter of the image's pixels;
+            // keep only a few, and only one once they get large
+            size_t cached_bytes = bytes;
+            for (found = cache.begin(); found != cache.end(); found++)
+            {
+                cached_bytes += found->second.second;
+            }
+            if (cache.size() >= 4 || cached_bytes > ((size_t)256 << 20))
+            {
+                cache.clear();
+            }
+            pending = built.get_future().share();
+            cache[key] = make_pair(pending, bytes);
+            building = true;
+        }
+    }
+    if (building)
+    {
+        try
+        {
+            built.set_value(build_vignette_mask(rows, cols));
+        }
+        catch (...)
+        {
+            // Waiting workers get the failure too, and the next call tries again
+            built.set_exception(current_exception());
+            lock_guard<mutex> lock(cache_mutex);
+            cache.erase(key);
+        }
+    }
+    return pending.get();
+}
+
+/**
+ * Darkens part of one row towards the image's corners like vignette_span(),
+ * computing each pixel's scale directly instead of reading the cached mask.
+ * Used where the mask, which grows with the image, would be too much memory.
+ * @param src       Interleaved source pixels, starting at column first_col
+ * @param dst       Interleaved destination pixels (may be src)
+ * @param row       Index of the row in the image
+ * @param rows      Height of the image
+ * @param cols      Width of the image
+ * @param first_col First column to darken
+ * @param last_col  One past the last column to darken
+ * @return nothing
+ */
+void vignette_span_unmasked(const unsigned char* src, unsigned char* dst, int row, int rows, int cols, int first_col, int last_col)
+{
+    for (int col = first_col; col < last_col; col++)
+    {
+        double scaling_factor = vignette_scale(row, col, rows, cols);
+        dst[0] = (int)(src[0] * scaling_factor);
+        dst[1] = (int)(src[1] * scaling_factor);
+        dst[2] = (int)(src[2] * scaling_factor);
+        src += 3;
+        dst += 3;
+    }
+}
+
+/**
+ * Darkens part of one row of an image towards the image's corners (the vignette filter)
+ * @param src       Interleaved source pixels, starting at column first_col
+ * @param dst       Interleaved destination pixels (may be src)
+ * @param row       Index of the row in the image
+ * @param first_col First column to darken
+ * @param last_col  One past the last column to darken
+ * @param mask      The vignette mask for the image's size
+ * @return nothing
+ */
+void vignette_span(const unsigned char* src, unsigned char* dst, int row, int first_col, int last_col, const VignetteMask& mask)
+{
+    const long long* weights = &mask.weights[(size_t)(abs(row - mask.center_row) - mask.min_dy) * mask.mask_width];
+    for (int col = first_col; col < last_col; col++)
+    {
+        long long weight = weights[abs(col - mask.center_col) - mask.min_dx];
+        if (weight == VIGNETTE_FALLBACK)
+        {
+            double scaling_factor = vignette_scale(row, col, mask.rows, mask.cols);
+            dst[0] = (int)(src[0] * scaling_factor);
+            dst[1] = (int)(src[1] * scaling_factor);
+            dst[2] = (int)(src[2] * scaling_factor);
+        }
+        else
+        {
+            // Set the blue, green and red color values at each pixel location
+            dst[0] = vignette_channel(src[0], weight);
+            dst[1] = vignette_channel(src[1], weight);
+            dst[2] = vignette_channel(src[2], weight);
+        }
+        src += 3;
+        dst += 3;
+    }
+}
+
+/**
+ * Darkens one row of an image towards its corners (the vignette filter)
+ * @param src  Interleaved source row
+ * @param dst  Interleaved destination row (may be src)
+ * @param row  Index of the row in the image
+ * @param mask The vignette mask for the image's size
+ * @return nothing
+ */
+void vignette_row(const unsigned char* src, unsigned char* dst, int row, const VignetteMask& mask)
+{
+    vignette_span(src, dst, row, 0, mask.cols, mask);
+}
+
+// Adds vignette effect to image (dark corners)
+Image process_1(const Image& image)
+{
+    int rows = image.height();
+    int cols = image.width();
+    ScopedTrace trace("process_1", "filter", (long long)rows * cols);
+
+    // Fresh canvas (every pixel is written below)
+    Image new_image(cols, rows, LAYOUT_INTERLEAVED, FILL_UNINITIALIZED);
+
+    shared_ptr<const VignetteMask> mask = vignette_mask(rows, cols);
+    parallel_rows(rows, [&](int first_row, int last_row)
+    {
+        for (int row = first_row; row < last_row; row++)
+        {
+            if (mask)
+            {
+                vignette_row(image.row(row), new_image.row(row), row, *mask);
+            }
+            else
+            {
+                vignette_span_unmasked(image.row(row), new_image.row(row), row, rows, cols, 0, cols);
+            }
+        }
+    });
+    return new_image;
+}
+
+// Adds Clarendon effect to image (darks darker and lights lighter) by a scaling factor
+Image process_2(const Image& image, double scaling_factor)
+{
+    int rows = image.height();
+    int cols = image.width();
+    ScopedTrace trace("process_2", "filter", (long long)rows * cols);
+    const PointKernels& kernels = point_kernels();
+
+    // Tone curves for the light and dark bands, so no per-pixel floating point math is left
+    ToneCurve light = scaling_curve(CURVE_LIGHTEN, scaling_factor);
+    ToneCurve dark = scaling_curve(CURVE_DARKEN, scaling_factor);
+
+    // Fresh canvas (every pixel is written below)
+    Image new_image(cols, rows, LAYOUT_INTERLEAVED, FILL_UNINITIALIZED);
+
+    parallel_rows(rows, [&](int first_row, int last_row)
+    {
+        for (int row = first_row; row < last_row; row++)
+        {
+            // Light pixels get lighter, dark pixels darker (see clarendon_scalar)
+            kernels.clarendon(image.row(row), new_image.row(row), cols, light, dark);
+        }
+    });
+    return new_image;
+}
+
+// Grayscale image
+Image process_3(const Image& image)
+{
+    int rows = image.height();
+    int cols = image.width();
+    ScopedTrace trace("process_3", "filter", (long long)rows * cols);
+    const PointKernels& kernels = point_kernels();
+
+    // Fresh canvas (every pixel is written below)
+    Image new_image(cols, rows, LAYOUT_INTERLEAVED, FILL_UNINITIALIZED);
+
+    parallel_rows(rows, [&](int first_row, int last_row)
+    {
+        for (int row = first_row; row < last_row; row++)
+        {
+            // Set every channel to the average of the blue, green and red values
+            kernels.grayscale(image.row(row), new_image.row(row), cols);
+        }
+    });
+    return new_image;
+}
+
+/**
+ * Rotates an image by quarter turns clockwise in a single pass. Quarter and
+ * three-quarter turns copy 64x64 pixel tiles, so the rows being read and the
+ * columns being written both stay in cache; half turns reverse whole rows.
+ * @param image         The input image
+ * @param quarter_turns Number of 90 degree clockwise turns (any integer)
+ * @return the rotated image
+ */
+Image rotate_image(const Image& image, int quarter_turns)
+{
+    int turns = ((quarter_turns % 4) + 4) % 4;
+    int rows = image.height();
+    int cols = image.width();
+    if (turns == 0)
+    {
+        return image;
+    }
+
+    if (turns == 2)
+    {
+        // Row r lands on row (rows - 1) - r, right to left
+        Image new_image(cols, rows, LAYOUT_INTERLEAVED, FILL_UNINITIALIZED);
+        parallel_rows(rows, [&](int first_row, int last_row)
+        {
+            for (int row = first_row; row < last_row; row++)
+            {
+                const unsigned char* src = image.row(row);
+                unsigned char* dst = new_image.row((rows - 1) - row) + (cols - 1) * 3;
+                for (int col = 0; col < cols; col++)
+                {
+                    dst[0] = src[0];
+                    dst[1] = src[1];
+                    dst[2] = src[2];
+                    src += 3;
+                    dst -= 3;
+                }
+            }
+        });
+        return new_image;
+    }
+
+    Image new_image(rows, cols, LAYOUT_INTERLEAVED, FILL_UNINITIALIZED);
+    const int tile = 64;
+    int tile_rows = (rows + tile - 1) / tile;
+    ptrdiff_t stride = new_image.stride();
+    parallel_rows(tile_rows, [&](int first_tile, int last_tile)
+    {
+        for (int t = first_tile; t < last_tile; t++)
+        {
+            int row_end = min(rows, (t + 1) * tile);
+            for (int col_start = 0; col_start < cols; col_start += tile)
+            {
+                int col_end = min(cols, col_start + tile);
+                for (int row = t * tile; row < row_end; row++)
+                {
+                    const unsigned char* src = image.row(row) + col_start * 3;
+
+                    // A clockwise quarter turn sends (row, col) to (col, (rows - 1) - row),
+                    // three quarters send it to ((cols - 1) - col, row)
+                    unsigned char* dst;
+                    ptrdiff_t step;
+                    if (turns == 1)
+                    {
+                        dst = new_image.row(col_start) + ((rows - 1) - row) * 3;
+                        step = stride;
+                    }
+                    else
+                    {
+                        dst = new_image.row((cols - 1) - col_start) + row * 3;
+                        step = -stride;
+                    }
+                    for (int col = col_start; col < col_end; col++)
+                    {
+                        dst[0] = src[0];
+                        dst[1] = src[1];
+                        dst[2] = src[2];
+                        src += 3;
+                        dst += step;
+                    }
+                }
+            }
+        }
+    });
+    return new_image;
+}
+
+/**
+ * Rotates an image by quarter turns clockwise without a second buffer.
+ * Works for half turns of any image and for any turn of a square image.
+ * @param image         The image to rotate
+ * @param quarter_turns Number of 90 degree clockwise turns (any integer)
+ * @return True if the image was rotated, false if it needs rotate_image()
+ */
+bool rotate_image_in_place(Image& image, int quarter_turns)
+{
+    int turns = ((quarter_turns % 4) + 4) % 4;
+    int rows = image.height();
+    int cols = image.width();
+    if (turns == 0)
+    {
+        return true;
+    }
+    if (turns != 2 && rows != cols)
+    {
+        return false;
+    }
+    ScopedTrace trace("rotate_image_in_place", "filter", (long long)rows * cols);
+
+    if (turns == 2)
+    {
+        // Swap row r with row (rows - 1) - r reversed; a middle row reverses onto itself
+        parallel_rows((rows + 1) / 2, [&](int first_row, int last_row)
+        {
+            for (int row = first_row; row < last_row; row++)
+            {
+                unsigned char* top = image.row(row);
+                unsigned char* bottom = image.row((rows - 1) - row) + (cols - 1) * 3;
+                int pixels = row == (rows - 1) - row ? cols / 2 : cols;
+                for (int col = 0; col < pixels; col++)
+                {
+                    swap(top[0], bottom[0]);
+                    swap(top[1], bottom[1]);
+                    swap(top[2], bottom[2]);
+                    top += 3;
+                    bottom -= 3;
+                }
+            }
+        });
+        return true;
+    }
+
+    // Each pixel of the top-left quadrant starts a cycle of four pixels, one per side
+    int n = rows;
+    parallel_rows(n / 2, [&](int first_ring, int last_ring)
+    {
+        for (int r = first_ring; r < last_ring; r++)
+        {
+            for (int c = r; c < (n - 1) - r; c++)
+            {
+                unsigned char* a = image.row(r) + c * 3;
+                unsigned char* b = image.row(c) + ((n - 1) - r) * 3;
+                unsigned char* d = image.row((n - 1) - r) + ((n - 1) - c) * 3;
+                unsigned char* e = image.row((n - 1) - c) + r * 3;
+                for (int channel = 0; channel < 3; channel++)
+                {
+                    unsigned char saved;
+                    if (turns == 1)
+                    {
+                        // a -> b -> d -> e -> a
+                        saved = e[channel];
+                        e[channel] = d[channel];
+                        d[channel] = b[channel];
+                        b[channel] = a[channel];
+                        a[channel] = saved;
+                    }
+                    else
+                    {
+                        // a -> e -> d -> b -> a
+                        saved = a[channel];
+                        a[channel] = b[channel];
+                        b[channel] = d[channel];
+                        d[channel] = e[channel];
+                        e[channel] = saved;
+                    }
+                }
+            }
+        }
+    });
+    return true;
+}
+
+/**
+ * Converts the rotation count of process_5 into clockwise quarter turns,
+ * keeping its handling of negative counts
+ * @param number Number of 90 degree rotations as entered
+ * @return quarter turns (0 to 3)
+ */
+int rotation_turns(int number)
+{
+    int angle = number * 90;
+    if (angle % 360 == 0)
+    {
+        return 0;
+    }
+    else if (angle % 360 == 90)
+    {
+        return 1;
+    }
+    else if (angle % 360 == 180)
+    {
+        return 2;
+    }
+    return 3;
+}
+
+// Rotates image by 90 degrees clockwise (not counter-clockwise)
+Image process_4(const Image& image)
+{
+    ScopedTrace trace("process_4", "filter", (long long)image.width() * image.height());
+    return rotate_image(image, 1);
+}
+
+// Rotates image by a specified number of multiples of 90 degrees clockwise
+Image process_5(const Image& image, int number)
+{
+    ScopedTrace trace("process_5", "filter", (long long)image.width() * image.height());
+    // One pass whatever the angle, instead of chaining 90 degree turns
+    return rotate_image(image, rotation_turns(number));
+}
+
+// Filters resize_image() can resample with
+enum ResampleFilter
+{
+    RESAMPLE_BOX,      // Averages the source pixels each output pixel covers
+    RESAMPLE_BILINEAR, // Triangle filter
+    RESAMPLE_LANCZOS   // Windowed sinc over three lobes; sharpest
+};
+
+/**
+ * Evaluates a resampling filter
+ * @param filter The filter
+ * @param x      Distance from the sample, in output pixels
+ * @return the filter's weight at that distance
+ */
+double resample_kernel(ResampleFilter filter, double x)
+{
+    if (filter == RESAMPLE_BOX)
+    {
+        // Half open, so a sample exactly between two pixels only lands in one
+        return x > -0.5 && x <= 0.5 ? 1.0 : 0.0;
+    }
+    x = fabs(x);
+    if (filter == RESAMPLE_BILINEAR)
+    {
+        return x < 1.0 ? 1.0 - x : 0.0;
+    }
+    if (x >= 3.0)
+    {
+        return 0.0;
+    }
+    if (x < 1e-8)
+    {
+        return 1.0;
+    }
+    const double pi = 3.14159265358979323846;
+    return 3.0 * sin(pi * x) * sin(pi * x / 3.0) / (pi * pi * x * x);
+}
+
+// How far from the sample a resampling filter reaches, in output pixels
+double resample_support(ResampleFilter filter)
+{
+    return filter == RESAMPLE_BOX ? 0.5 : filter == RESAMPLE_BILINEAR ? 1.0 : 3.0;
+}
+
+// Precomputed taps for resampling along one axis: output position i blends
+// source positions first[i] to first[i] + taps - 1 using weights[i * taps]
+// onwards, in fixed point with RESAMPLE_SHIFT fractional bits
+struct ResampleAxis
+{
+    int taps;
+    vector<int> first;
+    vector<short> weights;
+};
+
+/**
+ * Works out the taps for resampling one axis. When shrinking, the filter is
+ * stretched to cover every source pixel an output pixel spans, so large
+ * reductions average areas instead of skipping pixels.
+ * @param in_size  Source length
+ * @param out_size Output length
+ * @param filter   The filter
+ * @return the axis table
+ */
+ResampleAxis build_resample_axis(int in_size, int out_size, ResampleFilter filter)
+{
+    double scale = (double)in_size / out_size;
+    double filter_scale = max(scale, 1.0);
+    double support = resample_support(filter) * filter_scale;
+
+    ResampleAxis axis;
+    axis.taps = min(in_size, (int)ceil(support) * 2 + 1);
+    axis.first.resize(out_size);
+    axis.weights.assign((size_t)out_size * axis.taps, 0);
+
+    vector<double> weights(axis.taps);
+    for (int i = 0; i < out_size; i++)
+    {
+        double center = (i + 0.5) * scale;
+        int low = max(0, (int)(center - support + 0.5));
+        int high = min(in_size, (int)(center + support + 0.5));
+
+        // Keep every tap inside the source, shifting the window back at the far edge
+        int first = min(low, in_size - axis.taps);
+        double total = 0;
+        for (int t = 0; t < axis.taps; t++)
+        {
+            int position = first + t;
+            weights[t] = position >= low && position < high ? resample_kernel(filter, (position + 0.5 - center) / filter_scale) : 0.0;
+            total += weights[t];
+        }
+
+        // Round to fixed point, giving any rounding left over to the heaviest tap so the weights sum to one
+        short* fixed = &axis.weights[(size_t)i * axis.taps];
+        int heaviest = 0;
+        int sum = 0;
+        for (int t = 0; t < axis.taps; t++)
+        {
+            double weight = total != 0 ? weights[t] / total : (first + t == min(in_size - 1, (int)center) ? 1.0 : 0.0);
+            fixed[t] = (short)lround(weight * (1 << RESAMPLE_SHIFT));
+            sum += fixed[t];
+            if (fixed[t] > fixed[heaviest])
+            {
+                heaviest = t;
+            }
+        }
+        fixed[heaviest] += (1 << RESAMPLE_SHIFT) - sum;
+        axis.first[i] = first;
+    }
+    return axis;
+}
+
+/**
+ * Resizes an image to any size in two separable passes: across each row,
+ * then down each column. Both passes blend with the precomputed axis tables,
+ * run on the thread pool, and the column pass uses the SIMD kernel.
+ * @param image      The input image
+ * @param new_width  Width of the result
+ * @param new_height Height of the result
+ * @param filter     The resampling filter
+ * @return the resized image
+ */
+Image resize_image(const Image& image, int new_width, int new_height, ResampleFilter filter)
+{
+    int rows = image.height();
+    int cols = image.width();
+    ScopedTrace trace("resize_image", "filter", (long long)rows * cols);
+    if (new_width <= 0 || new_height <= 0 || image.empty())
+    {
+        return Image(max(new_width, 0), max(new_height, 0));
+    }
+
+    // Across each row: cols -> new_width
+    Image wide;
+    const Image* across = &image;
+    if (new_width != cols)
+    {
+        ResampleAxis axis = build_resample_axis(cols, new_width, filter);
+        wide = Image(new_width, rows, LAYOUT_INTERLEAVED, FILL_UNINITIALIZED);
+        parallel_rows(rows, [&](int first_row, int last_row)
+        {
+            for (int row = first_row; row < last_row; row++)
+            {
+                const unsigned char* src = image.row(row);
+                unsigned char* dst = wide.row(row);
+                for (int col = 0; col < new_width; col++)
+                {
+                    const unsigned char* pixel = src + axis.first[col] * 3;
+                    const short* weights = &axis.weights[(size_t)col * axis.taps];
+                    int blue = 1 << (RESAMPLE_SHIFT - 1);
+                    int green = blue;
+                    int red = blue;
+                    for (int t = 0; t < axis.taps; t++)
+                    {
+                        blue += pixel[0] * weights[t];
+                        green += pixel[1] * weights[t];
+                        red += pixel[2] * weights[t];
+                        pixel += 3;
+                    }
+                    dst[0] = clamp_byte(blue >> RESAMPLE_SHIFT);
+                    dst[1] = clamp_byte(green >> RESAMPLE_SHIFT);
+                    dst[2] = clamp_byte(red >> RESAMPLE_SHIFT);
+                    dst += 3;
+                }
+            }
+        });
+        across = &wide;
+    }
+    if (new_height == rows)
+    {
+        return new_width != cols ? wide : image;
+    }
+
+    // Down each column: rows -> new_height, a whole output row at a time
+    ResampleAxis axis = build_resample_axis(rows, new_height, filter);
+    const PointKernels& kernels = point_kernels();
+    Image new_image(new_width, new_height, LAYOUT_INTERLEAVED, FILL_UNINITIALIZED);
+    parallel_rows(new_height, [&](int first_row, int last_row)
+    {
+        vector<const unsigned char*> sources(axis.taps);
+        for (int row = first_row; row < last_row; row++)
+        {
+            for (int t = 0; t < axis.taps; t++)
+            {
+                sources[t] = across->row(axis.first[row] + t);
+            }
+            kernels.resample_vertical(sources.data(), &axis.weights[(size_t)row * axis.taps], axis.taps, new_image.row(row), 0, new_width * 3);
+        }
+    });
+    return new_image;
+}
+
+/**
+ * Halves an interleaved image in both directions, averaging each 2x2 block
+ * of pixels (a box filter). An odd last row or column is dropped.
+ * @param image The image to shrink
+ * @return the image at half the width and height (at least 1 x 1)
+ */
+Image downsample_2x(const Image& image)
+{
+    int cols = max(1, image.width() / 2);
+    int rows = max(1, image.height() / 2);
+    int last_x = image.width() - 1;
+    int last_y = image.height() - 1;
+    Image small(cols, rows, LAYOUT_INTERLEAVED, FILL_UNINITIALIZED);
+    parallel_rows(rows, [&](int first_row, int last_row)
+    {
+        for (int row = first_row; row < last_row; row++)
+        {
+            const unsigned char* top = image.row(min(2 * row, last_y));
+            const unsigned char* bottom = image.row(min(2 * row + 1, last_y));
+            unsigned char* dst = small.row(row);
+            for (int col = 0; col < cols; col++)
+            {
+                int left = min(2 * col, last_x) * 3;
+                int right = min(2 * col + 1, last_x) * 3;
+                for (int c = 0; c < 3; c++)
+                {
+                    dst[col * 3 + c] = (top[left + c] + top[right + c] + bottom[left + c] + bottom[right + c] + 2) >> 2;
+                }
+            }
+        }
+    });
+    return small;
+}
+
+// Most pixels a preview proxy may have; filters run on it in a few milliseconds
+const long long PREVIEW_MAX_PIXELS = 1 << 20;
+
+/**
+ * Builds the proxy the menu previews edits on: the first level of the
+ * image's pyramid (each level half the size of the one before) that has
+ * no more than PREVIEW_MAX_PIXELS pixels
+ * @param image  The full resolution image
+ * @param shrink Set to how many times smaller the proxy is in each direction
+ * @return the proxy
+ */
+Image build_proxy(const Image& image, int& shrink)
+{
+    ScopedTrace trace("build_proxy", "filter", (long long)image.width() * image.height());
+    shrink = 1;
+    if ((long long)image.width() * image.height() <= PREVIEW_MAX_PIXELS)
+    {
+        return image;
+    }
+    Image level = downsample_2x(image);
+    shrink = 2;
+    while ((long long)level.width() * level.height() > PREVIEW_MAX_PIXELS)
+    {
+        level = downsample_2x(level);
+        shrink *= 2;
+    }
+    return level;
+}
+
+// Enlarges the image in the x and y direction
+Image process_6(const Image& image, int x_scale, int y_scale)
+{
+    int rows = image.height();
+    int cols = image.width();
+    ScopedTrace trace("process_6", "filter", (long long)rows * cols);
+
+    // Calculates new dimensions based on user input
+    if (x_scale <= 0 || y_scale <= 0 || (long long)rows * y_scale > INT_MAX || (long long)cols * x_scale > INT_MAX)
+    {
+        return Image();
+    }
+    int new_rows = rows * y_scale;
+    int new_cols = cols * x_scale;
+
+    // Fresh canvas (every pixel is written below)
+    Image new_image(new_cols, new_rows, LAYOUT_INTERLEAVED, FILL_UNINITIALIZED);
+    if (new_image.empty())
+    {
+        return new_image;
+    }
+
+    parallel_rows(rows, [&](int first_row, int last_row)
+    {
+        for (int row = first_row; row < last_row; row++)
+        {
+            // Widen each source row once, repeating every pixel x_scale times...
+            const unsigned char* src = image.row(row);
+            unsigned char* first = new_image.row(row * y_scale);
+            unsigned char* dst = first;
+            for (int col = 0; col < cols; col++)
+            {
+                for (int copy = 0; copy < x_scale; copy++)
+                {
+                    dst[0] = src[0];
+                    dst[1] = src[1];
+                    dst[2] = src[2];
+                    dst += 3;
+                }
+                src += 3;
+            }
+
+            // ...then copy the widened row onto the rest of the rows it covers
+            for (int copy = 1; copy < y_scale; copy++)
+            {
+                memcpy(new_image.row(row * y_scale + copy), first, (size_t)new_cols * 3);
+            }
+        }
+    });
+    return new_image;
+}
+
+// Convert image to high contrast (black and white only)
+Image process_7(const Image& image)
+{
+    int rows = image.height();
+    int cols = image.width();
+    ScopedTrace trace("process_7", "filter", (long long)rows * cols);
+    const PointKernels& kernels = point_kernels();
+
+    // Fresh canvas (every pixel is written below)
+    Image new_image(cols, rows, LAYOUT_INTERLEAVED, FILL_UNINITIALIZED);
+
+    parallel_rows(rows, [&](int first_row, int last_row)
+    {
+        for (int row = first_row; row < last_row; row++)
+        {
+            // White if the gray value is at least 127, black otherwise
+            kernels.high_contrast(image.row(row), new_image.row(row), cols);
+        }
+    });
+    return new_image;
+}
+
+// Lightens image by a scaling factor
+Image process_8(const Image& image, double scaling_factor)
+{
+    int rows = image.height();
+    int cols = image.width();
+    ScopedTrace trace("process_8", "filter", (long long)rows * cols);
+    const PointKernels& kernels = point_kernels();
+    ToneCurve curve = scaling_curve(CURVE_LIGHTEN, scaling_factor);
+
+    // Fresh canvas (every pixel is written below)
+    Image new_image(cols, rows, LAYOUT_INTERLEAVED, FILL_UNINITIALIZED);
+
+    parallel_rows(rows, [&](int first_row, int last_row)
+    {
+        for (int row = first_row; row < last_row; row++)
+        {
+            // Every channel is scaled the same way
+            kernels.tone_curve(image.row(row), new_image.row(row), cols * 3, curve);
+        }
+    });
+    return new_image;
+}
+
+// Darkens image by a scaling factor
+Image process_9(const Image& image, double scaling_factor)
+{
+    int rows = image.height();
+    int cols = image.width();
+    ScopedTrace trace("process_9", "filter", (long long)rows * cols);
+    const PointKernels& kernels = point_kernels();
+    ToneCurve curve = scaling_curve(CURVE_DARKEN, scaling_factor);
+
+    // Fresh canvas (every pixel is written below)
+    Image new_image(cols, rows, LAYOUT_INTERLEAVED, FILL_UNINITIALIZED);
+
+    parallel_rows(rows, [&](int first_row, int last_row)
+    {
+        for (int row = first_row; row < last_row; row++)
+        {
+            // Every channel is scaled the same way
+            kernels.tone_curve(image.row(row), new_image.row(row), cols * 3, curve);
+        }
+    });
+    return new_image;
+}
+
+// Converts image to only black, white, red, blue, and green
+Image process_10(const Image& image)
+{
+    int rows = image.height();
+    int cols = image.width();
+    ScopedTrace trace("process_10", "filter", (long long)rows * cols);
+
+    // Fresh canvas (every pixel is written below)
+    Image new_image(cols, rows, LAYOUT_INTERLEAVED, FILL_UNINITIALIZED);
+
+    parallel_rows(rows, [&](int first_row, int last_row)
+    {
+        for (int row = first_row; row < last_row; row++)
+        {
+            point_kernels().five_color(image.row(row), new_image.row(row), cols);
+        }
+    });
+    return new_image;
+}
+
+// A per-pixel colour mapping, written as a row function like five_color_scalar()
+typedef function<void(const unsigned char* src, unsigned char* dst, int pixels)> ColorMapping;
+
+// Bits of each channel that pick a colour lookup table cell (32 x 32 x 32 cells of 8 x 8 x 8 colours)
+const int COLOR_LUT_BITS = 5;
+
+// Colours in one cell
+const int COLOR_LUT_CELL_COLORS = 1 << (3 * (8 - COLOR_LUT_BITS));
+
+// Marks a cell whose colours don't all map to the same colour; the low 24 bits then index its block
+const unsigned int COLOR_LUT_MIXED = 0x01000000;
+
+// A colour mapping compiled into a two level 3D table. A cell whose colours
+// all map to one colour stores it as 0x00RRGGBB. Any other cell points to a
+// block holding the result for each of its colours. Every colour therefore
+// maps exactly as the mapping would map it, with at most two lookups.
+// Mappings that split colour space along a few surfaces (palettes, the five
+// colour filter) only need blocks for the few percent of cells those cross.
+struct ColorLut
+{
+    vector<unsigned int> cells;  // Indexed by color_lut_cell()
+    vector<unsigned int> blocks; // COLOR_LUT_CELL_COLORS entries per mixed cell, indexed by color_lut_offset()
+};
+
+/**
+ * Finds the cell of a colour in a ColorLut
+ * @param blue  Blue channel
+ * @param green Green channel
+ * @param red   Red channel
+ * @return the cell index
+ */
+inline int color_lut_cell(int blue, int green, int red)
+{
+    const int shift = 8 - COLOR_LUT_BITS;
+    return (blue >> shift) << (2 * COLOR_LUT_BITS) | (green >> shift) << COLOR_LUT_BITS | (red >> shift);
+}
+
+/**
+ * Finds a colour within its cell's block
+ * @param blue  Blue channel
+ * @param green Green channel
+ * @param red   Red channel
+ * @return the index within the block
+ */
+inline int color_lut_offset(int blue, int green, int red)
+{
+    const int bits = 8 - COLOR_LUT_BITS;
+    const int mask = (1 << bits) - 1;
+    return (blue & mask) << (2 * bits) | (green & mask) << bits | (red & mask);
+}
+
+/**
+ * Fills colors with every colour of a cell, in block order
+ * @param cell   The cell index
+ * @param colors Room for COLOR_LUT_CELL_COLORS interleaved BGR pixels
+ * @return nothing
+ */
+void color_lut_cell_colors(int cell, unsigned char* colors)
+{
+    const int bits = 8 - COLOR_LUT_BITS;
+    const int mask = (1 << bits) - 1;
+    int blue = (cell >> (2 * COLOR_LUT_BITS)) << bits;
+    int green = (cell >> COLOR_LUT_BITS & ((1 << COLOR_LUT_BITS) - 1)) << bits;
+    int red = (cell & ((1 << COLOR_LUT_BITS) - 1)) << bits;
+    for (int i = 0; i < COLOR_LUT_CELL_COLORS; i++)
+    {
+        colors[0] = blue + (i >> (2 * bits));
+        colors[1] = green + (i >> bits & mask);
+        colors[2] = red + (i & mask);
+        colors += 3;
+    }
+}
+
+/**
+ * Compiles a colour mapping into a table. When every output colour comes from
+ * a convex region of input colours, as with nearest colour palettes and the
+ * five colour filter (whose regions are cut out by planes), a cell is uniform
+ * exactly when its eight corners map to the same colour, so only the corners
+ * and the colours of mixed cells are evaluated. Otherwise the mapping runs
+ * over every colour once.
+ * @param mapping The per-pixel mapping
+ * @param convex  True if each output colour's set of input colours is convex
+ * @return the compiled table
+ */
+shared_ptr<const ColorLut> compile_color_lut(const ColorMapping& mapping, bool convex)
+{
+    const int cells = 1 << COLOR_LUT_BITS;
+    const int cell_count = cells * cells * cells;
+    const int side = 256 >> COLOR_LUT_BITS;
+    shared_ptr<ColorLut> lut = make_shared<ColorLut>();
+    lut->cells.resize(cell_count);
+
+    if (convex)
+    {
+        // The first and last value of every cell along each axis
+        const int ends = 2 * cells;
+        vector<unsigned char> corners((size_t)ends * ends * ends * 3);
+        vector<unsigned char> mapped(corners.size());
+        for (int i = 0; i < ends * ends * ends; i++)
+        {
+            int blue = i / (ends * ends), green = i / ends % ends, red = i % ends;
+            corners[3 * i] = blue / 2 * side + blue % 2 * (side - 1);
+            corners[3 * i + 1] = green / 2 * side + green % 2 * (side - 1);
+            corners[3 * i + 2] = red / 2 * side + red % 2 * (side - 1);
+        }
+        mapping(corners.data(), mapped.data(), ends * ends * ends);
+
+        for (int cell = 0; cell < cell_count; cell++)
+        {
+            int blue = cell >> (2 * COLOR_LUT_BITS), green = cell >> COLOR_LUT_BITS & (cells - 1), red = cell & (cells - 1);
+            const unsigned char* first = &mapped[3 * (((size_t)2 * blue * ends + 2 * green) * ends + 2 * red)];
+            bool uniform = true;
+            for (int corner = 1; corner < 8 && uniform; corner++)
+            {
+                const unsigned char* other = &mapped[3 * (((size_t)(2 * blue + (corner >> 2)) * ends + 2 * green + (corner >> 1 & 1)) * ends +
+                                                          2 * red + (corner & 1))];
+                uniform = memcmp(first, other, 3) == 0;
+            }
+            lut->cells[cell] = uniform ? (unsigned int)first[0] | first[1] << 8 | first[2] << 16 : COLOR_LUT_MIXED;
+        }
+    }
+    else
+    {
+        parallel_rows(cell_count, [&](int first_cell, int last_cell)
+        {
+            vector<unsigned char> colors(COLOR_LUT_CELL_COLORS * 3);
+            vector<unsigned char> mapped(colors.size());
+            for (int cell = first_cell; cell < last_cell; cell++)
+            {
+                color_lut_cell_colors(cell, colors.data());
+                mapping(colors.data(), mapped.data(), COLOR_LUT_CELL_COLORS);
+                bool uniform = true;
+                for (int i = 3; i < COLOR_LUT_CELL_COLORS * 3 && uniform; i += 3)
+                {
+                    uniform = memcmp(&mapped[i], &mapped[0], 3) == 0;
+                }
+                lut->cells[cell] = uniform ? (unsigned int)mapped[0] | mapped[1] << 8 | mapped[2] << 16 : COLOR_LUT_MIXED;
+            }
+        });
+    }
+
+    // Give every mixed cell a block with the result for each of its colours
+    vector<int> mixed;
+    for (int cell = 0; cell < cell_count; cell++)
+    {
+        if (lut->cells[cell] == COLOR_LUT_MIXED)
+        {
+            lut->cells[cell] |= mixed.size();
+            mixed.push_back(cell);
+        }
+    }
+    lut->blocks.resize(mixed.size() * COLOR_LUT_CELL_COLORS);
+    parallel_rows(mixed.size(), [&](int first_block, int last_block)
+    {
+        vector<unsigned char> colors(COLOR_LUT_CELL_COLORS * 3);
+        vector<unsigned char> mapped(colors.size());
+        for (int block = first_block; block < last_block; block++)
+        {
+            color_lut_cell_colors(mixed[block], colors.data());
+            mapping(colors.data(), mapped.data(), COLOR_LUT_CELL_COLORS);
+            unsigned int* entries = &lut->blocks[(size_t)block * COLOR_LUT_CELL_COLORS];
+            for (int i = 0; i < COLOR_LUT_CELL_COLORS; i++)
+            {
+                entries[i] = (unsigned int)mapped[3 * i] | mapped[3 * i + 1] << 8 | mapped[3 * i + 2] << 16;
+            }
+        }
+    });
+    return lut;
+}
+
+// Maps every pixel through a compiled colour mapping
+void color_lut_scalar(const ColorLut& lut, const unsigned char* src, unsigned char* dst, int pixels)
+{
+    for (int p = 0; p < pixels; p++)
+    {
+        unsigned int entry = lut.cells[color_lut_cell(src[0], src[1], src[2])];
+        if (entry & COLOR_LUT_MIXED)
+        {
+            entry = lut.blocks[(size_t)(entry & (COLOR_LUT_MIXED - 1)) * COLOR_LUT_CELL_COLORS + color_lut_offset(src[0], src[1], src[2])];
+        }
+        dst[0] = entry;
+        dst[1] = entry >> 8;
+        dst[2] = entry >> 16;
+        src += 3;
+        dst += 3;
+    }
+}
+
+#ifdef IMAGE_EDITOR_X86_SIMD
+
+__attribute__((target("avx2")))
+void color_lut_avx2(const ColorLut& lut, const unsigned char* src, unsigned char* dst, int pixels)
+{
+    // Pixels 0-3 go to the low lane and 4-7 to the high lane, one per 32-bit element
+    const __m256i blue_bytes = _mm256_setr_epi8(0, -1, -1, -1, 3, -1, -1, -1, 6, -1, -1, -1, 9, -1, -1, -1,
+                                                0, -1, -1, -1, 3, -1, -1, -1, 6, -1, -1, -1, 9, -1, -1, -1);
+    const __m256i green_bytes = _mm256_setr_epi8(1, -1, -1, -1, 4, -1, -1, -1, 7, -1, -1, -1, 10, -1, -1, -1,
+                                                 1, -1, -1, -1, 4, -1, -1, -1, 7, -1, -1, -1, 10, -1, -1, -1);
+    const __m256i red_bytes = _mm256_setr_epi8(2, -1, -1, -1, 5, -1, -1, -1, 8, -1, -1, -1, 11, -1, -1, -1,
+                                               2, -1, -1, -1, 5, -1, -1, -1, 8, -1, -1, -1, 11, -1, -1, -1);
+    // Packs four 0x00RRGGBB entries per lane back into 12 BGR bytes
+    const __m256i pack = _mm256_setr_epi8(0, 1, 2, 4, 5, 6, 8, 9, 10, 12, 13, 14, -1, -1, -1, -1,
+                                          0, 1, 2, 4, 5, 6, 8, 9, 10, 12, 13, 14, -1, -1, -1, -1);
+    const int shift = 8 - COLOR_LUT_BITS;
+    const __m256i low_bits = _mm256_set1_epi32((1 << shift) - 1);
+    const __m256i block_bits = _mm256_set1_epi32(COLOR_LUT_MIXED - 1);
+    const int* cells = (const int*)lut.cells.data();
+    const int* blocks = (const int*)lut.blocks.data();
+    int p = 0;
+
+    // Each step reads 28 bytes, so stop while 10 pixels remain
+    for (; p + 10 <= pixels; p += 8)
+    {
+        const unsigned char* in = src + 3 * p;
+        __m256i bytes = _mm256_inserti128_si256(_mm256_castsi128_si256(_mm_loadu_si128((const __m128i*)in)),
+                                                _mm_loadu_si128((const __m128i*)(in + 12)), 1);
+        __m256i blue = _mm256_shuffle_epi8(bytes, blue_bytes);
+        __m256i green = _mm256_shuffle_epi8(bytes, green_bytes);
+        __m256i red = _mm256_shuffle_epi8(bytes, red_bytes);
+        __m256i cell = _mm256_or_si256(_mm256_or_si256(_mm256_slli_epi32(_mm256_srli_epi32(blue, shift), 2 * COLOR_LUT_BITS),
+                                                       _mm256_slli_epi32(_mm256_srli_epi32(green, shift), COLOR_LUT_BITS)),
+                                       _mm256_srli_epi32(red, shift));
+        __m256i entries = _mm256_i32gather_epi32(cells, cell, 4);
+
+        // Pixels in mixed cells take a second, masked gather from their cell's block
+        __m256i mixed = _mm256_srai_epi32(_mm256_slli_epi32(entries, 7), 31);
+        if (!_mm256_testz_si256(mixed, mixed))
+        {
+            __m256i offset = _mm256_or_si256(_mm256_or_si256(_mm256_slli_epi32(_mm256_and_si256(blue, low_bits), 2 * shift),
+                                                             _mm256_slli_epi32(_mm256_and_si256(green, low_bits), shift)),
+                                             _mm256_and_si256(red, low_bits));
+            __m256i index = _mm256_or_si256(_mm256_slli_epi32(_mm256_and_si256(entries, block_bits), 3 * shift), offset);
+            entries = _mm256_mask_i32gather_epi32(entries, blocks, index, mixed, 4);
+        }
+
+        // Store exactly 24 bytes, since dst may be src and the next pixels are still unread
+        __m256i packed = _mm256_shuffle_epi8(entries, pack);
+        __m128i halves[2] = {_mm256_castsi256_si128(packed), _mm256_extracti128_si256(packed, 1)};
+        for (int h = 0; h < 2; h++)
+        {
+            unsigned char* out = dst + 3 * p + 12 * h;
+            _mm_storel_epi64((__m128i*)out, halves[h]);
+            int last = _mm_cvtsi128_si32(_mm_srli_si128(halves[h], 8));
+            memcpy(out + 8, &last, 4);
+        }
+    }
+    color_lut_scalar(lut, src + 3 * p, dst + 3 * p, pixels - p);
+}
+
+#endif
+
+/**
+ * Maps a row through a compiled colour mapping, with AVX2 gathers when the CPU has them
+ * @param lut    The compiled mapping
+ * @param src    Interleaved source row
+ * @param dst    Interleaved destination row (may be src)
+ * @param pixels Number of pixels in the row
+ * @return nothing
+ */
+void apply_color_lut(const ColorLut& lut, const unsigned char* src, unsigned char* dst, int pixels)
+{
+#ifdef IMAGE_EDITOR_X86_SIMD
+    if (simd_level() >= SIMD_AVX2)
+    {
+        color_lut_avx2(lut, src, dst, pixels);
+        return;
+    }
+#endif
+    color_lut_scalar(lut, src, dst, pixels);
+}
+
+/**
+ * Replaces every pixel with the nearest palette colour (by squared distance,
+ * the earlier colour winning ties)
+ * @param palette Colours as 0xRRGGBB
+ * @param src     Interleaved source row
+ * @param dst     Interleaved destination row (may be src)
+ * @param pixels  Number of pixels in the row
+ * @return nothing
+ */
+void nearest_palette_row(const vector<unsigned int>& palette, const unsigned char* src, unsigned char* dst, int pixels)
+{
+    for (int p = 0; p < pixels; p++)
+    {
+        unsigned int best = 0;
+        int best_distance = INT_MAX;
+        for (size_t i = 0; i < palette.size(); i++)
+        {
+            int red = (int)(palette[i] >> 16 & 255) - src[2];
+            int green = (int)(palette[i] >> 8 & 255) - src[1];
+            int blue = (int)(palette[i] & 255) - src[0];
+            int distance = red * red + green * green + blue * blue;
+            if (distance < best_distance)
+            {
+                best = palette[i];
+                best_distance = distance;
+            }
+        }
+        dst[0] = best;
+        dst[1] = best >> 8;
+        dst[2] = best >> 16;
+        src += 3;
+        dst += 3;
+    }
+}
+
+/**
+ * Gets the compiled colour mapping for a palette, compiling it on first use
+ * @param palette Colours as 0xRRGGBB
+ * @return the compiled mapping
+ */
+shared_ptr<const ColorLut> palette_lut(const vector<unsigned int>& palette)
+{
+    static map<vector<unsigned int>, shared_ptr<const ColorLut>> cache;
+    static mutex cache_mutex;
+
+    lock_guard<mutex> lock(cache_mutex);
+    map<vector<unsigned int>, shared_ptr<const ColorLut>>::iterator found = cache.find(palette);
+    if (found != cache.end())
+    {
+        return found->second;
+    }
+
+    // A table takes a few MB; a recipe rarely uses more than one or two palettes
+    if (cache.size() >= 4)
+    {
+        cache.clear();
+    }
+    // Every palette colour wins a convex region: the colours nearer to it than to the others
+    shared_ptr<const ColorLut> lut = compile_color_lut([palette](const unsigned char* src, unsigned char* dst, int pixels)
+    {
+        nearest_palette_row(palette, src, dst, pixels);
+    }, true);
+    cache[palette] = lut;
+    return lut;
+}
+
+// Reduces the image to the nearest colours of a palette
+Image process_palette(const Image& image, const vector<unsigned int>& palette)
+{
+    int rows = image.height();
+    int cols = image.width();
+    ScopedTrace trace("process_palette", "filter", (long long)rows * cols);
+    shared_ptr<const ColorLut> lut = palette_lut(palette);
+
+    // Fresh canvas (every pixel is written below)
+    Image new_image(cols, rows, LAYOUT_INTERLEAVED, FILL_UNINITIALIZED);
+
+    parallel_rows(rows, [&](int first_row, int last_row)
+    {
+        for (int row = first_row; row < last_row; row++)
+        {
+            apply_color_lut(*lut, image.row(row), new_image.row(row), cols);
+        }
+    });
+    return new_image;
+}
+
+// Maps every channel of the image through a tone curve (see compile_tone_curve)
+Image process_tone_curve(const Image& image, const ToneCurve& curve)
+{
+    int rows = image.height();
+    int cols = image.width();
+    ScopedTrace trace("process_tone_curve", "filter", (long long)rows * cols);
+    const PointKernels& kernels = point_kernels();
+
+    // Fresh canvas (every pixel is written below)
+    Image new_image(cols, rows, LAYOUT_INTERLEAVED, FILL_UNINITIALIZED);
+
+    parallel_rows(rows, [&](int first_row, int last_row)
+    {
+        for (int row = first_row; row < last_row; row++)
+        {
+            kernels.tone_curve(image.row(row), new_image.row(row), cols * 3, curve);
+        }
+    });
+    return new_image;
+}
+
+// Operations a recipe can chain. The first ten match the menu numbers.
+enum OperationKind
+{
+    OP_VIGNETTE = 1,    // vignette
+    OP_CLARENDON,       // clarendon:<scaling factor>
+    OP_GRAYSCALE,       // grayscale
+    OP_ROTATE_90,       // rotate90
+    OP_ROTATE,          // rotate:<number of 90 degree turns>
+    OP_ENLARGE,         // enlarge:<x scale>:<y scale>
+    OP_HIGH_CONTRAST,   // high_contrast
+    OP_LIGHTEN,         // lighten:<scaling factor>
+    OP_DARKEN,          // darken:<scaling factor>
+    OP_FIVE_COLOR,      // five_color
+    OP_TONE_CURVE,      // curve:<in>=<out>:<in>=<out>:...
+    OP_RESIZE,          // resize:<width>:<height>[:box|bilinear|lanczos]
+    OP_PALETTE          // palette:<RRGGBB>:<RRGGBB>:...
+};
+
+// One step of a recipe
+struct Operation
+{
+    OperationKind kind;
+    double scaling_factor;              // Clarendon, lighten and darken
+    int number;                         // Rotate
+    int x_scale;                        // Enlarge
+    int y_scale;                        // Enlarge
+    vector<pair<int, int>> curve_points; // Tone curve control points
+    int width;                          // Resize
+    int height;                         // Resize
+    ResampleFilter filter;              // Resize
+    vector<unsigned int> palette;       // Palette colours as 0xRRGGBB
+};
+
+// Names of the resampling filters, as written in recipes
+const char* const RESAMPLE_FILTER_NAMES[] = {"box", "bilinear", "lanczos"};
+
+/**
+ * Formats a number so it reads back as exactly the same double
+ * @param value The number to format
+ * @return the shortest text that round-trips
+ */
+string format_number(double value)
+{
+    for (int precision = 1; precision <= 17; precision++)
+    {
+        ostringstream text;
+        text << setprecision(precision) << value;
+        if (strtod(text.str().c_str(), nullptr) == value)
+        {
+            return text.str();
+        }
+    }
+    ostringstream text;
+    text << setprecision(17) << value;
+    return text.str();
+}
+
+/**
+ * Parses one recipe step such as "clarendon:0.3", "rotate:2" or "enlarge:2:3"
+ * @param text The step to parse
+ * @param op   The parsed operation
+ * @return True if the step is valid and false otherwise
+ */
+bool parse_operation(const string& text, Operation& op)
+{
+    op = Operation();
+
+    // Split "name:arg:arg" into its parts
+    vector<string> parts;
+    string part;
+    istringstream stream(text);
+    while (getline(stream, part, ':'))
+    {
+        parts.push_back(part);
+    }
+    if (parts.empty())
+    {
+        return false;
+    }
+
+    const string& name = parts[0];
+    size_t args = parts.size() - 1;
+    char* end = nullptr;
+    if ((name == "vignette" || name == "1") && args == 0)
+    {
+        op.kind = OP_VIGNETTE;
+    }
+    else if ((name == "clarendon" || name == "2" || name == "lighten" || name == "8" ||
+              name == "darken" || name == "9") && args == 1)
+    {
+        op.kind = (name == "clarendon" || name == "2") ? OP_CLARENDON
+                : (name == "lighten" || name == "8") ? OP_LIGHTEN : OP_DARKEN;
+        op.scaling_factor = strtod(parts[1].c_str(), &end);
+        return !parts[1].empty() && *end == '\0';
+    }
+    else if ((name == "grayscale" || name == "3") && args == 0)
+    {
+        op.kind = OP_GRAYSCALE;
+    }
+    else if ((name == "rotate90" || name == "4") && args == 0)
+    {
+        op.kind = OP_ROTATE_90;
+    }
+    else if ((name == "rotate" || name == "5") && args == 1)
+    {
+        op.kind = OP_ROTATE;
+        op.number = strtol(parts[1].c_str(), &end, 10);
+        return !parts[1].empty() && *end == '\0';
+    }
+    else if ((name == "enlarge" || name == "6") && args == 2)
+    {
+        op.kind = OP_ENLARGE;
+        long x_scale = strtol(parts[1].c_str(), &end, 10);
+        if (parts[1].empty() || *end != '\0' || x_scale <= 0 || x_scale > INT_MAX)
+        {
+            return false;
+        }
+        long y_scale = strtol(parts[2].c_str(), &end, 10);
+        if (parts[2].empty() || *end != '\0' || y_scale <= 0 || y_scale > INT_MAX)
+        {
+            return false;
+        }
+        op.x_scale = (int)x_scale;
+        op.y_scale = (int)y_scale;
+        return true;
+    }
+    else if ((name == "high_contrast" || name == "7") && args == 0)
+    {
+        op.kind = OP_HIGH_CONTRAST;
+    }
+    else if ((name == "five_color" || name == "10") && args == 0)
+    {
+        op.kind = OP_FIVE_COLOR;
+    }
+    else if (name == "resize" && (args == 2 || args == 3))
+    {
+        op.kind = OP_RESIZE;
+        op.width = strtol(parts[1].c_str(), &end, 10);
+        if (parts[1].empty() || *end != '\0')
+        {
+            return false;
+        }
+        op.height = strtol(parts[2].c_str(), &end, 10);
+        if (parts[2].empty() || *end != '\0' || op.width <= 0 || op.height <= 0)
+        {
+            return false;
+        }
+        op.filter = RESAMPLE_LANCZOS;
+        if (args == 3)
+        {
+            const char* const* found = find(RESAMPLE_FILTER_NAMES, RESAMPLE_FILTER_NAMES + 3, parts[3]);
+            if (found == RESAMPLE_FILTER_NAMES + 3)
+            {
+                return false;
+            }
+            op.filter = (ResampleFilter)(found - RESAMPLE_FILTER_NAMES);
+        }
+    }
+    else if (name == "curve" && args >= 1)
+    {
+        op.kind = OP_TONE_CURVE;
+        for (size_t i = 1; i < parts.size(); i++)
+        {
+            int in = 0;
+            int out = 0;
+            char separator = 0;
+            istringstream point(parts[i]);
+            if (!(point >> in >> separator >> out) || separator != '=' || in < 0 || in > 255 ||
+                (!op.curve_points.empty() && in <= op.curve_points.back().first))
+            {
+                return false;
+            }
+            op.curve_points.push_back(make_pair(in, out));
+        }
+    }
+    else if (name == "palette" && args >= 1 && args <= 256)
+    {
+        op.kind = OP_PALETTE;
+        for (size_t i = 1; i < parts.size(); i++)
+        {
+            if (parts[i].size() != 6 || parts[i].find_first_not_of("0123456789abcdefABCDEF") != string::npos)
+            {
+                return false;
+            }
+            op.palette.push_back(strtoul(parts[i].c_str(), nullptr, 16));
+        }
+    }
+    else
+    {
+        return false;
+    }
+    return true;
+}
+
+/**
+ * Parses a comma separated recipe such as "darken:0.8,clarendon:0.3,vignette"
+ * @param text The recipe to parse
+ * @param ops  The parsed operations, in order
+ * @return True if every step is valid and false otherwise
+ */
+bool parse_recipe(const string& text, vector<Operation>& ops)
+{
+    ops.clear();
+    string step;
+    istringstream stream(text);
+    while (getline(stream, step, ','))
+    {
+        Operation op;
+        if (!parse_operation(step, op))
+        {
+            cout << "Unknown operation: " << step << "\n";
+            return false;
+        }
+        ops.push_back(op);
+    }
+    return !ops.empty();
+}
+
+/**
+ * Formats an operation in the canonical form parse_operation() reads back
+ * @param op The operation to format
+ * @return the canonical text of the operation
+ */
+string operation_name(const Operation& op)
+{
+    switch (op.kind)
+    {
+        case OP_VIGNETTE: return "vignette";
+        case OP_CLARENDON: return "clarendon:" + format_number(op.scaling_factor);
+        case OP_GRAYSCALE: return "grayscale";
+        case OP_ROTATE_90: return "rotate90";
+        case OP_ROTATE: return "rotate:" + to_string(op.number);
+        case OP_ENLARGE: return "enlarge:" + to_string(op.x_scale) + ":" + to_string(op.y_scale);
+        case OP_HIGH_CONTRAST: return "high_contrast";
+        case OP_LIGHTEN: return "lighten:" + format_number(op.scaling_factor);
+        case OP_DARKEN: return "darken:" + format_number(op.scaling_factor);
+        case OP_FIVE_COLOR: return "five_color";
+        case OP_TONE_CURVE:
+        {
+            string name = "curve";
+            for (size_t i = 0; i < op.curve_points.size(); i++)
+            {
+                name += ":" + to_string(op.curve_points[i].first) + "=" + to_string(op.curve_points[i].second);
+            }
+            return name;
+        }
+        case OP_RESIZE: return "resize:" + to_string(op.width) + ":" + to_string(op.height) + ":" + RESAMPLE_FILTER_NAMES[op.filter];
+        case OP_PALETTE:
+        {
+            string name = "palette";
+            for (size_t i = 0; i < op.palette.size(); i++)
+            {
+                char color[8];
+                snprintf(color, sizeof(color), ":%06x", op.palette[i]);
+                name += color;
+            }
+            return name;
+        }
+    }
+    return "";
+}
+
+/**
+ * Tells whether an operation maps each pixel in place without moving it.
+ * Runs of these are fused into a single pass by run_pipeline().
+ * @param op The operation
+ * @return True for point operations, false for rotations, enlarging and resizing
+ */
+bool is_point_operation(const Operation& op)
+{
+    return op.kind != OP_ROTATE_90 && op.kind != OP_ROTATE && op.kind != OP_ENLARGE && op.kind != OP_RESIZE;
+}
+
+/**
+ * Applies a single operation with its process_N function
+ * @param image The input image
+ * @param op    The operation to apply
+ * @return the new image
+ */
+Image apply_operation(const Image& image, const Operation& op)
+{
+    switch (op.kind)
+    {
+        case OP_VIGNETTE: return process_1(image);
+        case OP_CLARENDON: return process_2(image, op.scaling_factor);
+        case OP_GRAYSCALE: return process_3(image);
+        case OP_ROTATE_90: return process_4(image);
+        case OP_ROTATE: return process_5(image, op.number);
+        case OP_ENLARGE: return process_6(image, op.x_scale, op.y_scale);
+        case OP_HIGH_CONTRAST: return process_7(image);
+        case OP_LIGHTEN: return process_8(image, op.scaling_factor);
+        case OP_DARKEN: return process_9(image, op.scaling_factor);
+        case OP_FIVE_COLOR: return process_10(image);
+        case OP_TONE_CURVE: return process_tone_curve(image, piecewise_linear_curve(op.curve_points));
+        case OP_RESIZE: return resize_image(image, op.width, op.height, op.filter);
+        case OP_PALETTE: return process_palette(image, op.palette);
+    }
+    return image;
+}
+
+// One stage of a fused pass: transforms row `row` of a rows x cols image from src into dst (src may equal dst)
+typedef function<void(const unsigned char* src, unsigned char* dst, int row, int rows, int cols)> RowStage;
+
+/**
+ * Turns a run of point operations into row stages. Neighbouring tone curve
+ * operations (lighten, darken, curve) are composed into one lookup table.
+ * @param ops   The operations
+ * @param first Index of the first operation of the run
+ * @param last  One past the last operation of the run
+ * @param rows  Height of the image the run works on
+ * @param cols  Width of the image the run works on
+ * @param bounded_memory True to skip caches that grow with the image (the vignette mask)
+ * @param first_col      Column the stages' rows start at, when they only cover part of each
+ *                       row; the stages' column count is then the number of pixels covered
+ * @return the row stages, in order
+ */
+vector<RowStage> compile_point_stages(const vector<Operation>& ops, size_t first, size_t last, int rows, int cols,
+                                      bool bounded_memory = false, int first_col = 0)
+{
+    const PointKernels& kernels = point_kernels();
+    vector<RowStage> stages;
+    for (size_t i = first; i < last; i++)
+    {
+        const Operation& op = ops[i];
+        if (op.kind == OP_LIGHTEN || op.kind == OP_DARKEN || op.kind == OP_TONE_CURVE)
+        {
+            // Compose this and any following curve operations into one table
+            ToneCurve composed = compile_tone_curve([](int value) { return value; });
+            size_t run_start = i;
+            for (; i < last && (ops[i].kind == OP_LIGHTEN || ops[i].kind == OP_DARKEN || ops[i].kind == OP_TONE_CURVE); i++)
+            {
+                ToneCurve curve = ops[i].kind == OP_LIGHTEN ? scaling_curve(CURVE_LIGHTEN, ops[i].scaling_factor)
+                                : ops[i].kind == OP_DARKEN ? scaling_curve(CURVE_DARKEN, ops[i].scaling_factor)
+                                : piecewise_linear_curve(ops[i].curve_points);
+                if (i == run_start)
+                {
+                    // A curve on its own keeps its fixed point form
+                    composed = curve;
+                    continue;
+                }
+                composed.fixed_point = false;
+                for (int value = 0; value < 256; value++)
+                {
+                    composed.table[value] = curve.table[composed.table[value]];
+                }
+            }
+            i--;
+            stages.push_back([composed, &kernels](const unsigned char* src, unsigned char* dst, int, int, int cols)
+            {
+                kernels.tone_curve(src, dst, cols * 3, composed);
+            });
+        }
+        else if (op.kind == OP_CLARENDON)
+        {
+            ToneCurve light = scaling_curve(CURVE_LIGHTEN, op.scaling_factor);
+            ToneCurve dark = scaling_curve(CURVE_DARKEN, op.scaling_factor);
+            stages.push_back([light, dark, &kernels](const unsigned char* src, unsigned char* dst, int, int, int cols)
+            {
+                kernels.clarendon(src, dst, cols, light, dark);
+            });
+        }
+        else if (op.kind == OP_GRAYSCALE)
+        {
+            stages.push_back([&kernels](const unsigned char* src, unsigned char* dst, int, int, int cols)
+            {
+                kernels.grayscale(src, dst, cols);
+            });
+        }
+        else if (op.kind == OP_HIGH_CONTRAST)
+        {
+            stages.push_back([&kernels](const unsigned char* src, unsigned char* dst, int, int, int cols)
+            {
+                kernels.high_contrast(src, dst, cols);
+            });
+        }
+        else if (op.kind == OP_FIVE_COLOR)
+        {
+            stages.push_back([&kernels](const unsigned char* src, unsigned char* dst, int, int, int cols)
+            {
+                kernels.five_color(src, dst, cols);
+            });
+        }
+        else if (op.kind == OP_PALETTE)
+        {
+            shared_ptr<const ColorLut> lut = palette_lut(op.palette);
+            stages.push_back([lut](const unsigned char* src, unsigned char* dst, int, int, int cols)
+            {
+                apply_color_lut(*lut, src, dst, cols);
+            });
+        }
+        else if (op.kind == OP_VIGNETTE)
+        {
+            // Without a mask (bounded memory, or an image too large for one) each scale is
+            // computed directly. The darkening depends on where a pixel is in the whole image.
+            shared_ptr<const VignetteMask> mask = bounded_memory ? nullptr : vignette_mask(rows, cols);
+            if (mask)
+            {
+                stages.push_back([mask, first_col](const unsigned char* src, unsigned char* dst, int row, int, int count)
+                {
+                    vignette_span(src, dst, row, first_col, first_col + count, *mask);
+                });
+            }
+            else
+            {
+                stages.push_back([rows, cols, first_col](const unsigned char* src, unsigned char* dst, int row, int, int count)
+                {
+                    vignette_span_unmasked(src, dst, row, rows, cols, first_col, first_col + count);
+                });
+            }
+        }
+    }
+    return stages;
+}
+
+/**
+ * Runs a recipe of operations for both run_pipeline() overloads. Each run of
+ * point operations is fused into one pass that carries every row through all
+ * of the run's stages while it is in cache; only rotations, enlarging and
+ * resizing materialise a new image. Once the pipeline owns its working image,
+ * point passes and the rotations rotate_image_in_place() handles reuse its buffer.
+ * @param source  The caller's image, read by the first step, or null if the pipeline already owns current
+ * @param current The working image (unused while source is set)
+ * @param ops     The operations, in order
+ * @return the resulting image
+ */
+Image run_pipeline_on(const Image* source, Image current, const vector<Operation>& ops)
+{
+    const Image& input_image = source != nullptr ? *source : current;
+    ScopedTrace trace("run_pipeline", "pipeline", (long long)input_image.width() * input_image.height());
+    size_t i = 0;
+    while (i < ops.size())
+    {
+        const Image& input = source != nullptr ? *source : current;
+        if (!is_point_operation(ops[i]))
+        {
+            // Rotate the working image in place where possible
+            int turns = ops[i].kind == OP_ROTATE_90 ? 1 : ops[i].kind == OP_ROTATE ? rotation_turns(ops[i].number) : -1;
+            if (source != nullptr || turns < 0 || current.layout() != LAYOUT_INTERLEAVED || !rotate_image_in_place(current, turns))
+            {
+                current = apply_operation(input, ops[i]);
+            }
+            source = nullptr;
+            i++;
+            continue;
+        }
+
+        size_t last = i;
+        while (last < ops.size() && is_point_operation(ops[last]))
+        {
+            last++;
+        }
+        // The first stage reads the input row and the rest work in place on the output row,
+        // which is the input row itself once the pipeline owns the image
+        int rows = input.height();
+        int cols = input.width();
+        ScopedTrace stage_trace("point_stages", "filter", (long long)rows * cols);
+        vector<RowStage> stages = compile_point_stages(ops, i, last, rows, cols);
+        if (source != nullptr)
+        {
+            current = Image(cols, rows, LAYOUT_INTERLEAVED, FILL_UNINITIALIZED);
+        }
+        parallel_rows(rows, [&](int first_row, int last_row)
+        {
+            for (int row = first_row; row < last_row; row++)
+            {
+                unsigned char* dst = current.row(row);
+                stages[0](input.row(row), dst, row, rows, cols);
+                for (size_t s = 1; s < stages.size(); s++)
+                {
+                    stages[s](dst, dst, row, rows, cols);
+                }
+            }
+        });
+        source = nullptr;
+        i = last;
+    }
+    if (source != nullptr)
+    {
+        return *source;
+    }
+    return current;
+}
+
+/**
+ * Runs a recipe of operations on an image, leaving the image unchanged
+ * @param image The input image
+ * @param ops   The operations, in order
+ * @return the resulting image
+ */
+Image run_pipeline(const Image& image, const vector<Operation>& ops)
+{
+    return run_pipeline_on(&image, Image(), ops);
+}
+
+/**
+ * Runs a recipe of operations on an image the caller no longer needs. Point
+ * operations then filter the image's own buffer in place instead of a new one.
+ * @param image The input image, moved in
+ * @param ops   The operations, in order
+ * @return the resulting image
+ */
+Image run_pipeline(Image&& image, const vector<Operation>& ops)
+{
+    return run_pipeline_on(nullptr, move(image), ops);
+}
+
+/**
+ * Reads exactly the requested number of bytes, retrying short reads
+ * @param fd    File descriptor to read from
+ * @param data  Where to store the bytes
+ * @param bytes Number of bytes to read
+ * @return True if every byte was read and false otherwise
+ */
+bool read_all(int fd, unsigned char* data, size_t bytes)
+{
+    while (bytes > 0)
+    {
+        ssize_t got = read(fd, data, bytes);
+        if (got < 0 && errno == EINTR)
+        {
+            continue;
+        }
+        if (got <= 0)
+        {
+            return false;
+        }
+        data += got;
+        bytes -= got;
+    }
+    return true;
+}
+
+// Number of bands of scanlines in flight while streaming
+const int STREAM_SLOTS = 4;
+
+/**
+ * Tells whether two paths name the same file, through links or otherwise
+ * @param a A path
+ * @param b Another path
+ * @return True if both exist and are the same file
+ */
+bool same_file(const string& a, const string& b)
+{
+    struct stat a_info, b_info;
+    return stat(a.c_str(), &a_info) == 0 && stat(b.c_str(), &b_info) == 0 &&
+           a_info.st_dev == b_info.st_dev && a_info.st_ino == b_info.st_ino;
+}
+
+/**
+ * Picks the file a result is written to before it takes the output's place.
+ * Writing the output directly would truncate the input while it is still
+ * being read if they are the same file, so a temporary file next to the
+ * output is used then, and renamed over it at the end (see finish_output()).
+ * @param input  The file the result is computed from
+ * @param output Where the result belongs
+ * @return the file to write
+ */
+string staging_output(const string& input, const string& output)
+{
+    return same_file(input, output) ? output + ".tmp" + to_string(getpid()) : output;
+}
+
+/**
+ * Moves a result written by way of staging_output() into place, or removes it if it failed
+ * @param target The file written
+ * @param output Where the result belongs
+ * @param ok     True if the result was written completely
+ * @return True if the output now holds the result
+ */
+bool finish_output(const string& target, const string& output, bool ok)
+{
+    if (target == output)
+    {
+        return ok;
+    }
+    if (ok && rename(target.c_str(), output.c_str()) == 0)
+    {
+        return true;
+    }
+    unlink(target.c_str());
+    return false;
+}
+
+// One band of scanlines in the streaming ring, in file (bottom-up) order
+struct StreamSlot
+{
+    enum State { FREE, READ, FILTERED };
+    vector<unsigned char> pixels; // 24-bit scanlines with zeroed padding, as they are written
+    int first;                    // Index of the band's first scanline in the file
+    int count;                    // Number of scanlines in the band
+    State state;
+};
+
+/**
+ * Runs a recipe of point operations from one BMP file to another without
+ * loading the image. A reader thread fills a ring of STREAM_SLOTS bands of
+ * scanlines, this thread filters them in place and a writer thread writes
+ * them out, so memory use depends on the image width but not its height.
+ * Scanlines are handled in file order (the bottom row first) and each one
+ * is filtered as image row (height - 1 - scanline), like every other path.
+ * @param input  BMP image to read
+ * @param output Where to write the result
+ * @param ops    The recipe; every step must be a point operation
+ * @return True if the result was written and false otherwise
+ */
+bool stream_recipe(const string& input, const string& output, const vector<Operation>& ops)
+{
+    for (size_t i = 0; i < ops.size(); i++)
+    {
+        if (!is_point_operation(ops[i]))
+        {
+            return false;
+        }
+    }
+
+    int in_fd = open(input.c_str(), O_RDONLY);
+    if (in_fd < 0)
+    {
+        return false;
+    }
+
+    BmpInfo info;
+    if (!read_bmp_info(in_fd, info) || lseek(in_fd, info.pixel_offset, SEEK_SET) != info.pixel_offset)
+    {
+        close(in_fd);
+        return false;
+    }
+    int width = info.width;
+    int height = info.height;
+    int bytes_per_pixel = info.bytes_per_pixel;
+    size_t in_row_size = info.row_size;
+    posix_fadvise(in_fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+    ScopedTrace trace("stream_recipe", "pipeline", (long long)width * height);
+
+    // Streaming reads the input while writing, so the result can't go straight over it
+    string target = staging_output(input, output);
+    int out_fd = open(target.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (out_fd < 0)
+    {
+        close(in_fd);
+        return false;
+    }
+    unsigned char header[54];
+    build_bmp_header(header, width, height);
+    bool failed = !write_all(out_fd, header, sizeof(header));
+
+    // Bands of roughly 1 MB, and never less than one scanline
+    int row_size = (width * 3 + 3) / 4 * 4;
+    int rows_per_slot = min(height, max(1, (1 << 20) / row_size));
+    int bands = (height + rows_per_slot - 1) / rows_per_slot;
+    vector<StreamSlot> slots(STREAM_SLOTS);
+    for (int s = 0; s < STREAM_SLOTS; s++)
+    {
+        slots[s].pixels.resize((size_t)rows_per_slot * row_size);
+        slots[s].state = StreamSlot::FREE;
+    }
+    vector<RowStage> stages = compile_point_stages(ops, 0, ops.size(), height, width, true);
+
+    mutex ring_mutex;
+    condition_variable ring_changed;
+
+    // Waits until band b's slot reaches a state, or until a stage fails
+    auto wait_for = [&](int b, StreamSlot::State state) -> StreamSlot*
+    {
+        unique_lock<mutex> lock(ring_mutex);
+        StreamSlot& slot = slots[b % STREAM_SLOTS];
+        ring_changed.wait(lock, [&]() { return failed || slot.state == state; });
+        return failed ? nullptr : &slot;
+    };
+    auto finish = [&](StreamSlot& slot, StreamSlot::State state, bool ok)
+    {
+        lock_guard<mutex> lock(ring_mutex);
+        slot.state = state;
+        failed = failed || !ok;
+        ring_changed.notify_all();
+    };
+
+    thread reader([&]()
+    {
+        vector<unsigned char> converted;
+        for (int b = 0; b < bands; b++)
+        {
+            StreamSlot* slot = wait_for(b, StreamSlot::FREE);
+            if (slot == nullptr)
+            {
+                return;
+            }
+            slot->first = b * rows_per_slot;
+            slot->count = min(rows_per_slot, height - slot->first);
+            unsigned char* pixels = slot->pixels.data();
+            ScopedTrace band_trace("stream_read", "io", (long long)slot->count * width);
+            band_trace.add_bytes_read((long long)slot->count * in_row_size);
+            bool ok;
+            if (bytes_per_pixel == 3)
+            {
+                // Scanlines arrive exactly as they are written; only the padding needs clearing
+                ok = read_all(in_fd, pixels, (size_t)slot->count * row_size);
+                for (int r = 0; r < slot->count && width * 3 < row_size; r++)
+                {
+                    memset(pixels + (size_t)r * row_size + width * 3, 0, row_size - width * 3);
+                }
+            }
+            else
+            {
+                // Drop the alpha channel of 32-bit scanlines
+                converted.resize((size_t)slot->count * in_row_size);
+                ok = read_all(in_fd, converted.data(), converted.size());
+                for (int r = 0; r < slot->count && ok; r++)
+                {
+                    const unsigned char* src = converted.data() + (size_t)r * in_row_size;
+                    unsigned char* dst = pixels + (size_t)r * row_size;
+                    for (int col = 0; col < width; col++)
+                    {
+                        dst[0] = src[0];
+                        dst[1] = src[1];
+                        dst[2] = src[2];
+                        src += bytes_per_pixel;
+                        dst += 3;
+                    }
+                    memset(dst, 0, row_size - width * 3);
+                }
+            }
+            finish(*slot, StreamSlot::READ, ok);
+        }
+    });
+
+    thread writer([&]()
+    {
+        for (int b = 0; b < bands; b++)
+        {
+            StreamSlot* slot = wait_for(b, StreamSlot::FILTERED);
+            if (slot == nullptr)
+            {
+                return;
+            }
+            ScopedTrace band_trace("stream_write", "io", (long long)slot->count * width);
+            band_trace.add_bytes_written((long long)slot->count * row_size);
+            bool ok = write_all(out_fd, slot->pixels.data(), (size_t)slot->count * row_size);
+            finish(*slot, StreamSlot::FREE, ok);
+        }
+    });
+
+    for (int b = 0; b < bands; b++)
+    {
+        StreamSlot* slot = wait_for(b, StreamSlot::READ);
+        if (slot == nullptr)
+        {
+            break;
+        }
+        ScopedTrace band_trace("stream_filter", "filter", (long long)slot->count * width);
+        parallel_rows(slot->count, [&](int first_row, int last_row)
+        {
+            for (int r = first_row; r < last_row; r++)
+            {
+                // BMP files store pixels from bottom to top
+                int row = (height - 1) - (slot->first + r);
+                unsigned char* pixels = slot->pixels.data() + (size_t)r * row_size;
+                for (size_t s = 0; s < stages.size(); s++)
+                {
+                    stages[s](pixels, pixels, row, height, width);
+                }
+            }
+        });
+        finish(*slot, StreamSlot::FILTERED, true);
+    }
+
+    reader.join();
+    writer.join();
+    close(in_fd);
+    if (close(out_fd) != 0)
+    {
+        failed = true;
+    }
+    trace.add_bytes_read((long long)height * in_row_size);
+    trace.add_bytes_written(sizeof(header) + (long long)height * row_size);
+    return finish_output(target, output, !failed);
+}
+
+// Settings for working on images too large to load
+struct OutOfCoreOptions
+{
+    size_t memory_budget;     // Bytes of pixel buffers to use at most (roughly)
+    string scratch_directory; // Where tiles and intermediate images are kept
+};
+
+/**
+ * Creates an empty scratch file
+ * @param directory Where to create it
+ * @param name      Gets the file's path
+ * @return the open file descriptor, or -1 if the file couldn't be created
+ */
+int make_scratch_file(const string& directory, string& name)
+{
+    string pattern = (directory.empty() ? string(".") : directory) + "/image-editor-XXXXXX";
+    vector<char> path(pattern.begin(), pattern.end());
+    path.push_back('\0');
+    int fd = mkstemp(path.data());
+    name = fd >= 0 ? string(path.data()) : "";
+    return fd;
+}
+
+/**
+ * Copies one scanline's pixels as 24-bit BGR, dropping any alpha channel
+ * @param src             Source pixels
+ * @param dst             Destination pixels
+ * @param pixels          Number of pixels
+ * @param bytes_per_pixel 3 for BGR, 4 for BGRA sources
+ * @return nothing
+ */
+void copy_bgr(const unsigned char* src, unsigned char* dst, int pixels, int bytes_per_pixel)
+{
+    if (bytes_per_pixel == 3)
+    {
+        memcpy(dst, src, (size_t)pixels * 3);
+        return;
+    }
+    for (int p = 0; p < pixels; p++)
+    {
+        dst[0] = src[0];
+        dst[1] = src[1];
+        dst[2] = src[2];
+        src += bytes_per_pixel;
+        dst += 3;
+    }
+}
+
+// Smallest tile side rotate_out_of_core() cuts an image into
+const int ROTATE_MIN_TILE = 64;
+
+/**
+ * Rotates a BMP file by quarter turns clockwise without loading it. The
+ * source is first cut into square tiles in a scratch file, reading it front
+ * to back a strip of tile rows at a time. The output is then assembled a
+ * band of tile rows at a time, from the bottom band up, so it is also
+ * written front to back; each band reads just the tiles that land in it.
+ * The tile side is picked so a strip, its tiles and a band fit the budget.
+ * @param input         BMP image to rotate
+ * @param output        Where to write the result
+ * @param quarter_turns Number of 90 degree clockwise turns (any integer)
+ * @param options       Memory budget and scratch directory
+ * @return True if the result was written and false otherwise
+ */
+bool rotate_out_of_core(const string& input, const string& output, int quarter_turns, const OutOfCoreOptions& options)
+{
+    int turns = ((quarter_turns % 4) + 4) % 4;
+    int in_fd = open(input.c_str(), O_RDONLY);
+    BmpInfo info;
+    if (in_fd < 0 || !read_bmp_info(in_fd, info))
+    {
+        if (in_fd >= 0)
+        {
+            close(in_fd);
+        }
+        return false;
+    }
+    int width = info.width;
+    int height = info.height;
+    int out_width = turns % 2 == 1 ? height : width;
+    int out_height = turns % 2 == 1 ? width : height;
+    size_t out_row_size = ((size_t)out_width * 3 + 3) / 4 * 4;
+    ScopedTrace trace("rotate_out_of_core", "pipeline", (long long)width * height);
+    trace.add_bytes_read((long long)height * info.row_size);
+    trace.add_bytes_written(54 + (long long)out_height * out_row_size);
+
+    // Largest power of two tile side (up to 2048) whose buffers fit the budget,
+    // counting the tile each filter thread holds while the bands are assembled.
+    // Smaller tiles than ROTATE_MIN_TILE would mean millions of tiny scratch file reads.
+    int tile = 2048;
+    size_t threads = filter_pool().size();
+    while (true)
+    {
+        size_t tiles_x = (width + tile - 1) / tile;
+        size_t strip = tile * (info.row_size + tiles_x * tile * 3);
+        size_t band = tile * out_row_size + threads * tile * tile * 3;
+        if (strip + band <= options.memory_budget)
+        {
+            break;
+        }
+        if (tile == ROTATE_MIN_TILE)
+        {
+            cout << "--memory is too small to rotate a " << width << "x" << height << " image (it needs at least "
+                 << (strip + band + (1 << 20) - 1) / (1 << 20) << " MB)" << "\n";
+            close(in_fd);
+            return false;
+        }
+        tile /= 2;
+    }
+    int tiles_x = (width + tile - 1) / tile;
+    int tiles_y = (height + tile - 1) / tile;
+    size_t tile_bytes = (size_t)tile * tile * 3;
+
+    // The scratch file is unlinked straight away and disappears when closed
+    string tile_name;
+    int tile_fd = make_scratch_file(options.scratch_directory, tile_name);
+    string target = staging_output(input, output);
+    int out_fd = open(target.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (tile_fd >= 0)
+    {
+        unlink(tile_name.c_str());
+    }
+    bool ok = tile_fd >= 0 && out_fd >= 0;
+
+    // Cut the source into tiles, bottom strip first so the file is read front to back
+    {
+        vector<unsigned char> strip(ok ? (size_t)tile * info.row_size : 0);
+        vector<unsigned char> packed(ok ? tiles_x * tile_bytes : 0);
+        for (int ty = tiles_y - 1; ty >= 0 && ok; ty--)
+        {
+            int y0 = ty * tile;
+            int strip_rows = min(tile, height - y0);
+            off_t offset = info.pixel_offset + (off_t)(height - y0 - strip_rows) * info.row_size;
+            ok = pread_all(in_fd, strip.data(), strip_rows * info.row_size, offset);
+            for (int r = 0; r < strip_rows && ok; r++)
+            {
+                // BMP files store pixels from bottom to top
+                const unsigned char* src = strip.data() + (strip_rows - 1 - r) * info.row_size;
+                for (int tx = 0; tx < tiles_x; tx++)
+                {
+                    int tile_width = min(tile, width - tx * tile);
+                    copy_bgr(src + (size_t)tx * tile * info.bytes_per_pixel,
+                             packed.data() + tx * tile_bytes + (size_t)r * tile_width * 3, tile_width, info.bytes_per_pixel);
+                }
+            }
+            ok = ok && pwrite_all(tile_fd, packed.data(), tiles_x * tile_bytes, (off_t)ty * tiles_x * tile_bytes);
+        }
+    }
+
+    unsigned char header[54];
+    build_bmp_header(header, out_width, out_height);
+    ok = ok && pwrite_all(out_fd, header, sizeof(header), 0);
+
+    // Assemble the output a band of rows at a time, kept in file (bottom-up) order
+    vector<unsigned char> band(ok ? (size_t)tile * out_row_size : 0, 0);
+    for (int b = (out_height - 1) / tile; b >= 0 && ok; b--)
+    {
+        int oy0 = b * tile;
+        int oy1 = min(out_height, oy0 + tile);
+
+        // Source pixels that land in output rows oy0 to oy1 - 1
+        int sx0 = 0, sx1 = width, sy0 = 0, sy1 = height;
+        if (turns == 0)
+        {
+            sy0 = oy0;
+            sy1 = oy1;
+        }
+        else if (turns == 1)
+        {
+            sx0 = oy0;
+            sx1 = oy1;
+        }
+        else if (turns == 2)
+        {
+            sy0 = height - oy1;
+            sy1 = height - oy0;
+        }
+        else
+        {
+            sx0 = width - oy1;
+            sx1 = width - oy0;
+        }
+
+        vector<pair<int, int>> tiles;
+        for (int ty = sy0 / tile; ty <= (sy1 - 1) / tile; ty++)
+        {
+            for (int tx = sx0 / tile; tx <= (sx1 - 1) / tile; tx++)
+            {
+                tiles.push_back(make_pair(tx, ty));
+            }
+        }
+
+        // Tiles fill disjoint parts of the band, so they can be read and placed in parallel
+        atomic<bool> read_ok(true);
+        parallel_rows(tiles.size(), [&](int first_tile, int last_tile)
+        {
+            vector<unsigned char> pixels(tile_bytes);
+            for (int t = first_tile; t < last_tile; t++)
+            {
+                int tx = tiles[t].first;
+                int ty = tiles[t].second;
+                int tile_width = min(tile, width - tx * tile);
+                int tile_height = min(tile, height - ty * tile);
+                if (!pread_all(tile_fd, pixels.data(), (size_t)tile_width * tile_height * 3, ((off_t)ty * tiles_x + tx) * tile_bytes))
+                {
+                    read_ok = false;
+                    return;
+                }
+
+                int x0 = max(sx0, tx * tile);
+                int x1 = min(sx1, tx * tile + tile_width);
+                for (int y = max(sy0, ty * tile); y < min(sy1, ty * tile + tile_height); y++)
+                {
+                    // Where source pixel (x0, y) goes, and how far one step in x moves it
+                    int ox, oy;
+                    ptrdiff_t step;
+                    if (turns == 0)
+                    {
+                        ox = x0;
+                        oy = y;
+                        step = 3;
+                    }
+                    else if (turns == 1)
+                    {
+                        ox = (height - 1) - y;
+                        oy = x0;
+                        step = -(ptrdiff_t)out_row_size;
+                    }
+                    else if (turns == 2)
+                    {
+                        ox = (width - 1) - x0;
+                        oy = (height - 1) - y;
+                        step = -3;
+                    }
+                    else
+                    {
+                        ox = y;
+                        oy = (width - 1) - x0;
+                        step = out_row_size;
+                    }
+                    const unsigned char* src = pixels.data() + ((size_t)(y - ty * tile) * tile_width + (x0 - tx * tile)) * 3;
+                    unsigned char* dst = band.data() + (size_t)(oy1 - 1 - oy) * out_row_size + (size_t)ox * 3;
+                    for (int x = x0; x < x1; x++)
+                    {
+                        dst[0] = src[0];
+                        dst[1] = src[1];
+                        dst[2] = src[2];
+                        src += 3;
+                        dst += step;
+                    }
+                }
+            }
+        });
+        ok = read_ok && pwrite_all(out_fd, band.data(), (oy1 - oy0) * out_row_size, 54 + (off_t)(out_height - oy1) * out_row_size);
+    }
+
+    close(in_fd);
+    if (tile_fd >= 0)
+    {
+        close(tile_fd);
+    }
+    if (out_fd >= 0 && close(out_fd) != 0)
+    {
+        ok = false;
+    }
+    return out_fd >= 0 && finish_output(target, output, ok);
+}
+
+/**
+ * Enlarges a BMP file like process_6 without loading it. Source scanline k
+ * (in file order) becomes output scanlines k * y_scale to k * y_scale +
+ * y_scale - 1, so both files are simply walked front to back.
+ * @param input   BMP image to enlarge
+ * @param output  Where to write the result
+ * @param x_scale Horizontal scale factor
+ * @param y_scale Vertical scale factor
+ * @param options Memory budget (the scratch directory isn't needed)
+ * @return True if the result was written and false otherwise
+ */
+bool enlarge_out_of_core(const string& input, const string& output, int x_scale, int y_scale, const OutOfCoreOptions& options)
+{
+    int in_fd = open(input.c_str(), O_RDONLY);
+    BmpInfo info;
+    if (in_fd < 0 || !read_bmp_info(in_fd, info) || x_scale <= 0 || y_scale <= 0 ||
+        (long long)info.width * x_scale > INT_MAX || (long long)info.height * y_scale > INT_MAX)
+    {
+        if (in_fd >= 0)
+        {
+            close(in_fd);
+        }
+        return false;
+    }
+    int width = info.width;
+    int height = info.height;
+    int out_width = width * x_scale;
+    size_t out_row_size = ((size_t)out_width * 3 + 3) / 4 * 4;
+    posix_fadvise(in_fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+    ScopedTrace trace("enlarge_out_of_core", "pipeline", (long long)out_width * height * y_scale);
+    trace.add_bytes_read((long long)height * info.row_size);
+    trace.add_bytes_written(54 + (long long)height * y_scale * out_row_size);
+
+    string target = staging_output(input, output);
+    int out_fd = open(target.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    unsigned char header[54];
+    build_bmp_header(header, out_width, height * y_scale);
+    bool ok = out_fd >= 0 && write_all(out_fd, header, sizeof(header));
+
+    // Half the budget for source scanlines and half for output scanlines waiting to be written
+    int rows_per_read = max(1, (int)min<size_t>(height, options.memory_budget / 2 / info.row_size));
+    size_t rows_per_write = max<size_t>(y_scale, options.memory_budget / 2 / out_row_size);
+    vector<unsigned char> strip(ok ? rows_per_read * info.row_size : 0);
+    vector<unsigned char> pending(ok ? rows_per_write * out_row_size : 0, 0);
+    size_t used = 0;
+    for (int first = 0; first < height && ok; first += rows_per_read)
+    {
+        int rows = min(rows_per_read, height - first);
+        ok = pread_all(in_fd, strip.data(), rows * info.row_size, info.pixel_offset + (off_t)first * info.row_size);
+        for (int r = 0; r < rows && ok; r++)
+        {
+            if (used + y_scale * out_row_size > pending.size())
+            {
+                ok = write_all(out_fd, pending.data(), used);
+                used = 0;
+            }
+
+            // Widen the scanline once, repeating every pixel x_scale times...
+            const unsigned char* src = strip.data() + r * info.row_size;
+            unsigned char* wide = pending.data() + used;
+            unsigned char* dst = wide;
+            for (int col = 0; col < width; col++)
+            {
+                for (int copy = 0; copy < x_scale; copy++)
+                {
+                    dst[0] = src[0];
+                    dst[1] = src[1];
+                    dst[2] = src[2];
+                    dst += 3;
+                }
+                src += info.bytes_per_pixel;
+            }
+            memset(dst, 0, out_row_size - (size_t)out_width * 3);
+
+            // ...then repeat it for the rest of the scanlines it covers
+            for (int copy = 1; copy < y_scale; copy++)
+            {
+                memcpy(wide + copy * out_row_size, wide, out_row_size);
+            }
+            used += y_scale * out_row_size;
+        }
+    }
+    ok = ok && write_all(out_fd, pending.data(), used);
+
+    close(in_fd);
+    if (out_fd >= 0 && close(out_fd) != 0)
+    {
+        ok = false;
+    }
+    return out_fd >= 0 && finish_output(target, output, ok);
+}
+
+/**
+ * Runs a recipe from one BMP file to another without loading the image.
+ * Each run of point operations is streamed and each rotation or enlarging
+ * runs out of core, going through intermediate files in the scratch
+ * directory. Resizing needs the whole image and isn't supported.
+ * @param input   BMP image to read
+ * @param output  Where to write the result
+ * @param ops     The recipe
+ * @param options Memory budget and scratch directory
+ * @return True if the result was written and false otherwise
+ */
+bool run_recipe_out_of_core(const string& input, const string& output, const vector<Operation>& ops, const OutOfCoreOptions& options)
+{
+    string current = input;
+    vector<string> scratch_files;
+    bool ok = true;
+    size_t i = 0;
+    while (i < ops.size() && ok)
+    {
+        size_t last = i + 1;
+        while (is_point_operation(ops[i]) && last < ops.size() && is_point_operation(ops[last]))
+        {
+            last++;
+        }
+
+        string target = output;
+        if (last < ops.size())
+        {
+            int fd = make_scratch_file(options.scratch_directory, target);
+            if (fd < 0)
+            {
+                ok = false;
+                break;
+            }
+            close(fd);
+            scratch_files.push_back(target);
+        }
+
+        const Operation& op = ops[i];
+        if (is_point_operation(op))
+        {
+            ok = stream_recipe(current, target, vector<Operation>(ops.begin() + i, ops.begin() + last));
+        }
+        else if (op.kind == OP_ROTATE_90 || op.kind == OP_ROTATE)
+        {
+            ok = rotate_out_of_core(current, target, op.kind == OP_ROTATE_90 ? 1 : rotation_turns(op.number), options);
+        }
+        else if (op.kind == OP_ENLARGE)
+        {
+            ok = enlarge_out_of_core(current, target, op.x_scale, op.y_scale, options);
+        }
+        else
+        {
+            ok = false;
+        }
+        current = target;
+        i = last;
+    }
+
+    for (size_t f = 0; f < scratch_files.size(); f++)
+    {
+        unlink(scratch_files[f].c_str());
+    }
+    return ok;
+}
+
+/**
+ * Estimates the most memory a recipe needs when run on a loaded image
+ * @param width  Width of the input image
+ * @param height Height of the input image
+ * @param ops    The recipe
+ * @return the largest input plus output image size over the steps, in bytes
+ */
+size_t recipe_peak_bytes(int width, int height, const vector<Operation>& ops)
+{
+    size_t peak = 0;
+    for (size_t i = 0; i <= ops.size(); i++)
+    {
+        size_t bytes = ((size_t)width * 3 + 3) / 4 * 4 * height;
+        if (i < ops.size())
+        {
+            if (ops[i].kind == OP_ROTATE_90 || (ops[i].kind == OP_ROTATE && rotation_turns(ops[i].number) % 2 == 1))
+            {
+                swap(width, height);
+            }
+            else if (ops[i].kind == OP_ENLARGE)
+            {
+                width = (int)min<long long>(INT_MAX, (long long)width * ops[i].x_scale);
+                height = (int)min<long long>(INT_MAX, (long long)height * ops[i].y_scale);
+            }
+            else if (ops[i].kind == OP_RESIZE)
+            {
+                width = ops[i].width;
+                height = ops[i].height;
+            }
+        }
+        bytes += ((size_t)width * 3 + 3) / 4 * 4 * height;
+        peak = max(peak, bytes);
+    }
+    return peak;
+}
+
+/**
+ * Rotates a 64 bit value left
+ * @param value The value
+ * @param bits  Number of bits to rotate by (1 to 63)
+ * @return the rotated value
+ */
+inline unsigned long long rotate_left(unsigned long long value, int bits)
+{
+    return (value << bits) | (value >> (64 - bits));
+}
+
+// Multipliers of the xxHash64 algorithm, which hash_bytes() follows
+const unsigned long long HASH_PRIME_1 = 0x9E3779B185EBCA87ULL;
+const unsigned long long HASH_PRIME_2 = 0xC2B2AE3D27D4EB4FULL;
+const unsigned long long HASH_PRIME_3 = 0x165667B19E3779F9ULL;
+const unsigned long long HASH_PRIME_4 = 0x85EBCA77C2B2AE63ULL;
+const unsigned long long HASH_PRIME_5 = 0x27D4EB2F165667C5ULL;
+
+inline unsigned long long hash_round(unsigned long long accumulator, unsigned long long input)
+{
+    return rotate_left(accumulator + input * HASH_PRIME_2, 31) * HASH_PRIME_1;
+}
+
+inline unsigned long long hash_merge(unsigned long long hash, unsigned long long accumulator)
+{
+    return (hash ^ hash_round(0, accumulator)) * HASH_PRIME_1 + HASH_PRIME_4;
+}
+
+/**
+ * Hashes bytes with xxHash64, which runs at several GB/s per core
+ * @param data  The bytes
+ * @param bytes Number of bytes
+ * @param seed  Starting value, so the same bytes can give independent hashes
+ * @return the 64 bit hash
+ */
+unsigned long long hash_bytes(const unsigned char* data, size_t bytes, unsigned long long seed)
+{
+    const unsigned char* end = data + bytes;
+    unsigned long long hash;
+    if (bytes >= 32)
+    {
+        unsigned long long lanes[4] = {seed + HASH_PRIME_1 + HASH_PRIME_2, seed + HASH_PRIME_2, seed, seed - HASH_PRIME_1};
+        for (; data + 32 <= end; data += 32)
+        {
+            for (int lane = 0; lane < 4; lane++)
+            {
+                unsigned long long word;
+                memcpy(&word, data + lane * 8, 8);
+                lanes[lane] = hash_round(lanes[lane], word);
+            }
+        }
+        hash = rotate_left(lanes[0], 1) + rotate_left(lanes[1], 7) + rotate_left(lanes[2], 12) + rotate_left(lanes[3], 18);
+        for (int lane = 0; lane < 4; lane++)
+        {
+            hash = hash_merge(hash, lanes[lane]);
+        }
+    }
+    else
+    {
+        hash = seed + HASH_PRIME_5;
+    }
+    hash += bytes;
+
+    for (; data + 8 <= end; data += 8)
+    {
+        unsigned long long word;
+        memcpy(&word, data, 8);
+        hash = rotate_left(hash ^ hash_round(0, word), 27) * HASH_PRIME_1 + HASH_PRIME_4;
+    }
+    if (data + 4 <= end)
+    {
+        unsigned int word;
+        memcpy(&word, data, 4);
+        hash = rotate_left(hash ^ (word * HASH_PRIME_1), 23) * HASH_PRIME_2 + HASH_PRIME_3;
+        data += 4;
+    }
+    for (; data < end; data++)
+    {
+        hash = rotate_left(hash ^ (*data * HASH_PRIME_5), 11) * HASH_PRIME_1;
+    }
+
+    hash ^= hash >> 33;
+    hash *= HASH_PRIME_2;
+    hash ^= hash >> 29;
+    hash *= HASH_PRIME_3;
+    hash ^= hash >> 32;
+    return hash;
+}
+
+// Bytes of a file hashed by one task of hash_file()
+const size_t HASH_CHUNK_BYTES = 4 << 20;
+
+/**
+ * Hashes the contents of a file. The file is mapped and cut into chunks that
+ * are hashed on the filter threads, then the chunk hashes are hashed together.
+ * @param filename The file
+ * @param hash     The hash of the file's contents
+ * @return True if the file could be read and false otherwise
+ */
+bool hash_file(const string& filename, unsigned long long& hash)
+{
+    int fd = open(filename.c_str(), O_RDONLY);
+    if (fd < 0)
+    {
+        return false;
+    }
+    struct stat info;
+    if (fstat(fd, &info) != 0 || info.st_size <= 0)
+    {
+        close(fd);
+        return false;
+    }
+    size_t bytes = info.st_size;
+    ScopedTrace trace("hash_file", "cache");
+    trace.add_bytes_read(bytes);
+    void* mapped = mmap(nullptr, bytes, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (mapped == MAP_FAILED)
+    {
+        return false;
+    }
+    madvise(mapped, bytes, MADV_SEQUENTIAL);
+
+    const unsigned char* data = (const unsigned char*)mapped;
+    int chunks = (int)((bytes + HASH_CHUNK_BYTES - 1) / HASH_CHUNK_BYTES);
+    vector<unsigned long long> chunk_hashes(chunks);
+    parallel_rows(chunks, [&](int first, int last)
+    {
+        for (int chunk = first; chunk < last; chunk++)
+        {
+            size_t offset = (size_t)chunk * HASH_CHUNK_BYTES;
+            chunk_hashes[chunk] = hash_bytes(data + offset, min(HASH_CHUNK_BYTES, bytes - offset), chunk);
+        }
+    });
+    munmap(mapped, bytes);
+    hash = hash_bytes((const unsigned char*)chunk_hashes.data(), chunks * sizeof(unsigned long long), bytes);
+    return true;
+}
+
+/**
+ * Replaces a file that has other hard links with nothing, so writing the
+ * path afterwards creates a new file instead of changing the shared one
+ * (outputs from older builds can be hard links to cache entries).
+ * The input is never removed, even when the output is one of its links.
+ * @param input    The file the result is computed from
+ * @param filename The file about to be written
+ * @return nothing
+ */
+void detach_output(const string& input, const string& filename)
+{
+    struct stat info;
+    if (lstat(filename.c_str(), &info) == 0 && S_ISREG(info.st_mode) && info.st_nlink > 1 &&
+        !same_file(input, filename))
+    {
+        unlink(filename.c_str());
+    }
+}
+
+/**
+ * Makes a copy-on-write clone of a file, which shares the original's disk
+ * blocks until either is changed (btrfs, XFS and other file systems with reflinks)
+ * @param source      File to clone
+ * @param destination New file to create (must not exist)
+ * @return True if the clone was made and false if the file system can't clone
+ */
+bool clone_file(const string& source, const string& destination)
+{
+#ifdef FICLONE
+    int in_fd = open(source.c_str(), O_RDONLY);
+    if (in_fd < 0)
+    {
+        return false;
+    }
+    int out_fd = open(destination.c_str(), O_WRONLY | O_CREAT | O_EXCL, 0644);
+    bool ok = out_fd >= 0 && ioctl(out_fd, FICLONE, in_fd) == 0;
+    close(in_fd);
+    if (out_fd >= 0)
+    {
+        ok = close(out_fd) == 0 && ok;
+        if (!ok)
+        {
+            unlink(destination.c_str());
+        }
+    }
+    return ok;
+#else
+    (void)source;
+    (void)destination;
+    return false;
+#endif
+}
+
+/**
+ * Copies a whole file
+ * @param source      File to copy
+ * @param destination New file to create (must not exist)
+ * @return True if the copy was made and false otherwise
+ */
+bool copy_file(const string& source, const string& destination)
+{
+    int in_fd = open(source.c_str(), O_RDONLY);
+    if (in_fd < 0)
+    {
+        return false;
+    }
+    int out_fd = open(destination.c_str(), O_WRONLY | O_CREAT | O_EXCL, 0644);
+    if (out_fd < 0)
+    {
+        close(in_fd);
+        return false;
+    }
+    vector<unsigned char> buffer(1 << 20);
+    bool ok = true;
+    while (ok)
+    {
+        ssize_t got = read(in_fd, buffer.data(), buffer.size());
+        if (got < 0 && errno == EINTR)
+        {
+            continue;
+        }
+        if (got <= 0)
+        {
+            ok = got == 0;
+            break;
+        }
+        ok = write_all(out_fd, buffer.data(), got);
+    }
+    close(in_fd);
+    ok = close(out_fd) == 0 && ok;
+    if (!ok)
+    {
+        unlink(destination.c_str());
+    }
+    return ok;
+}
+
+// Bumped whenever a filter's output changes, so older cache entries are never used
+const unsigned long long RESULT_CACHE_VERSION = 1;
+
+// On-disk cache of batch results, addressed by the hash of the input file
+// and the canonical text of the operations applied to it. Entries are plain
+// read-only BMP files named after their key; the least recently used are
+// deleted once the directory outgrows its size limit (each hit refreshes
+// an entry's modification time). Safe to share between processes: entries
+// are written under a temporary name and renamed into place.
+class ResultCache
+{
+public:
+    ResultCache(const string& directory, size_t limit) : directory_(directory), limit_(limit) {}
+
+    bool enabled() const { return !directory_.empty(); }
+
+    /**
+     * Builds the key of the result of applying the first steps of a recipe to an input
+     * @param input_hash Hash of the input file, from hash_file()
+     * @param ops        The recipe
+     * @param count      Number of steps applied
+     * @return the key, as 16 hex digits
+     */
+    static string key(unsigned long long input_hash, const vector<Operation>& ops, size_t count)
+    {
+        string recipe;
+        for (size_t i = 0; i < count; i++)
+        {
+            recipe += (i > 0 ? "," : "") + operation_name(ops[i]);
+        }
+        unsigned long long hash = hash_bytes((const unsigned char*)recipe.data(), recipe.size(),
+                                             input_hash ^ RESULT_CACHE_VERSION);
+        char text[17];
+        snprintf(text, sizeof(text), "%016llx", hash);
+        return text;
+    }
+
+    /**
+     * Tells whether an entry is cached
+     * @param key The entry's key
+     * @return True if it is and false otherwise
+     */
+    bool contains(const string& key) const
+    {
+        struct stat info;
+        return stat(path(key).c_str(), &info) == 0;
+    }
+
+    /**
+     * Hands a cached result out to a file: as a copy-on-write clone if the
+     * file system supports it, otherwise as a copy. Never as a hard link, so
+     * writing the output later can't change the entry. The file appears
+     * complete or not at all, and always as a new file.
+     * @param key    The entry's key
+     * @param output Where the result is wanted
+     * @return True if the entry was cached and handed out, false otherwise
+     */
+    bool fetch(const string& key, const string& output) const
+    {
+        ScopedTrace trace("cache_fetch", "cache");
+        string entry = path(key);
+        string temporary = temporary_name(output);
+        bool ok = clone_file(entry, temporary) || copy_file(entry, temporary);
+        if (ok && rename(temporary.c_str(), output.c_str()) != 0)
+        {
+            unlink(temporary.c_str());
+            ok = false;
+        }
+        if (ok)
+        {
+            // Mark the entry as recently used
+            utimensat(AT_FDCWD, entry.c_str(), nullptr, 0);
+        }
+        return ok;
+    }
+
+    /**
+     * Loads a cached result
+     * @param key The entry's key
+     * @return the image, or an empty image if the entry is not cached
+     */
+    Image load(const string& key) const
+    {
+        Image image = read_image_fast(path(key));
+        if (!image.empty())
+        {
+            utimensat(AT_FDCWD, path(key).c_str(), nullptr, 0);
+        }
+        return image;
+    }
+
+    /**
+     * Adds a result to the cache
+     * @param key   The entry's key
+     * @param image The result
+     * @return True if the entry was written and false otherwise
+     */
+    bool store(const string& key, const Image& image) const
+    {
+        ScopedTrace trace("cache_store", "cache");
+        string entry = path(key);
+        string temporary = temporary_name(entry);
+        // Read-only, so an output that is still a hard link to an entry can't be written through
+        bool ok = write_image_fast(temporary, image) && chmod(temporary.c_str(), 0444) == 0 &&
+                  rename(temporary.c_str(), entry.c_str()) == 0;
+        if (!ok)
+        {
+            unlink(temporary.c_str());
+        }
+        return ok;
+    }
+
+    /**
+     * Deletes the least recently used entries until the cache fits its size limit
+     * @return nothing
+     */
+    void trim() const
+    {
+        static mutex trim_mutex;
+        lock_guard<mutex> lock(trim_mutex);
+        DIR* directory = opendir(directory_.c_str());
+        if (directory == nullptr)
+        {
+            return;
+        }
+        vector<pair<long long, pair<size_t, string>>> entries; // (used ns, (bytes, path))
+        size_t total = 0;
+        while (struct dirent* found = readdir(directory))
+        {
+            string name = found->d_name;
+            struct stat info;
+            if (name.size() != 20 || name.compare(16, 4, ".bmp") != 0 || stat(path(name.substr(0, 16)).c_str(), &info) != 0)
+            {
+                continue;
+            }
+            long long used = (long long)info.st_mtim.tv_sec * 1000000000LL + info.st_mtim.tv_nsec;
+            entries.push_back(make_pair(used, make_pair((size_t)info.st_size, path(name.substr(0, 16)))));
+            total += info.st_size;
+        }
+        closedir(directory);
+        sort(entries.begin(), entries.end());
+        for (size_t i = 0; i < entries.size() && total > limit_; i++)
+        {
+            unlink(entries[i].second.second.c_str());
+            total -= entries[i].second.first;
+        }
+    }
+
+private:
+    string path(const string& key) const
+    {
+        return directory_ + "/" + key + ".bmp";
+    }
+
+    // A name next to the file that no other thread or process will pick
+    static string temporary_name(const string& filename)
+    {
+        static atomic<unsigned int> counter(0);
+        return filename + ".tmp" + to_string(getpid()) + "_" + to_string(counter++);
+    }
+
+    string directory_;
+    size_t limit_;
+};
+
+// A rectangle of pixels; x is the column and y the row (from the top) of its top left corner
+struct Rect
+{
+    int x;
+    int y;
+    int width;
+    int height;
+};
+
+/**
+ * Parses a region given as "X,Y,WIDTH,HEIGHT"
+ * @param text   The region
+ * @param region The parsed rectangle
+ * @return True if the text is a valid region and false otherwise
+ */
+bool parse_region(const string& text, Rect& region)
+{
+    char extra = 0;
+    if (sscanf(text.c_str(), "%d,%d,%d,%d%c", &region.x, &region.y, &region.width, &region.height, &extra) != 4)
+    {
+        return false;
+    }
+    return region.x >= 0 && region.y >= 0 && region.width > 0 && region.height > 0;
+}
+
+/**
+ * Clips a region to an image
+ * @param region The region
+ * @param cols   Width of the image
+ * @param rows   Height of the image
+ * @return the part of the region inside the image (0 x 0 if there is none)
+ */
+Rect clip_region(const Rect& region, int cols, int rows)
+{
+    long long left = max(0, region.x);
+    long long top = max(0, region.y);
+    long long right = min<long long>(cols, (long long)region.x + region.width);
+    long long bottom = min<long long>(rows, (long long)region.y + region.height);
+    Rect clipped = {0, 0, 0, 0};
+    if (right > left && bottom > top)
+    {
+        clipped.x = (int)left;
+        clipped.y = (int)top;
+        clipped.width = (int)(right - left);
+        clipped.height = (int)(bottom - top);
+    }
+    return clipped;
+}
+
+/**
+ * Finds the smallest rectangle covering two regions
+ * @param a A region (ignored if 0 x 0)
+ * @param b Another region (ignored if 0 x 0)
+ * @return the rectangle covering both
+ */
+Rect union_region(const Rect& a, const Rect& b)
+{
+    if (a.width <= 0 || a.height <= 0)
+    {
+        return b;
+    }
+    if (b.width <= 0 || b.height <= 0)
+    {
+        return a;
+    }
+    Rect covering;
+    covering.x = min(a.x, b.x);
+    covering.y = min(a.y, b.y);
+    covering.width = max(a.x + a.width, b.x + b.width) - covering.x;
+    covering.height = max(a.y + a.height, b.y + b.height) - covering.y;
+    return covering;
+}
+
+/**
+ * Runs a recipe of point operations on one rectangle of an image, in place.
+ * Pixels outside it are left alone, and the vignette still darkens towards
+ * the corners of the whole image.
+ * @param image  The image to edit
+ * @param ops    The recipe; every step must be a point operation
+ * @param region The rectangle, inside the image
+ * @return nothing
+ */
+void filter_region(Image& image, const vector<Operation>& ops, const Rect& region)
+{
+    ScopedTrace trace("filter_region", "filter", (long long)region.width * region.height);
+    int rows = image.height();
+    int cols = image.width();
+    vector<RowStage> stages = compile_point_stages(ops, 0, ops.size(), rows, cols, false, region.x);
+    parallel_rows(region.height, [&](int first, int last)
+    {
+        for (int row = region.y + first; row < region.y + last; row++)
+        {
+            unsigned char* pixels = image.row(row) + (size_t)region.x * 3;
+            for (size_t s = 0; s < stages.size(); s++)
+            {
+                stages[s](pixels, pixels, row, rows, region.width);
+            }
+        }
+    });
+}
+
+// Bytes of scanlines read or written at a time when working on part of a BMP file
+const size_t REGION_BAND_BYTES = 8 << 20;
+
+/**
+ * Rewrites some rows of a 24-bit BMP file from an image of the same size,
+ * leaving every other byte of the file alone
+ * @param filename  The BMP file, as written by write_image_fast() from an earlier version of the image
+ * @param image     The image
+ * @param first_row First row to write (from the top)
+ * @param last_row  One past the last row to write
+ * @return True if the rows were written and false if the file doesn't match the image or can't be written
+ */
+bool write_image_rows(const string& filename, const Image& image, int first_row, int last_row)
+{
+    ScopedTrace trace("write_image_rows", "io", (long long)image.width() * (last_row - first_row));
+    int fd = open(filename.c_str(), O_RDWR);
+    BmpInfo info;
+    if (fd < 0 || !read_bmp_info(fd, info) || info.width != image.width() || info.height != image.height() ||
+        info.bytes_per_pixel != 3 || image.layout() != LAYOUT_INTERLEAVED)
+    {
+        if (fd >= 0)
+        {
+            close(fd);
+        }
+        return false;
+    }
+
+    // Rows are stored bottom-up, so a band of rows is a run of scanlines in reverse order
+    int band_rows = max(1, (int)(REGION_BAND_BYTES / info.row_size));
+    vector<unsigned char> band((size_t)min(band_rows, max(0, last_row - first_row)) * info.row_size);
+    bool ok = true;
+    for (int first = first_row; ok && first < last_row; first += band_rows)
+    {
+        int count = min(band_rows, last_row - first);
+        for (int i = 0; i < count; i++)
+        {
+            memcpy(&band[(size_t)i * info.row_size], image.row(first + count - 1 - i), info.row_size);
+        }
+        off_t offset = info.pixel_offset + (off_t)(info.height - first - count) * info.row_size;
+        ok = pwrite_all(fd, band.data(), (size_t)count * info.row_size, offset);
+        trace.add_bytes_written((size_t)count * info.row_size);
+    }
+    return close(fd) == 0 && ok;
+}
+
+/**
+ * Runs a recipe of point operations on one rectangle of a BMP file. Only the
+ * scanlines the rectangle covers are read, filtered and written back, a band
+ * at a time, so the time and memory taken depend on the rectangle, not the image.
+ * The output starts as a clone or copy of the input, renamed into place when
+ * done, or is the input itself when that has no other hard links.
+ * @param input  BMP image to read
+ * @param output Where to write the result (may be the input)
+ * @param ops    The recipe; every step must be a point operation
+ * @param region The rectangle (clipped to the image)
+ * @return True if the result was written and false otherwise
+ */
+bool filter_file_region(const string& input, const string& output, const vector<Operation>& ops, const Rect& region)
+{
+    ScopedTrace trace("filter_file_region", "io");
+    struct stat input_info, output_info;
+    if (stat(input.c_str(), &input_info) != 0)
+    {
+        return false;
+    }
+    // Patching in place isn't atomic, so only a file no other link shares is edited that way
+    bool in_place = stat(output.c_str(), &output_info) == 0 && output_info.st_dev == input_info.st_dev &&
+                    output_info.st_ino == input_info.st_ino && output_info.st_nlink == 1;
+    string target = in_place ? output : output + ".tmp" + to_string(getpid());
+    if (!in_place && !clone_file(input, target) && !copy_file(input, target))
+    {
+        return false;
+    }
+
+    int fd = open(target.c_str(), O_RDWR);
+    BmpInfo info;
+    bool ok = fd >= 0 && read_bmp_info(fd, info);
+    Rect area = ok ? clip_region(region, info.width, info.height) : region;
+    if (ok && area.width > 0)
+    {
+        trace.set_pixels((long long)area.width * area.height);
+        vector<RowStage> stages = compile_point_stages(ops, 0, ops.size(), info.height, info.width, true, area.x);
+        int bytes_per_pixel = info.bytes_per_pixel;
+        int band_rows = max(1, (int)(REGION_BAND_BYTES / info.row_size));
+        vector<unsigned char> band((size_t)min(band_rows, area.height) * info.row_size);
+        for (int first = area.y; ok && first < area.y + area.height; first += band_rows)
+        {
+            // Image rows first ... first + count - 1 are the file's scanlines height - first - count ... height - first - 1
+            int count = min(band_rows, area.y + area.height - first);
+            int first_scanline = info.height - first - count;
+            off_t offset = info.pixel_offset + (off_t)first_scanline * info.row_size;
+            size_t bytes = (size_t)count * info.row_size;
+            ok = pread_all(fd, band.data(), bytes, offset);
+            if (!ok)
+            {
+                break;
+            }
+            parallel_rows(count, [&](int first_band_row, int last_band_row)
+            {
+                vector<unsigned char> pixels(bytes_per_pixel == 3 ? 0 : (size_t)area.width * 3);
+                for (int i = first_band_row; i < last_band_row; i++)
+                {
+                    int row = info.height - 1 - (first_scanline + i);
+                    unsigned char* scanline = &band[(size_t)i * info.row_size] + (size_t)area.x * bytes_per_pixel;
+                    unsigned char* p = bytes_per_pixel == 3 ? scanline : pixels.data();
+                    if (bytes_per_pixel != 3)
+                    {
+                        copy_bgr(scanline, p, area.width, bytes_per_pixel);
+                    }
+                    for (size_t s = 0; s < stages.size(); s++)
+                    {
+                        stages[s](p, p, row, info.height, area.width);
+                    }
+                    // Wider pixels keep their alpha (or other) bytes
+                    for (int x = 0; bytes_per_pixel != 3 && x < area.width; x++)
+                    {
+                        memcpy(scanline + (size_t)x * bytes_per_pixel, p + x * 3, 3);
+                    }
+                }
+            });
+            ok = pwrite_all(fd, band.data(), bytes, offset);
+            trace.add_bytes_read(bytes);
+            trace.add_bytes_written(bytes);
+        }
+    }
+    if (fd >= 0)
+    {
+        ok = close(fd) == 0 && ok;
+    }
+    return finish_output(target, output, ok);
+}
+
+// Settings for a non-interactive batch run
+struct BatchOptions
+{
+    vector<Operation> ops;    // Recipe applied to every file
+    vector<string> inputs;    // BMP files, or directories whose *.bmp files are processed
+    string output_directory;  // Where results are written, under their input file names
+    int jobs;                 // Number of files processed at the same time
+    bool stream;              // Stream point-only recipes instead of loading whole images
+    size_t memory_budget;     // Work out of core on files needing more than this (0 for no limit)
+    string scratch_directory; // Where out-of-core runs keep their tiles (defaults to the output directory)
+    string cache_directory;   // Where results are cached between runs (empty for no cache)
+    size_t cache_limit;       // Size the cache is trimmed to
+    bool has_region;          // Only filter region, reading and rewriting just the scanlines it covers
+    Rect region;
+    bool async_io;            // Read and write in the background while filtering (see run_batch_async())
+    bool io_threads;          // Use I/O threads for that even where io_uring is available
+    int in_flight;            // Files between reading and writing at once
+};
+
+// Timings for one file of a batch run
+struct BatchResult
+{
+    string input;
+    string output;
+    bool ok;
+    double load_seconds;
+    double process_seconds;
+    double write_seconds;
+};
+
+/**
+ * Parses the command line of a batch run, e.g.
+ * --op clarendon:0.3 --op rotate:1 -j 16 [--stream] [--memory 2048] [--scratch /tmp] [--cache ~/.cache/editor]
+ * [--cache-size 4096] [--region 0,0,640,480] [--io async] [--in-flight 8] in/a.bmp in/b.bmp -o out/
+ * @param args    Command line arguments (without the program name)
+ * @param options The parsed settings
+ * @return True if the command line is valid and false otherwise
+ */
+bool parse_batch_arguments(const vector<string>& args, BatchOptions& options)
+{
+    options = BatchOptions();
+    options.jobs = 1;
+    options.cache_limit = (size_t)1024 << 20;
+    options.in_flight = 4;
+    for (size_t i = 0; i < args.size(); i++)
+    {
+        if (args[i] == "--op" && i + 1 < args.size())
+        {
+            Operation op;
+            if (!parse_operation(args[++i], op))
+            {
+                cout << "Unknown operation: " << args[i] << "\n";
+                return false;
+            }
+            options.ops.push_back(op);
+        }
+        else if (args[i] == "-j" && i + 1 < args.size())
+        {
+            options.jobs = max(1, atoi(args[++i].c_str()));
+        }
+        else if (args[i] == "-o" && i + 1 < args.size())
+        {
+            options.output_directory = args[++i];
+        }
+        else if (args[i] == "--stream")
+        {
+            options.stream = true;
+        }
+        else if (args[i] == "--memory" && i + 1 < args.size())
+        {
+            options.memory_budget = (size_t)max(1, atoi(args[++i].c_str())) << 20;
+        }
+        else if (args[i] == "--scratch" && i + 1 < args.size())
+        {
+            options.scratch_directory = args[++i];
+        }
+        else if (args[i] == "--cache" && i + 1 < args.size())
+        {
+            options.cache_directory = args[++i];
+        }
+        else if (args[i] == "--cache-size" && i + 1 < args.size())
+        {
+            options.cache_limit = (size_t)max(1, atoi(args[++i].c_str())) << 20;
+        }
+        else if (args[i] == "--io" && i + 1 < args.size())
+        {
+            string mode = args[++i];
+            if (mode != "sync" && mode != "async" && mode != "threads")
+            {
+                cout << "Unknown I/O mode " << mode << " (expected sync, async or threads)" << "\n";
+                return false;
+            }
+            options.async_io = mode != "sync";
+            options.io_threads = mode == "threads";
+        }
+        else if (args[i] == "--in-flight" && i + 1 < args.size())
+        {
+            options.in_flight = max(1, atoi(args[++i].c_str()));
+        }
+        else if (args[i] == "--region" && i + 1 < args.size())
+        {
+            options.has_region = parse_region(args[++i], options.region);
+            if (!options.has_region)
+            {
+                cout << "Invalid region " << args[i] << " (expected X,Y,WIDTH,HEIGHT)" << "\n";
+                return false;
+            }
+        }
+        else
+        {
+            options.inputs.push_back(args[i]);
+        }
+    }
+    if (options.ops.empty() || options.inputs.empty() || options.output_directory.empty())
+    {
+        cout << "Usage: main --op <operation> [--op <operation> ...] [-j <jobs>] [--stream] [--memory <MB>] [--scratch <directory>] [--cache <directory>] [--cache-size <MB>] [--region <x>,<y>,<width>,<height>] [--io sync|async|threads] [--in-flight <files>] <input.bmp|directory> ... -o <output directory>" << "\n";
+        return false;
+    }
+    if (options.has_region && !all_of(options.ops.begin(), options.ops.end(), is_point_operation))
+    {
+        cout << "A region can only be used with colour operations (no rotating, enlarging or resizing)" << "\n";
+        return false;
+    }
+    if (options.async_io && (options.stream || options.has_region || !options.cache_directory.empty()))
+    {
+        cout << "--io " << (options.io_threads ? "threads" : "async") << " can't be combined with --stream, --region or --cache" << "\n";
+        return false;
+    }
+    if (options.scratch_directory.empty())
+    {
+        options.scratch_directory = options.output_directory;
+    }
+    return true;
+}
+
+/**
+ * Expands directories among the inputs into the BMP files they contain
+ * @param inputs Files and directories
+ * @return the BMP files to process, directories' contents sorted by name
+ */
+vector<string> expand_inputs(const vector<string>& inputs)
+{
+    vector<string> files;
+    for (size_t i = 0; i < inputs.size(); i++)
+    {
+        struct stat info;
+        if (stat(inputs[i].c_str(), &info) != 0 || !S_ISDIR(info.st_mode))
+        {
+            files.push_back(inputs[i]);
+            continue;
+        }
+
+        DIR* directory = opendir(inputs[i].c_str());
+        if (directory == nullptr)
+        {
+            continue;
+        }
+        vector<string> found;
+        while (struct dirent* entry = readdir(directory))
+        {
+            string name = entry->d_name;
+            string extension = name.size() > 4 ? name.substr(name.size() - 4) : "";
+            transform(extension.begin(), extension.end(), extension.begin(), ::tolower);
+            if (extension == ".bmp")
+            {
+                found.push_back(inputs[i] + "/" + name);
+            }
+        }
+        closedir(directory);
+        sort(found.begin(), found.end());
+        files.insert(files.end(), found.begin(), found.end());
+    }
+    return files;
+}
+
+/**
+ * Creates a directory and any missing parents
+ * @param path The directory to create
+ * @return True if the directory exists afterwards and false otherwise
+ */
+bool make_directories(const string& path)
+{
+    for (size_t slash = path.find('/', 1); slash != string::npos; slash = path.find('/', slash + 1))
+    {
+        mkdir(path.substr(0, slash).c_str(), 0755);
+    }
+    mkdir(path.c_str(), 0755);
+    struct stat info;
+    return stat(path.c_str(), &info) == 0 && S_ISDIR(info.st_mode);
+}
+
+/**
+ * Loads, processes and writes one file of a batch run; see process_file()
+ * @param input   The BMP file to process
+ * @param output  Where to write the result
+ * @param options The batch settings (recipe, streaming and memory budget)
+ * @return the timings of the file (bad_alloc is passed on)
+ */
+BatchResult process_file_steps(const string& input, const string& output, const BatchOptions& options)
+{
+    const vector<Operation>& ops = options.ops;
+    BatchResult result;
+    result.input = input;
+    result.output = output;
+    result.ok = false;
+    result.load_seconds = 0;
+    result.process_seconds = 0;
+    result.write_seconds = 0;
+
+    auto start = chrono::steady_clock::now();
+    ScopedTrace trace("process_file", "batch");
+
+    // Regions touch only the scanlines they cover; the rest of the file is cloned or copied
+    // (and renamed into place, unless the output is the input and is edited in place)
+    if (options.has_region)
+    {
+        result.ok = filter_file_region(input, output, ops, options.region);
+        result.process_seconds = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+        return result;
+    }
+
+    // A result that is already cached is handed out without decoding the input
+    ResultCache cache(options.cache_directory, options.cache_limit);
+    unsigned long long input_hash = 0;
+    bool cached = cache.enabled() && hash_file(input, input_hash);
+    if (cached && cache.fetch(ResultCache::key(input_hash, ops, ops.size()), output))
+    {
+        result.ok = true;
+        result.load_seconds = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+        return result;
+    }
+
+    // Files that wouldn't fit the memory budget once loaded are worked on out of core
+    bool out_of_core = false;
+    if (options.memory_budget > 0)
+    {
+        int fd = open(input.c_str(), O_RDONLY);
+        BmpInfo info;
+        if (fd >= 0 && read_bmp_info(fd, info))
+        {
+            out_of_core = recipe_peak_bytes(info.width, info.height, ops) > options.memory_budget;
+        }
+        if (fd >= 0)
+        {
+            close(fd);
+        }
+    }
+
+    if (out_of_core || (options.stream && all_of(ops.begin(), ops.end(), is_point_operation)))
+    {
+        // Reading, filtering and writing overlap, so the whole run counts as processing. The
+        // output is only unlinked if it isn't the input, which is written to a temporary file instead.
+        detach_output(input, output);
+        OutOfCoreOptions out_of_core_options = {options.memory_budget, options.scratch_directory};
+        result.ok = out_of_core ? run_recipe_out_of_core(input, output, ops, out_of_core_options)
+                                : stream_recipe(input, output, ops);
+        result.process_seconds = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+        return result;
+    }
+
+    // The cache also keeps the image after each rotation, enlarging or resizing (where the
+    // pipeline makes a new image anyway), so a recipe sharing those first steps starts from there
+    size_t done = 0;
+    Image image;
+    for (size_t i = cached ? ops.size() - 1 : 0; i > 0 && image.empty(); i--)
+    {
+        bool boundary = !is_point_operation(ops[i - 1]) || !is_point_operation(ops[i]);
+        if (boundary && cache.contains(ResultCache::key(input_hash, ops, i)))
+        {
+            image = cache.load(ResultCache::key(input_hash, ops, i));
+            done = i;
+        }
+    }
+    if (image.empty())
+    {
+        image = read_image_fast(input);
+        done = 0;
+    }
+    auto loaded = chrono::steady_clock::now();
+    result.load_seconds = chrono::duration<double>(loaded - start).count();
+    if (image.empty())
+    {
+        return result;
+    }
+
+    Image new_image;
+    if (!cached)
+    {
+        new_image = run_pipeline(move(image), ops);
+    }
+    else
+    {
+        new_image = move(image);
+        size_t first = done;
+        for (size_t i = done + 1; i <= ops.size(); i++)
+        {
+            if (i < ops.size() && is_point_operation(ops[i - 1]) && is_point_operation(ops[i]))
+            {
+                continue;
+            }
+            new_image = run_pipeline(move(new_image), vector<Operation>(ops.begin() + first, ops.begin() + i));
+            if (i < ops.size())
+            {
+                cache.store(ResultCache::key(input_hash, ops, i), new_image);
+            }
+            first = i;
+        }
+    }
+    auto processed = chrono::steady_clock::now();
+    result.process_seconds = chrono::duration<double>(processed - loaded).count();
+
+    // Cached results are written once, into the cache, and handed out from there. Anything
+    // else is written to a new output file rather than through a hard link the output may
+    // have; the input has been read by now.
+    string key = ResultCache::key(input_hash, ops, ops.size());
+    detach_output(input, output);
+    result.ok = (cached && cache.store(key, new_image) && cache.fetch(key, output)) || write_image_fast(output, new_image);
+    result.write_seconds = chrono::duration<double>(chrono::steady_clock::now() - processed).count();
+    if (cached)
+    {
+        cache.trim();
+    }
+    return result;
+}
+
+/**
+ * Loads, processes and writes one file of a batch run
+ * @param input   The BMP file to process
+ * @param output  Where to write the result
+ * @param options The batch settings (recipe, streaming and memory budget)
+ * @return the timings of the file, which has failed if it ran out of memory
+ */
+BatchResult process_file(const string& input, const string& output, const BatchOptions& options)
+{
+    try
+    {
+        return process_file_steps(input, output, options);
+    }
+    catch (const bad_alloc&)
+    {
+        // Only this file fails; the rest of the batch still runs
+        BatchResult result;
+        result.input = input;
+        result.output = output;
+        result.ok = false;
+        result.load_seconds = result.process_seconds = result.write_seconds = 0;
+        return result;
+    }
+}
+
+/**
+ * Prints the per-file timings of a batch run and its totals
+ * @param results      Timings of every file, in input order
+ * @param wall_seconds Wall time of the whole run
+ * @return nothing
+ */
+void print_batch_summary(const vector<BatchResult>& results, double wall_seconds)
+{
+    cout << fixed << setprecision(1);
+    cout << setw(10) << "load ms" << setw(12) << "process ms" << setw(10) << "write ms"
+         << setw(10) << "total ms" << "  file" << "\n";
+
+    int failed = 0;
+    double load = 0, process = 0, write = 0;
+    for (size_t i = 0; i < results.size(); i++)
+    {
+        const BatchResult& r = results[i];
+        double total = r.load_seconds + r.process_seconds + r.write_seconds;
+        cout << setw(10) << r.load_seconds * 1000 << setw(12) << r.process_seconds * 1000
+             << setw(10) << r.write_seconds * 1000 << setw(10) << total * 1000 << "  " << r.input
+             << (r.ok ? "" : "  FAILED") << "\n";
+        load += r.load_seconds;
+        process += r.process_seconds;
+        write += r.write_seconds;
+        failed += r.ok ? 0 : 1;
+    }
+    cout << setw(10) << load * 1000 << setw(12) << process * 1000 << setw(10) << write * 1000
+         << setw(10) << (load + process + write) * 1000 << "  (sum over files)" << "\n";
+    cout << results.size() - failed << " of " << results.size() << " files processed in "
+         << wall_seconds * 1000 << " ms wall time" << "\n";
+    cout.unsetf(ios::floatfield);
+    cout << setprecision(6);
+}
+
+// Requests an asynchronous batch run has queued in the kernel (or on its I/O threads) at most
+const unsigned ASYNC_QUEUE_DEPTH = 64;
+
+// Largest read or write an asynchronous batch run issues as one request
+const size_t ASYNC_CHUNK_BYTES = 4 << 20;
+
+// Scanlines gathered into one request at most (the smallest IOV_MAX Linux has)
+const size_t ASYNC_CHUNK_ROWS = 1024;
+
+// Threads doing the reads and writes where io_uring isn't available
+const int ASYNC_IO_THREADS = 4;
+
+// Memory the files in flight may hold when no --memory budget is given
+const size_t ASYNC_MEMORY_BYTES = (size_t)1 << 30;
+
+// One read or write of an asynchronous batch run: a run of scanlines, or the headers
+struct IoRequest
+{
+    size_t file;                // Index of the file it belongs to
+    int fd;
+    bool write;
+    off_t offset;               // Where in the file the first part goes
+    vector<struct iovec> parts; // The buffers, in file order
+    ssize_t result;             // Bytes transferred, or -errno
+};
+
+/**
+ * Counts the bytes a request moves
+ * @param request The request
+ * @return the total size of its parts
+ */
+size_t request_bytes(const IoRequest& request)
+{
+    size_t bytes = 0;
+    for (size_t i = 0; i < request.parts.size(); i++)
+    {
+        bytes += request.parts[i].iov_len;
+    }
+    return bytes;
+}
+
+/**
+ * Finishes a request with preadv() or pwritev(), retrying short transfers
+ * @param request The request
+ * @param done    Bytes already transferred
+ * @return True if every byte was transferred and false otherwise
+ */
+bool finish_request(const IoRequest& request, size_t done)
+{
+    vector<struct iovec> parts = request.parts;
+    off_t offset = request.offset + done;
+    size_t first = 0;
+    while (true)
+    {
+        // Skip what has been transferred
+        while (first < parts.size() && done >= parts[first].iov_len)
+        {
+            done -= parts[first].iov_len;
+            first++;
+        }
+        if (first == parts.size())
+        {
+            return true;
+        }
+        parts[first].iov_base = (unsigned char*)parts[first].iov_base + done;
+        parts[first].iov_len -= done;
+        int count = (int)min<size_t>(parts.size() - first, ASYNC_CHUNK_ROWS);
+        ssize_t moved = request.write ? pwritev(request.fd, &parts[first], count, offset)
+                                      : preadv(request.fd, &parts[first], count, offset);
+        if (moved < 0 && errno == EINTR)
+        {
+            done = 0;
+            continue;
+        }
+        if (moved <= 0)
+        {
+            return false;
+        }
+        done = moved;
+        offset += moved;
+    }
+}
+
+// Carries out reads and writes in the background. Uses io_uring, through
+// its system calls, where the kernel has it, and otherwise a few threads
+// making blocking calls. Submitting never blocks: requests beyond the
+// queue depth wait in a list until earlier ones complete.
+class AsyncFileIo
+{
+public:
+    /**
+     * Starts the background I/O
+     * @param use_uring False to use threads even where io_uring is available
+     */
+    explicit AsyncFileIo(bool use_uring) : ring_fd_(-1), in_kernel_(0), stopping_(false), outstanding_(0)
+    {
+        if (!use_uring || !setup_ring(ASYNC_QUEUE_DEPTH))
+        {
+            for (int t = 0; t < ASYNC_IO_THREADS; t++)
+            {
+                workers_.push_back(thread([this]() { work(); }));
+            }
+        }
+    }
+
+    ~AsyncFileIo()
+    {
+        {
+            lock_guard<mutex> lock(mutex_);
+            stopping_ = true;
+        }
+        work_ready_.notify_all();
+        for (size_t t = 0; t < workers_.size(); t++)
+        {
+            workers_[t].join();
+        }
+#ifdef IMAGE_EDITOR_IO_URING
+        if (ring_fd_ >= 0)
+        {
+            munmap(sqes_, sqes_bytes_);
+            if (cq_map_ != sq_map_)
+            {
+                munmap(cq_map_, cq_bytes_);
+            }
+            munmap(sq_map_, sq_bytes_);
+            close(ring_fd_);
+        }
+#endif
+    }
+
+    const char* backend() const { return ring_fd_ >= 0 ? "io_uring" : "threads"; }
+
+    /**
+     * Queues requests, with one system call for all of them. They must stay
+     * where they are until wait() hands them back.
+     * @param requests The requests
+     * @return nothing
+     */
+    void submit(vector<IoRequest>& requests)
+    {
+        if (ring_fd_ >= 0)
+        {
+            for (size_t r = 0; r < requests.size(); r++)
+            {
+                waiting_.push_back(&requests[r]);
+            }
+            flush();
+            return;
+        }
+        {
+            lock_guard<mutex> lock(mutex_);
+            for (size_t r = 0; r < requests.size(); r++)
+            {
+                queue_.push_back(&requests[r]);
+            }
+            outstanding_ += requests.size();
+        }
+        work_ready_.notify_all();
+    }
+
+    /**
+     * Collects completed requests
+     * @param completed Where to append them
+     * @param block     True to wait for at least one if any are outstanding
+     * @return nothing
+     */
+    void wait(vector<IoRequest*>& completed, bool block)
+    {
+        if (ring_fd_ >= 0)
+        {
+            reap(completed, block);
+            return;
+        }
+        unique_lock<mutex> lock(mutex_);
+        while (block && finished_.empty() && outstanding_ > 0)
+        {
+            work_done_.wait(lock);
+        }
+        outstanding_ -= finished_.size();
+        completed.insert(completed.end(), finished_.begin(), finished_.end());
+        finished_.clear();
+    }
+
+private:
+    AsyncFileIo(const AsyncFileIo&);
+    AsyncFileIo& operator=(const AsyncFileIo&);
+
+    // Runs requests on an I/O thread until the object is destroyed
+    void work()
+    {
+        unique_lock<mutex> lock(mutex_);
+        while (true)
+        {
+            while (queue_.empty() && !stopping_)
+            {
+                work_ready_.wait(lock);
+            }
+            if (queue_.empty())
+            {
+                return;
+            }
+            IoRequest* request = queue_.front();
+            queue_.pop_front();
+            lock.unlock();
+            request->result = finish_request(*request, 0) ? (ssize_t)request_bytes(*request) : -EIO;
+            lock.lock();
+            finished_.push_back(request);
+            work_done_.notify_one();
+        }
+    }
+
+#ifdef IMAGE_EDITOR_IO_URING
+    /**
+     * Creates an io_uring instance and maps its rings
+     * @param entries Submission queue size
+     * @return True if the ring is ready and false if the kernel doesn't support it
+     */
+    bool setup_ring(unsigned entries)
+    {
+        struct io_uring_params params;
+        memset(&params, 0, sizeof(params));
+        int fd = (int)syscall(__NR_io_uring_setup, entries, &params);
+        if (fd < 0)
+        {
+            return false;
+        }
+        sq_bytes_ = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+        cq_bytes_ = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+        sqes_bytes_ = params.sq_entries * sizeof(struct io_uring_sqe);
+
+        // Newer kernels put both rings in one mapping
+        bool single = (params.features & IORING_FEAT_SINGLE_MMAP) != 0;
+        if (single)
+        {
+            sq_bytes_ = cq_bytes_ = max(sq_bytes_, cq_bytes_);
+        }
+        void* sq = mmap(nullptr, sq_bytes_, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQ_RING);
+        void* cq = single || sq == MAP_FAILED ? sq
+                 : mmap(nullptr, cq_bytes_, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_CQ_RING);
+        void* sqes = sq == MAP_FAILED || cq == MAP_FAILED ? MAP_FAILED
+                   : mmap(nullptr, sqes_bytes_, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQES);
+        if (sqes == MAP_FAILED)
+        {
+            if (cq != MAP_FAILED && cq != sq)
+            {
+                munmap(cq, cq_bytes_);
+            }
+            if (sq != MAP_FAILED)
+            {
+                munmap(sq, sq_bytes_);
+            }
+            close(fd);
+            return false;
+        }
+
+        sq_map_ = (unsigned char*)sq;
+        cq_map_ = (unsigned char*)cq;
+        sqes_ = (struct io_uring_sqe*)sqes;
+        sq_head_ = (unsigned*)(sq_map_ + params.sq_off.head);
+        sq_tail_ = (unsigned*)(sq_map_ + params.sq_off.tail);
+        sq_mask_ = *(unsigned*)(sq_map_ + params.sq_off.ring_mask);
+        sq_array_ = (unsigned*)(sq_map_ + params.sq_off.array);
+        sq_entries_ = params.sq_entries;
+        cq_head_ = (unsigned*)(cq_map_ + params.cq_off.head);
+        cq_tail_ = (unsigned*)(cq_map_ + params.cq_off.tail);
+        cq_mask_ = *(unsigned*)(cq_map_ + params.cq_off.ring_mask);
+        cqes_ = (struct io_uring_cqe*)(cq_map_ + params.cq_off.cqes);
+        ring_fd_ = fd;
+        return true;
+    }
+
+    // Hands waiting requests to the kernel, keeping no more in it than the submission queue holds
+    void flush()
+    {
+        unsigned tail = *sq_tail_;
+        unsigned added = 0;
+        while (!waiting_.empty() && in_kernel_ + added < sq_entries_)
+        {
+            IoRequest* request = waiting_.front();
+            waiting_.pop_front();
+            unsigned index = (tail + added) & sq_mask_;
+            struct io_uring_sqe* sqe = &sqes_[index];
+            memset(sqe, 0, sizeof(*sqe));
+            sqe->opcode = request->write ? IORING_OP_WRITEV : IORING_OP_READV;
+            sqe->fd = request->fd;
+            sqe->off = request->offset;
+            sqe->addr = (unsigned long long)(uintptr_t)request->parts.data();
+            sqe->len = request->parts.size();
+            sqe->user_data = (unsigned long long)(uintptr_t)request;
+            sq_array_[index] = index;
+            added++;
+        }
+        if (added == 0)
+        {
+            return;
+        }
+        __atomic_store_n(sq_tail_, tail + added, __ATOMIC_RELEASE);
+        in_kernel_ += added;
+        enter(added, 0);
+    }
+
+    // Collects completions, waiting for one if asked to and any are outstanding
+    void reap(vector<IoRequest*>& completed, bool block)
+    {
+        while (true)
+        {
+            unsigned head = *cq_head_;
+            unsigned tail = __atomic_load_n(cq_tail_, __ATOMIC_ACQUIRE);
+            for (; head != tail; head++)
+            {
+                struct io_uring_cqe* cqe = &cqes_[head & cq_mask_];
+                IoRequest* request = (IoRequest*)(uintptr_t)cqe->user_data;
+                request->result = cqe->res;
+                completed.push_back(request);
+                in_kernel_--;
+            }
+            __atomic_store_n(cq_head_, head, __ATOMIC_RELEASE);
+            flush();
+            if (!completed.empty() || !block || in_kernel_ == 0)
+            {
+                return;
+            }
+            enter(0, 1);
+        }
+    }
+
+    // Submits queued entries and optionally waits for completions, retrying interrupted calls
+    void enter(unsigned to_submit, unsigned min_complete)
+    {
+        unsigned flags = min_complete > 0 ? IORING_ENTER_GETEVENTS : 0;
+        while (true)
+        {
+            if (syscall(__NR_io_uring_enter, ring_fd_, to_submit, min_complete, flags, nullptr, 0) >= 0 ||
+                (errno != EINTR && errno != EAGAIN && errno != EBUSY))
+            {
+                return;
+            }
+        }
+    }
+
+    unsigned char* sq_map_;
+    unsigned char* cq_map_;
+    struct io_uring_sqe* sqes_;
+    size_t sq_bytes_;
+    size_t cq_bytes_;
+    size_t sqes_bytes_;
+    unsigned* sq_head_;
+    unsigned* sq_tail_;
+    unsigned* sq_array_;
+    unsigned sq_mask_;
+    unsigned sq_entries_;
+    unsigned* cq_head_;
+    unsigned* cq_tail_;
+    unsigned cq_mask_;
+    struct io_uring_cqe* cqes_;
+#else
+    bool setup_ring(unsigned) { return false; }
+    void flush() {}
+    void reap(vector<IoRequest*>&, bool) {}
+#endif
+
+    int ring_fd_;
+    unsigned in_kernel_;            // Requests submitted to the ring and not yet reaped
+    deque<IoRequest*> waiting_;     // Requests for the ring beyond the queue depth
+    vector<thread> workers_;
+    mutex mutex_;
+    condition_variable work_ready_;
+    condition_variable work_done_;
+    deque<IoRequest*> queue_;       // Requests for the I/O threads
+    deque<IoRequest*> finished_;    // Requests the I/O threads completed
+    bool stopping_;
+    size_t outstanding_;            // Requests given to the I/O threads and not yet collected
+};
+
+// A file on its way through an asynchronous batch run
+struct AsyncFile
+{
+    string input;
+    string output;
+    int fd;                          // The input while it is read, then the output while it is written
+    BmpInfo info;
+    Image image;
+    vector<unsigned char> scanlines; // Pixels wider than 24 bits, before conversion
+    unsigned char header[54];
+    vector<IoRequest> requests;
+    size_t remaining;                // Requests not yet completed
+    bool ok;
+    size_t charge;                   // Memory counted against the budget while the file is in flight
+    chrono::steady_clock::time_point started;
+    chrono::steady_clock::time_point finished_stage; // When the last stage ended
+};
+
+/**
+ * Splits the scanlines of a file into requests, each a run of rows in file order
+ * @param file      The file
+ * @param index     Index of the file in the batch
+ * @param write     True for writes and false for reads
+ * @param offset    Where the pixel array starts in the file
+ * @param row_size  Scanline size in bytes, including padding
+ * @param height    Number of scanlines
+ * @param scanline  Gives the buffer of scanline k, counting from the bottom (first in the file)
+ * @return nothing
+ */
+void add_scanline_requests(AsyncFile& file, size_t index, bool write, off_t offset, size_t row_size, int height,
+                           const function<unsigned char*(int)>& scanline)
+{
+    size_t rows_per_request = max<size_t>(1, min(ASYNC_CHUNK_ROWS, ASYNC_CHUNK_BYTES / row_size));
+    for (int first = 0; first < height; first += rows_per_request)
+    {
+        int last = (int)min<size_t>(height, first + rows_per_request);
+        IoRequest request;
+        request.file = index;
+        request.fd = file.fd;
+        request.write = write;
+        request.offset = offset + (off_t)first * row_size;
+        request.result = 0;
+        for (int k = first; k < last; k++)
+        {
+            struct iovec part = {scanline(k), row_size};
+            request.parts.push_back(part);
+        }
+        file.requests.push_back(request);
+    }
+}
+
+/**
+ * Runs a batch as a three stage pipeline: the next files are read and the
+ * finished ones written in the background (see AsyncFileIo) while the
+ * current file is filtered on every core. Up to in_flight files, and the
+ * memory budget's worth of images, are between reading and writing at once.
+ * 24-bit files are read straight into the image rows and written straight
+ * from them, a run of scanlines per request.
+ * @param files   The BMP files to process
+ * @param options The batch settings
+ * @param results Where to store the timings of each file
+ * @return nothing
+ */
+void run_batch_async(const vector<string>& files, const BatchOptions& options, vector<BatchResult>& results)
+{
+    ScopedTrace trace("run_batch_async", "batch");
+    const vector<Operation>& ops = options.ops;
+    AsyncFileIo io(!options.io_threads);
+    size_t budget = options.memory_budget > 0 ? options.memory_budget : ASYNC_MEMORY_BYTES;
+    cout << "Asynchronous I/O with " << io.backend() << ", up to " << options.in_flight << " files in flight" << "\n";
+
+    vector<unique_ptr<AsyncFile>> state(files.size());
+    deque<size_t> read_files; // Read and waiting to be filtered, in order
+    size_t next = 0;
+    size_t in_flight = 0;
+    size_t charged = 0;
+
+    for (size_t i = 0; i < files.size(); i++)
+    {
+        string name = files[i].substr(files[i].find_last_of('/') + 1);
+        results[i].input = files[i];
+        results[i].output = options.output_directory + "/" + name;
+        results[i].ok = false;
+        results[i].load_seconds = results[i].process_seconds = results[i].write_seconds = 0;
+    }
+
+    // A file is done once its last write completes, or at the first failure
+    auto finish = [&](size_t i, bool ok)
+    {
+        AsyncFile& file = *state[i];
+        if (file.fd >= 0 && close(file.fd) != 0)
+        {
+            ok = false;
+        }
+        chrono::duration<double> elapsed = chrono::steady_clock::now() - file.finished_stage;
+        results[i].write_seconds = ok ? elapsed.count() : 0;
+        results[i].ok = ok;
+        charged -= file.charge;
+        in_flight--;
+        state[i].reset();
+    };
+
+    while (next < files.size() || in_flight > 0)
+    {
+        // Stage 1: start reading the next files while there is room
+        while (next < files.size() && in_flight < (size_t)options.in_flight)
+        {
+            size_t i = next;
+            if (!state[i])
+            {
+                state[i].reset(new AsyncFile());
+                AsyncFile& file = *state[i];
+                file.input = results[i].input;
+                file.output = results[i].output;
+                file.started = chrono::steady_clock::now();
+                file.fd = open(file.input.c_str(), O_RDONLY);
+                if (file.fd < 0 || !read_bmp_info(file.fd, file.info))
+                {
+                    if (file.fd >= 0)
+                    {
+                        close(file.fd);
+                    }
+                    state[i].reset();
+                    next++;
+                    continue;
+                }
+                file.charge = recipe_peak_bytes(file.info.width, file.info.height, ops);
+                if (file.info.bytes_per_pixel != 3)
+                {
+                    file.charge += file.info.row_size * file.info.height;
+                }
+            }
+            AsyncFile& file = *state[i];
+
+            // Files too large for the budget are worked on out of core, like any batch run does
+            if (options.memory_budget > 0 && file.charge > options.memory_budget)
+            {
+                close(file.fd);
+                state[i].reset();
+                results[i] = process_file(files[i], results[i].output, options);
+                next++;
+                continue;
+            }
+            if (in_flight > 0 && charged + file.charge > budget)
+            {
+                break;
+            }
+
+            const BmpInfo& info = file.info;
+            try
+            {
+                file.image = Image(info.width, info.height, LAYOUT_INTERLEAVED, FILL_UNINITIALIZED);
+                if (info.bytes_per_pixel != 3)
+                {
+                    file.scanlines.resize(info.row_size * info.height);
+                }
+            }
+            catch (const bad_alloc&)
+            {
+                close(file.fd);
+                state[i].reset();
+                next++;
+                continue;
+            }
+
+            // 24-bit scanlines are exactly the image rows, in reverse order
+            if (info.bytes_per_pixel == 3)
+            {
+                Image& image = file.image;
+                add_scanline_requests(file, i, false, info.pixel_offset, info.row_size, info.height,
+                                      [&](int k) { return image.row(info.height - 1 - k); });
+            }
+            else
+            {
+                unsigned char* scanlines = file.scanlines.data();
+                add_scanline_requests(file, i, false, info.pixel_offset, info.row_size, info.height,
+                                      [&](int k) { return scanlines + (size_t)k * info.row_size; });
+            }
+            file.remaining = file.requests.size();
+            file.ok = true;
+            charged += file.charge;
+            in_flight++;
+            next++;
+            io.submit(file.requests);
+        }
+
+        // Collect finished reads and writes, waiting only if there is nothing to filter
+        vector<IoRequest*> completed;
+        io.wait(completed, read_files.empty());
+        for (size_t c = 0; c < completed.size(); c++)
+        {
+            IoRequest& request = *completed[c];
+            AsyncFile& file = *state[request.file];
+            size_t bytes = request_bytes(request);
+
+            // Finish a short or failed transfer with plain calls, which also report real errors
+            if (request.result != (ssize_t)bytes && !finish_request(request, max<ssize_t>(0, request.result)))
+            {
+                file.ok = false;
+            }
+            if (request.write)
+            {
+                trace.add_bytes_written(bytes);
+            }
+            else
+            {
+                trace.add_bytes_read(bytes);
+            }
+            if (--file.remaining > 0)
+            {
+                continue;
+            }
+            if (request.write)
+            {
+                finish(request.file, file.ok);
+                continue;
+            }
+            close(file.fd);
+            file.fd = -1;
+            if (!file.ok)
+            {
+                finish(request.file, false);
+                continue;
+            }
+            file.finished_stage = chrono::steady_clock::now();
+            results[request.file].load_seconds = chrono::duration<double>(file.finished_stage - file.started).count();
+            read_files.push_back(request.file);
+        }
+        if (read_files.empty())
+        {
+            continue;
+        }
+
+        // Stage 2: filter the oldest file that has been read
+        size_t i = read_files.front();
+        read_files.pop_front();
+        AsyncFile& file = *state[i];
+        const BmpInfo& info = file.info;
+        if (info.bytes_per_pixel != 3)
+        {
+            parallel_rows(info.height, [&](int first, int last)
+            {
+                for (int row = first; row < last; row++)
+                {
+                    copy_bgr(&file.scanlines[(size_t)(info.height - 1 - row) * info.row_size], file.image.row(row),
+                             info.width, info.bytes_per_pixel);
+                }
+            });
+            vector<unsigned char>().swap(file.scanlines);
+        }
+        try
+        {
+            file.image = run_pipeline(move(file.image), ops);
+            if (file.image.layout() != LAYOUT_INTERLEAVED)
+            {
+                file.image = file.image.to_layout(LAYOUT_INTERLEAVED);
+            }
+        }
+        catch (const bad_alloc&)
+        {
+            file.image = Image();
+        }
+        if (file.image.empty())
+        {
+            // Out of memory, or a recipe whose result doesn't fit (an enlarged size past INT_MAX)
+            finish(i, false);
+            continue;
+        }
+        auto processed = chrono::steady_clock::now();
+        results[i].process_seconds = chrono::duration<double>(processed - file.finished_stage).count();
+        file.finished_stage = processed;
+
+        // Stage 3: write the result straight from the image rows
+        Image& image = file.image;
+        int width = image.width();
+        int height = image.height();
+        size_t row_size = (size_t)image.stride();
+        size_t padding = row_size - (size_t)width * 3;
+        for (int row = 0; padding > 0 && row < height; row++)
+        {
+            // Rows read from a file keep its padding, which may not be zero
+            memset(image.row(row) + (size_t)width * 3, 0, padding);
+        }
+        build_bmp_header(file.header, width, height);
+        detach_output(file.input, file.output);
+        file.fd = open(file.output.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+        if (file.fd < 0)
+        {
+            finish(i, false);
+            continue;
+        }
+        file.requests.clear();
+        IoRequest header;
+        header.file = i;
+        header.fd = file.fd;
+        header.write = true;
+        header.offset = 0;
+        header.result = 0;
+        struct iovec part = {file.header, sizeof(file.header)};
+        header.parts.push_back(part);
+        file.requests.push_back(header);
+        add_scanline_requests(file, i, true, sizeof(file.header), row_size, height,
+                              [&](int k) { return image.row(height - 1 - k); });
+        file.remaining = file.requests.size();
+        io.submit(file.requests);
+    }
+}
+
+/**
+ * Runs a recipe over many files. Several files are in flight at once so one
+ * file's disk I/O overlaps another file's filtering.
+ * @param options The batch settings
+ * @return 0 if every file succeeded, 1 otherwise
+ */
+int run_batch(const BatchOptions& options)
+{
+    vector<string> files = expand_inputs(options.inputs);
+    if (files.empty())
+    {
+        cout << "No input files" << "\n";
+        return 1;
+    }
+    if (!make_directories(options.output_directory))
+    {
+        cout << "Could not create output directory " << options.output_directory << "\n";
+        return 1;
+    }
+    if (!options.cache_directory.empty() && !make_directories(options.cache_directory))
+    {
+        cout << "Could not create cache directory " << options.cache_directory << "\n";
+        return 1;
+    }
+
+    vector<BatchResult> results(files.size());
+    atomic<size_t> next_file(0);
+    auto start = chrono::steady_clock::now();
+
+    if (options.async_io)
+    {
+        run_batch_async(files, options, results);
+    }
+    else
+    {
+        // Each worker takes the next file until none are left. Workers that find
+        // the filter pool busy run their filters on their own thread.
+        auto worker = [&]()
+        {
+            for (size_t i = next_file++; i < files.size(); i = next_file++)
+            {
+                string name = files[i].substr(files[i].find_last_of('/') + 1);
+                results[i] = process_file(files[i], options.output_directory + "/" + name, options);
+            }
+        };
+        vector<thread> workers;
+        int jobs = min<int>(options.jobs, files.size());
+        for (int j = 1; j < jobs; j++)
+        {
+            workers.push_back(thread(worker));
+        }
+        worker();
+        for (size_t j = 0; j < workers.size(); j++)
+        {
+            workers[j].join();
+        }
+    }
+
+    // Files cut short by the cache skip trimming it; apply a smaller --cache-size now
+    if (!options.cache_directory.empty())
+    {
+        ResultCache(options.cache_directory, options.cache_limit).trim();
+    }
+
+    double wall_seconds = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+    print_batch_summary(results, wall_seconds);
+    for (size_t i = 0; i < results.size(); i++)
+    {
+        if (!results[i].ok)
+        {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+// Longest request line the server accepts
+const size_t SERVE_MAX_REQUEST = 1 << 16;
+
+// Shared memory objects a connection keeps mapped between requests
+const size_t SERVE_MAX_MAPPINGS = 8;
+
+// A POSIX shared memory object mapped by the server
+struct SharedMapping
+{
+    dev_t device;        // Identity of the object, so a recreated one is mapped again
+    ino_t inode;
+    unsigned char* data;
+    size_t bytes;
+};
+
+// The shared memory objects one client connection uses. Clients normally pass
+// the same few buffers with every request, so mappings are kept until the
+// object is replaced or resized, and later requests skip mmap() and the page faults.
+class SharedMappings
+{
+public:
+    SharedMappings() {}
+
+    ~SharedMappings()
+    {
+        clear();
+    }
+
+    /**
+     * Maps a shared memory object, reusing the mapping from an earlier request when possible
+     * @param name     Name of the object, as given to shm_open()
+     * @param bytes    Number of bytes needed
+     * @param writable True to create the object and size it to exactly bytes, false to
+     *                 map an existing object read-only (it must hold at least bytes)
+     * @return the mapped bytes, or nullptr if the object can't be mapped
+     */
+    unsigned char* map_object(const string& name, size_t bytes, bool writable)
+    {
+        if (bytes == 0)
+        {
+            return nullptr;
+        }
+        int fd = shm_open(name.c_str(), writable ? O_RDWR | O_CREAT : O_RDONLY, 0600);
+        if (fd < 0)
+        {
+            return nullptr;
+        }
+        struct stat info;
+        bool ok = fstat(fd, &info) == 0;
+        if (ok && writable && (size_t)info.st_size != bytes)
+        {
+            ok = ftruncate(fd, bytes) == 0 && fstat(fd, &info) == 0;
+        }
+        if (!ok || (size_t)info.st_size < bytes)
+        {
+            close(fd);
+            return nullptr;
+        }
+
+        pair<string, bool> key(name, writable);
+        std::map<pair<string, bool>, SharedMapping>::iterator found = mappings_.find(key);
+        if (found != mappings_.end())
+        {
+            const SharedMapping& mapping = found->second;
+            if (mapping.device == info.st_dev && mapping.inode == info.st_ino && mapping.bytes == bytes)
+            {
+                close(fd);
+                return mapping.data;
+            }
+            munmap(mapping.data, mapping.bytes);
+            mappings_.erase(found);
+        }
+        if (mappings_.size() >= SERVE_MAX_MAPPINGS)
+        {
+            clear();
+        }
+
+        // Fault every page in now, which is much cheaper than one fault per page while filtering
+        int protection = writable ? PROT_READ | PROT_WRITE : PROT_READ;
+        void* data = mmap(nullptr, bytes, protection, MAP_SHARED | MAP_POPULATE, fd, 0);
+        close(fd);
+        if (data == MAP_FAILED)
+        {
+            return nullptr;
+        }
+        SharedMapping mapping = {info.st_dev, info.st_ino, (unsigned char*)data, bytes};
+        mappings_[key] = mapping;
+        return mapping.data;
+    }
+
+    // Unmaps every object
+    void clear()
+    {
+        for (std::map<pair<string, bool>, SharedMapping>::iterator it = mappings_.begin(); it != mappings_.end(); it++)
+        {
+            munmap(it->second.data, it->second.bytes);
+        }
+        mappings_.clear();
+    }
+
+private:
+    SharedMappings(const SharedMappings&);
+    SharedMappings& operator=(const SharedMappings&);
+
+    std::map<pair<string, bool>, SharedMapping> mappings_;
+};
+
+/**
+ * Runs one server request and returns its reply. Requests are
+ * "run <input> <width> <height> <output> <recipe>", "ping" and "shutdown".
+ * For "run", the input shared memory object holds the image as height rows
+ * of width BGR pixels, top row first, each row padded to a multiple of 4 bytes
+ * (the layout of Image). The result is written in the same layout to the output
+ * object, which is created or resized to fit, and the reply is
+ * "ok <width> <height> <row bytes>". Failures reply "error <reason>".
+ * @param line     The request, without its newline
+ * @param mappings The connection's mapped shared memory objects
+ * @param stop     Set to true when the client asks the server to shut down
+ * @return the reply, without its newline
+ */
+string serve_request(const string& line, SharedMappings& mappings, bool& stop)
+{
+    istringstream words(line);
+    string command;
+    words >> command;
+    if (command == "ping")
+    {
+        return "ok";
+    }
+    if (command == "shutdown")
+    {
+        stop = true;
+        return "ok";
+    }
+    if (command != "run")
+    {
+        return "error unknown request " + command;
+    }
+
+    string input_name, output_name, recipe;
+    int width = 0, height = 0;
+    if (!(words >> input_name >> width >> height >> output_name >> recipe) || width <= 0 || height <= 0 ||
+        width > (INT_MAX - 3) / 3)
+    {
+        return "error usage: run <input> <width> <height> <output> <recipe>";
+    }
+    vector<Operation> ops;
+    if (!parse_recipe(recipe, ops))
+    {
+        return "error invalid recipe " + recipe;
+    }
+
+    ScopedTrace trace("serve_request", "server", (long long)width * height);
+    int stride = (width * 3 + 3) / 4 * 4;
+    size_t bytes = (size_t)stride * height;
+    const unsigned char* src = mappings.map_object(input_name, bytes, false);
+    if (src == nullptr)
+    {
+        return "error cannot map " + input_name;
+    }
+
+    if (all_of(ops.begin(), ops.end(), is_point_operation))
+    {
+        // Colour-only recipes filter straight from one mapping into the other
+        unsigned char* dst = mappings.map_object(output_name, bytes, true);
+        if (dst == nullptr)
+        {
+            return "error cannot map " + output_name;
+        }
+        trace.add_bytes_read(bytes);
+        trace.add_bytes_written(bytes);
+        vector<RowStage> stages = compile_point_stages(ops, 0, ops.size(), height, width);
+        parallel_rows(height, [&](int first_row, int last_row)
+        {
+            for (int row = first_row; row < last_row; row++)
+            {
+                unsigned char* out = dst + (size_t)row * stride;
+                stages[0](src + (size_t)row * stride, out, row, height, width);
+                for (size_t s = 1; s < stages.size(); s++)
+                {
+                    stages[s](out, out, row, height, width);
+                }
+                memset(out + width * 3, 0, stride - width * 3);
+            }
+        });
+        return "ok " + to_string(width) + " " + to_string(height) + " " + to_string(stride);
+    }
+
+    // Copy the input before mapping the output, which may be the same object resized
+    Image image(width, height, LAYOUT_INTERLEAVED, FILL_UNINITIALIZED);
+    memcpy(image.row(0), src, bytes);
+    Image new_image = run_pipeline(move(image), ops);
+    unsigned char* dst = mappings.map_object(output_name, new_image.size_bytes(), true);
+    if (dst == nullptr)
+    {
+        return "error cannot map " + output_name;
+    }
+    memcpy(dst, new_image.row(0), new_image.size_bytes());
+    trace.add_bytes_read(bytes);
+    trace.add_bytes_written(new_image.size_bytes());
+    return "ok " + to_string(new_image.width()) + " " + to_string(new_image.height()) + " " + to_string(new_image.stride());
+}
+
+// Connections of a running server
+struct ServerState
+{
+    int listener;
+    mutex lock;
+    condition_variable finished;
+    set<int> clients;
+    bool stopping;
+};
+
+/**
+ * Answers the requests of one client, one line each, until it disconnects
+ * @param fd    The client's socket
+ * @param state The server, which this connection asks to stop on "shutdown"
+ * @return nothing
+ */
+void serve_connection(int fd, ServerState& state)
+{
+    SharedMappings mappings;
+    string pending;
+    char buffer[4096];
+    while (true)
+    {
+        size_t newline = pending.find('\n');
+        if (newline == string::npos)
+        {
+            if (pending.size() > SERVE_MAX_REQUEST)
+            {
+                break;
+            }
+            ssize_t got = recv(fd, buffer, sizeof(buffer), 0);
+            if (got < 0 && errno == EINTR)
+            {
+                continue;
+            }
+            if (got <= 0)
+            {
+                break;
+            }
+            pending.append(buffer, got);
+            continue;
+        }
+
+        string line = pending.substr(0, newline);
+        pending.erase(0, newline + 1);
+        if (!line.empty() && line[line.size() - 1] == '\r')
+        {
+            line.erase(line.size() - 1);
+        }
+        bool stop = false;
+        string reply = serve_request(line, mappings, stop) + "\n";
+        if (!write_all(fd, (const unsigned char*)reply.data(), reply.size()))
+        {
+            break;
+        }
+        if (stop)
+        {
+            // Wakes the accept() in run_server(), which then closes the other connections
+            lock_guard<mutex> lock(state.lock);
+            state.stopping = true;
+            shutdown(state.listener, SHUT_RDWR);
+            break;
+        }
+    }
+
+    lock_guard<mutex> lock(state.lock);
+    state.clients.erase(fd);
+    close(fd);
+    state.finished.notify_all();
+}
+
+/**
+ * Runs as a server on a Unix domain socket until a client sends "shutdown".
+ * Images are passed in POSIX shared memory, so only short request lines go
+ * through the socket, and the thread pool, vignette masks and palette tables
+ * stay warm between requests. Each client gets its own thread.
+ * @param socket_path Where to create the socket (an old socket there is replaced)
+ * @return 0 after a clean shutdown, 1 if the socket can't be set up
+ */
+int run_server(const string& socket_path)
+{
+    sockaddr_un address;
+    memset(&address, 0, sizeof(address));
+    address.sun_family = AF_UNIX;
+    if (socket_path.empty() || socket_path.size() >= sizeof(address.sun_path))
+    {
+        cout << "Invalid socket path " << socket_path << "\n";
+        return 1;
+    }
+    memcpy(address.sun_path, socket_path.c_str(), socket_path.size());
+
+    struct stat info;
+    if (lstat(socket_path.c_str(), &info) == 0 && S_ISSOCK(info.st_mode))
+    {
+        unlink(socket_path.c_str());
+    }
+    int listener = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (listener < 0 || ::bind(listener, (const sockaddr*)&address, sizeof(address)) != 0 || listen(listener, 64) != 0)
+    {
+        cout << "Could not listen on " << socket_path << ": " << strerror(errno) << "\n";
+        if (listener >= 0)
+        {
+            close(listener);
+        }
+        return 1;
+    }
+
+    // A client that disconnects mid-reply must not kill the server
+    signal(SIGPIPE, SIG_IGN);
+    // Start the worker threads before the first request arrives
+    filter_pool();
+    cout << "Listening on " << socket_path << "\n";
+    cout.flush();
+
+    ServerState state;
+    state.listener = listener;
+    state.stopping = false;
+    while (true)
+    {
+        int fd = accept4(listener, nullptr, nullptr, SOCK_CLOEXEC);
+        if (fd < 0 && errno == EINTR)
+        {
+            continue;
+        }
+        lock_guard<mutex> lock(state.lock);
+        if (fd < 0 || state.stopping)
+        {
+            if (fd >= 0)
+            {
+                close(fd);
+            }
+            break;
+        }
+        state.clients.insert(fd);
+        thread(serve_connection, fd, ref(state)).detach();
+    }
+
+    // Let requests in progress finish, then wait for every connection to close
+    unique_lock<mutex> lock(state.lock);
+    for (set<int>::iterator it = state.clients.begin(); it != state.clients.end(); it++)
+    {
+        shutdown(*it, SHUT_RDWR);
+    }
+    state.finished.wait(lock, [&]() { return state.clients.empty(); });
+    lock.unlock();
+    close(listener);
+    unlink(socket_path.c_str());
+    cout << "Server stopped" << "\n";
+    return 0;
+}
+
+/**
+ * Compares write_image() against each write_image_fast() mode on one image
+ * and checks that every path produces identical files
+ * @param filename BMP image to encode
+ * @param runs     Number of timed runs per encoder
+ * @return 0 on success, 1 on failure
+ */
+int benchmark_encoders(string filename, int runs)
+{
+    Image image = read_image_fast(filename);
+    vector<vector<Pixel>> pixels = pixels_from_image(image);
+    if (image.empty())
+    {
+        cout << "Could not read a valid BMP image from " << filename << "\n";
+        return 1;
+    }
+
+    double megabytes = (54 + image.size_bytes()) / (1024.0 * 1024.0);
+    cout << "Encoding " << image.width() << "x" << image.height() << " (" << megabytes << " MB), "
+         << runs << " runs each" << "\n";
+
+    const string names[] = {"write_image", "write_image_fast scanlines", "write_image_fast whole", "write_image_fast writev"};
+    const string reference_file = "bench_encode_reference.bmp";
+    const string candidate_file = "bench_encode_candidate.bmp";
+    bool all_match = true;
+
+    for (int encoder = 0; encoder < 4; encoder++)
+    {
+        string output = encoder == 0 ? reference_file : candidate_file;
+        double best = 0;
+        for (int run = 0; run < runs; run++)
+        {
+            auto start = chrono::steady_clock::now();
+            bool ok = encoder == 0 ? write_image(output, pixels)
+                                   : write_image_fast(output, image, (WriteMode)(encoder - 1));
+            chrono::duration<double> elapsed = chrono::steady_clock::now() - start;
+            if (!ok)
+            {
+                cout << names[encoder] << " failed" << "\n";
+                return 1;
+            }
+            if (run == 0 || elapsed.count() < best)
+            {
+                best = elapsed.count();
+            }
+        }
+
+        string verdict = "";
+        if (encoder > 0)
+        {
+            ifstream a(reference_file, ios::binary);
+            ifstream b(candidate_file, ios::binary);
+            bool same = equal(istreambuf_iterator<char>(a), istreambuf_iterator<char>(),
+                              istreambuf_iterator<char>(b)) && b.peek() == EOF;
+            verdict = same ? " (identical)" : " (MISMATCH)";
+            all_match = all_match && same;
+        }
+        cout << names[encoder] << ": " << best * 1000 << " ms, " << megabytes / best << " MB/s" << verdict << "\n";
+    }
+
+    remove(reference_file.c_str());
+    remove(candidate_file.c_str());
+    return all_match ? 0 : 1;
+}
+
+// Settings for the synthetic benchmark
+struct BenchmarkOptions
+{
+    vector<double> megapixels; // Image sizes to generate
+    int runs;                  // Timed runs per measurement; the fastest one counts
+    unsigned int seed;         // Seed of the synthetic image content
+    string json_file;          // Where the JSON report is written
+    string scratch_directory;  // Where the generated BMP files are written
+    bool reference;            // Also time the original read_image() and write_image()
+};
+
+// One measurement of the benchmark
+struct BenchmarkResult
+{
+    string name;      // e.g. "decode/read_image_fast" or "filter/process_1"
+    int width;
+    int height;
+    bool padded;      // Whether the scanlines carry padding bytes
+    double seconds;   // Fastest run
+    double bytes;     // Bytes handled per run (file bytes for I/O, pixel bytes for filters)
+    long peak_rss_kb; // Peak resident set size during the measurement
+};
+
+/**
+ * Generates a reproducible test image: smooth gradients, so every band of
+ * the threshold filters is hit, with pseudo-random noise on top
+ * @param width  Width of the image
+ * @param height Height of the image
+ * @param seed   Seed of the noise
+ * @return the image
+ */
+Image synthetic_image(int width, int height, unsigned int seed)
+{
+    Image image(width, height);
+    parallel_rows(height, [&](int first_row, int last_row)
+    {
+        for (int row = first_row; row < last_row; row++)
+        {
+            // Seeding per row keeps the content the same whatever the thread count
+            unsigned int state = seed ^ (row * 2654435761u) ^ 0x9E3779B9u;
+            unsigned char* dst = image.row(row);
+            for (int col = 0; col < width; col++)
+            {
+                state ^= state << 13;
+                state ^= state >> 17;
+                state ^= state << 5;
+                int noise = (int)(state & 63) - 32;
+                dst[0] = clamp_byte((int)((long long)col * 255 / width) + noise);
+                dst[1] = clamp_byte((int)((long long)row * 255 / height) + noise);
+                dst[2] = clamp_byte((int)((long long)(col + row) * 255 / (width + height)) + noise);
+                dst += 3;
+            }
+        }
+    });
+    return image;
+}
+
+/**
+ * Resets the peak resident set size the kernel reports (Linux only), after
+ * handing memory freed by earlier measurements back to the system
+ * @return nothing
+ */
+void reset_peak_rss()
+{
+#ifdef __GLIBC__
+    malloc_trim(0);
+#endif
+    ofstream clear_refs("/proc/self/clear_refs");
+    clear_refs << "5";
+}
+
+/**
+ * Gets the peak resident set size since the last reset_peak_rss()
+ * @return the peak in kilobytes
+ */
+long peak_rss_kb()
+{
+    ifstream status("/proc/self/status");
+    string line;
+    while (getline(status, line))
+    {
+        if (line.compare(0, 6, "VmHWM:") == 0)
+        {
+            return atol(line.c_str() + 6);
+        }
+    }
+
+    // Without /proc, fall back to the peak of the whole run
+    struct rusage usage;
+    getrusage(RUSAGE_SELF, &usage);
+    return usage.ru_maxrss;
+}
+
+/**
+ * Times a piece of work several times
+ * @param runs Number of runs
+ * @param work The work to time; returns false if it failed
+ * @return the fastest run in seconds, or -1 if a run failed
+ */
+double best_time(int runs, const function<bool()>& work)
+{
+    double best = -1;
+    for (int run = 0; run < runs; run++)
+    {
+        auto start = chrono::steady_clock::now();
+        if (!work())
+        {
+            return -1;
+        }
+        double seconds = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+        if (best < 0 || seconds < best)
+        {
+            best = seconds;
+        }
+    }
+    return best;
+}
+
+/**
+ * Writes the benchmark results as JSON
+ * @param options The benchmark settings
+ * @param results Every measurement, in the order taken
+ * @return True if the file was written and false otherwise
+ */
+bool write_benchmark_json(const BenchmarkOptions& options, const vector<BenchmarkResult>& results)
+{
+    const char* const simd_names[] = {"scalar", "ssse3", "avx2"};
+    string compiler = __VERSION__;
+    replace(compiler.begin(), compiler.end(), '"', '\'');
+
+    ofstream json(options.json_file);
+    json << fixed << setprecision(3);
+    json << "{\n";
+    json << "  \"unix_time\": " << (long long)time(nullptr) << ",\n";
+    json << "  \"compiler\": \"" << compiler << "\",\n";
+    json << "  \"simd\": \"" << simd_names[simd_level()] << "\",\n";
+    json << "  \"threads\": " << filter_pool().size() << ",\n";
+    json << "  \"runs\": " << options.runs << ",\n";
+    json << "  \"seed\": " << options.seed << ",\n";
+    json << "  \"results\": [\n";
+    for (size_t i = 0; i < results.size(); i++)
+    {
+        const BenchmarkResult& r = results[i];
+        double pixels = (double)r.width * r.height;
+        json << "    {\"name\": \"" << r.name << "\", \"width\": " << r.width << ", \"height\": " << r.height
+             << ", \"megapixels\": " << pixels / 1e6 << ", \"padded\": " << (r.padded ? "true" : "false")
+             << ", \"seconds\": " << setprecision(6) << r.seconds << setprecision(3)
+             << ", \"ns_per_pixel\": " << r.seconds * 1e9 / pixels
+             << ", \"mb_per_s\": " << r.bytes / (1024.0 * 1024.0) / r.seconds
+             << ", \"peak_rss_kb\": " << r.peak_rss_kb << "}" << (i + 1 < results.size() ? "," : "") << "\n";
+    }
+    json << "  ]\n";
+    json << "}\n";
+    return json.good();
+}
+
+/**
+ * Parses the command line of a benchmark run, e.g.
+ * --benchmark --sizes 1,12,50,200 --runs 3 --seed 1 --json bench.json --reference
+ * @param args    Command line arguments (without the program name)
+ * @param options The parsed settings
+ * @return True if the command line is valid and false otherwise
+ */
+bool parse_benchmark_arguments(const vector<string>& args, BenchmarkOptions& options)
+{
+    options = BenchmarkOptions();
+    options.megapixels = {1, 12, 50, 200};
+    options.runs = 3;
+    options.seed = 1;
+    options.json_file = "benchmark.json";
+    options.scratch_directory = ".";
+    for (size_t i = 1; i < args.size(); i++)
+    {
+        if (args[i] == "--sizes" && i + 1 < args.size())
+        {
+            options.megapixels.clear();
+            string size;
+            istringstream sizes(args[++i]);
+            while (getline(sizes, size, ','))
+            {
+                double megapixels = atof(size.c_str());
+                if (megapixels <= 0)
+                {
+                    return false;
+                }
+                options.megapixels.push_back(megapixels);
+            }
+        }
+        else if (args[i] == "--runs" && i + 1 < args.size())
+        {
+            options.runs = max(1, atoi(args[++i].c_str()));
+        }
+        else if (args[i] == "--seed" && i + 1 < args.size())
+        {
+            options.seed = strtoul(args[++i].c_str(), nullptr, 10);
+        }
+        else if (args[i] == "--json" && i + 1 < args.size())
+        {
+            options.json_file = args[++i];
+        }
+        else if (args[i] == "--scratch" && i + 1 < args.size())
+        {
+            options.scratch_directory = args[++i];
+        }
+        else if (args[i] == "--reference")
+        {
+            options.reference = true;
+        }
+        else
+        {
+            return false;
+        }
+    }
+    return !options.megapixels.empty();
+}
+
+/**
+ * Times decoding, encoding and each of the ten filters on synthetic images
+ * of every requested size, once with unpadded and once with padded
+ * scanlines. Prints a table and writes the results as JSON. Decoding reads
+ * a file just written, so it measures the page cache rather than the disk.
+ * @param options The benchmark settings
+ * @return 0 on success, 1 if a step failed
+ */
+int run_benchmark(const BenchmarkOptions& options)
+{
+    vector<BenchmarkResult> results;
+    string file = options.scratch_directory + "/benchmark-input.bmp";
+    bool ok = true;
+
+    cout << fixed << setprecision(2);
+    cout << setw(28) << left << "measurement" << right << setw(14) << "size" << setw(12) << "ms"
+         << setw(12) << "ns/pixel" << setw(12) << "MB/s" << setw(12) << "peak MB" << "\n";
+
+    for (size_t s = 0; s < options.megapixels.size() && ok; s++)
+    {
+        for (int padded = 0; padded <= 1 && ok; padded++)
+        {
+            // 4:3 images; a width that is a multiple of four needs no padding, one more needs a byte
+            double pixels = options.megapixels[s] * 1e6;
+            int width = max(4, (int)lround(sqrt(pixels * 4 / 3)) / 4 * 4) + padded;
+            int height = max(1, (int)lround(pixels / width));
+            Image image = synthetic_image(width, height, options.seed);
+            double pixel_bytes = (double)width * height * 3;
+            double file_bytes = 54 + (double)image.size_bytes();
+
+            auto measure = [&](const string& name, double bytes, const function<bool()>& work)
+            {
+                if (!ok)
+                {
+                    return;
+                }
+                reset_peak_rss();
+                BenchmarkResult result;
+                result.name = name;
+                result.width = width;
+                result.height = height;
+                result.padded = padded == 1;
+                result.seconds = best_time(options.runs, work);
+                result.bytes = bytes;
+                result.peak_rss_kb = peak_rss_kb();
+                if (result.seconds < 0)
+                {
+                    cout << name << " failed" << "\n";
+                    ok = false;
+                    return;
+                }
+                results.push_back(result);
+
+                ostringstream size;
+                size << width << "x" << height;
+                cout << setw(28) << left << name << right << setw(14) << size.str() << setw(12) << result.seconds * 1000
+                     << setw(12) << result.seconds * 1e9 / ((double)width * height)
+                     << setw(12) << bytes / (1024.0 * 1024.0) / result.seconds
+                     << setw(12) << result.peak_rss_kb / 1024.0 << "\n";
+            };
+
+            measure("encode/write_image_fast", file_bytes, [&]() { return write_image_fast(file, image); });
+            measure("decode/read_image_fast", file_bytes, [&]() { return !read_image_fast(file).empty(); });
+            measure("filter/process_1", pixel_bytes, [&]() { return !process_1(image).empty(); });
+            measure("filter/process_2", pixel_bytes, [&]() { return !process_2(image, 0.5).empty(); });
+            measure("filter/process_3", pixel_bytes, [&]() { return !process_3(image).empty(); });
+            measure("filter/process_4", pixel_bytes, [&]() { return !process_4(image).empty(); });
+            measure("filter/process_5", pixel_bytes, [&]() { return !process_5(image, 2).empty(); });
+            measure("filter/process_6", pixel_bytes, [&]() { return !process_6(image, 2, 2).empty(); });
+            measure("filter/process_7", pixel_bytes, [&]() { return !process_7(image).empty(); });
+            measure("filter/process_8", pixel_bytes, [&]() { return !process_8(image, 0.5).empty(); });
+            measure("filter/process_9", pixel_bytes, [&]() { return !process_9(image, 0.5).empty(); });
+            measure("filter/process_10", pixel_bytes, [&]() { return !process_10(image).empty(); });
+
+            // The original vector<vector<Pixel>> reader and writer, for comparison. The
+            // reader seeks for every pixel (about a second per megapixel), so it is opt-in.
+            if (options.reference)
+            {
+                vector<vector<Pixel>> rows = pixels_from_image(image);
+                image = Image();
+                measure("encode/write_image", file_bytes, [&]() { return write_image(file, rows); });
+            }
+            if (options.reference)
+            {
+                measure("decode/read_image", file_bytes, [&]() { return !read_image(file).empty(); });
+            }
+            remove(file.c_str());
+        }
+    }
+
+    cout.unsetf(ios::floatfield);
+    cout << setprecision(6);
+    if (!ok)
+    {
+        return 1;
+    }
+    if (!write_benchmark_json(options, results))
+    {
+        cout << "Could not write " << options.json_file << "\n";
+        return 1;
+    }
+    cout << "Results written to " << options.json_file << "\n";
+    return 0;
+}
+
+// Names of the SIMD levels, as --simd takes them
+const char* const SIMD_LEVEL_NAMES[] = {"scalar", "ssse3", "avx2"};
+
+// Row widths the self test runs kernels on: every SIMD tail length, and rows with padding
+const int SELF_TEST_WIDTHS[] = {1, 2, 3, 4, 5, 7, 8, 11, 15, 16, 17, 21, 31, 32, 33, 47, 63, 64, 65, 127, 129, 255};
+
+// Bytes after each row the kernels must leave alone
+const int SELF_TEST_GUARD_BYTES = 64;
+
+/**
+ * Fills bytes with reproducible noise covering every channel value
+ * @param data  The bytes
+ * @param bytes How many
+ * @param seed  Seed of the noise
+ * @return nothing
+ */
+void fill_noise(unsigned char* data, size_t bytes, unsigned int seed)
+{
+    unsigned int state = seed * 2654435761u + 0x9E3779B9u;
+    for (size_t i = 0; i < bytes; i++)
+    {
+        state ^= state << 13;
+        state ^= state >> 17;
+        state ^= state << 5;
+        data[i] = (unsigned char)state;
+    }
+}
+
+/**
+ * Checks a row kernel at the active SIMD level against a reference, out of
+ * place and in place, and that it writes nothing past the end of the row
+ * @param name      What is checked, for the report
+ * @param kernel    The kernel, taking (src, dst, pixels)
+ * @param reference The expected result, taking (src, dst, pixels)
+ * @return the number of widths that didn't match
+ */
+int check_row_kernel(const string& name, const function<void(const unsigned char*, unsigned char*, int)>& kernel,
+                     const function<void(const unsigned char*, unsigned char*, int)>& reference)
+{
+    int failures = 0;
+    for (size_t w = 0; w < sizeof(SELF_TEST_WIDTHS) / sizeof(SELF_TEST_WIDTHS[0]); w++)
+    {
+        int pixels = SELF_TEST_WIDTHS[w];
+        size_t bytes = (size_t)pixels * 3;
+        vector<unsigned char> src(bytes + SELF_TEST_GUARD_BYTES);
+        fill_noise(src.data(), src.size(), pixels);
+        vector<unsigned char> expected(src.size(), 0xA5);
+        vector<unsigned char> out_of_place(src.size(), 0xA5);
+        vector<unsigned char> in_place = src;
+        reference(src.data(), expected.data(), pixels);
+        kernel(src.data(), out_of_place.data(), pixels);
+        kernel(in_place.data(), in_place.data(), pixels);
+
+        bool ok = memcmp(expected.data(), out_of_place.data(), bytes) == 0 &&
+                  memcmp(expected.data(), in_place.data(), bytes) == 0;
+        for (size_t i = bytes; ok && i < src.size(); i++)
+        {
+            ok = out_of_place[i] == 0xA5 && in_place[i] == src[i];
+        }
+        if (!ok)
+        {
+            cout << "  MISMATCH " << name << " at width " << pixels << "\n";
+            failures++;
+        }
+    }
+    return failures;
+}
+
+/**
+ * Checks a recipe at the active SIMD level against its scalar result on
+ * images of odd sizes, whose rows are padded
+ * @param recipe   The recipe, as the menu takes it
+ * @param expected Scalar results, one per test size; filled in when running at the scalar level
+ * @return the number of sizes that didn't match
+ */
+int check_recipe(const string& recipe, vector<Image>& expected)
+{
+    static const int sizes[][2] = {{1, 1}, {7, 3}, {33, 17}, {65, 9}, {130, 41}, {255, 3}};
+    vector<Operation> ops;
+    if (!parse_recipe(recipe, ops))
+    {
+        cout << "  Invalid recipe " << recipe << "\n";
+        return 1;
+    }
+    int failures = 0;
+    for (size_t s = 0; s < sizeof(sizes) / sizeof(sizes[0]); s++)
+    {
+        Image result = run_pipeline(synthetic_image(sizes[s][0], sizes[s][1], (unsigned int)s + 1), ops);
+        if (expected.size() <= s)
+        {
+            expected.push_back(result);
+            continue;
+        }
+        const Image& reference = expected[s];
+        bool ok = result.width() == reference.width() && result.height() == reference.height();
+        for (int row = 0; ok && row < result.height(); row++)
+        {
+            ok = memcmp(result.row(row), reference.row(row), (size_t)result.width() * 3) == 0;
+        }
+        if (!ok)
+        {
+            cout << "  MISMATCH " << recipe << " on " << sizes[s][0] << " x " << sizes[s][1] << "\n";
+            failures++;
+        }
+    }
+    return failures;
+}
+
+/**
+ * Checks the filters against the original per-pixel formulas and, at every
+ * SIMD level the CPU supports, against the scalar kernels: each row kernel
+ * on every tail length, and whole recipes on images with padded rows
+ * @return 0 if everything matched, 1 otherwise
+ */
+int run_self_test()
+{
+    SimdLevel original = simd_level();
+    SimdLevel best = detect_simd_level();
+    int failures = 0;
+
+    // The original filters truncated double results to int, then kept the low byte
+    const double factors[] = {0.0, 0.1, 0.3, 0.5, 0.75, 0.8, 0.9, 1.0};
+    vector<string> recipes;
+    recipes.push_back("vignette");
+    recipes.push_back("grayscale");
+    recipes.push_back("high_contrast");
+    recipes.push_back("five_color");
+    recipes.push_back("clarendon:0.3");
+    recipes.push_back("clarendon:1.7");
+    recipes.push_back("lighten:0.4");
+    recipes.push_back("lighten:1.3");
+    recipes.push_back("darken:0.7");
+    recipes.push_back("darken:1.6");
+    recipes.push_back("curve:0=30:128=200:255=240");
+    recipes.push_back("palette:FF0000:00FF00:0000FF:FFFFFF:000000:808080");
+    recipes.push_back("resize:13:7");
+    recipes.push_back("resize:97:61:bilinear");
+    recipes.push_back("resize:40:30:box");
+    recipes.push_back("darken:0.8,clarendon:0.3,vignette,grayscale");
+    vector<vector<Image>> expected(recipes.size());
+
+    for (int level = SIMD_SCALAR; level <= best; level++)
+    {
+        set_simd_level((SimdLevel)level);
+        const PointKernels& kernels = point_kernels();
+        int level_failures = 0;
+
+        level_failures += check_row_kernel("grayscale",
+            [&](const unsigned char* src, unsigned char* dst, int pixels) { kernels.grayscale(src, dst, pixels); },
+            [](const unsigned char* src, unsigned char* dst, int pixels)
+            {
+                for (int p = 0; p < pixels * 3; p += 3)
+                {
+                    dst[p] = dst[p + 1] = dst[p + 2] = (src[p] + src[p + 1] + src[p + 2]) / 3;
+                }
+            });
+        level_failures += check_row_kernel("high_contrast",
+            [&](const unsigned char* src, unsigned char* dst, int pixels) { kernels.high_contrast(src, dst, pixels); },
+            [](const unsigned char* src, unsigned char* dst, int pixels)
+            {
+                for (int p = 0; p < pixels * 3; p += 3)
+                {
+                    dst[p] = dst[p + 1] = dst[p + 2] = (src[p] + src[p + 1] + src[p + 2]) / 3 >= 255 / 2 ? 255 : 0;
+                }
+            });
+        level_failures += check_row_kernel("five_color", kernels.five_color, five_color_scalar);
+
+        for (size_t f = 0; f < sizeof(factors) / sizeof(factors[0]); f++)
+        {
+            double factor = factors[f];
+            ToneCurve light = scaling_curve(CURVE_LIGHTEN, factor);
+            ToneCurve dark = scaling_curve(CURVE_DARKEN, factor);
+            string suffix = ":" + to_string(factor);
+            level_failures += check_row_kernel("lighten" + suffix,
+                [&](const unsigned char* src, unsigned char* dst, int pixels) { kernels.tone_curve(src, dst, pixels * 3, light); },
+                [&](const unsigned char* src, unsigned char* dst, int pixels)
+                {
+                    for (int i = 0; i < pixels * 3; i++)
+                    {
+                        dst[i] = (unsigned char)(int)(255 - ((255 - src[i]) * factor));
+                    }
+                });
+            level_failures += check_row_kernel("darken" + suffix,
+                [&](const unsigned char* src, unsigned char* dst, int pixels) { kernels.tone_curve(src, dst, pixels * 3, dark); },
+                [&](const unsigned char* src, unsigned char* dst, int pixels)
+                {
+                    for (int i = 0; i < pixels * 3; i++)
+                    {
+                        dst[i] = (unsigned char)(int)(src[i] * factor);
+                    }
+                });
+            level_failures += check_row_kernel("clarendon" + suffix,
+                [&](const unsigned char* src, unsigned char* dst, int pixels) { kernels.clarendon(src, dst, pixels, light, dark); },
+                [&](const unsigned char* src, unsigned char* dst, int pixels)
+                {
+                    for (int p = 0; p < pixels * 3; p += 3)
+                    {
+                        double average_value = (src[p] + src[p + 1] + src[p + 2]) / 3;
+                        for (int c = 0; c < 3; c++)
+                        {
+                            double value = average_value >= 170 ? 255 - ((255 - src[p + c]) * factor)
+                                         : average_value < 90   ? src[p + c] * factor
+                                                                : src[p + c];
+                            dst[p + c] = (unsigned char)(int)value;
+                        }
+                    }
+                });
+        }
+
+        for (size_t r = 0; r < recipes.size(); r++)
+        {
+            level_failures += check_recipe(recipes[r], expected[r]);
+        }
+        cout << SIMD_LEVEL_NAMES[level] << ": " << (level_failures == 0 ? "ok" : "FAILED") << "\n";
+        failures += level_failures;
+    }
+    set_simd_level(original);
+
+    if (best < SIMD_AVX2)
+    {
+        cout << "(" << SIMD_LEVEL_NAMES[best + 1] << " and above not supported by this CPU, not checked)" << "\n";
+    }
+    cout << (failures == 0 ? "All checks passed" : to_string(failures) + " checks failed") << "\n";
+    return failures == 0 ? 0 : 1;
+}
+
+// One edit in the menu's history: the operations it applied and, while it is
+// kept, the image they produced. Images are never modified once stored, so
+// undoing and redoing only moves shared pointers around.
+struct EditStep
+{
+    unsigned long long id;         // Identifies the step across undo, redo and reloading
+    string label;
+    vector<Operation> ops;
+    Rect region;                   // The part of the image the step edited; 0 x 0 if it edited all of it
+    shared_ptr<const Image> image; // Null once dropped to stay within the memory budget, or while only previewed
+    shared_ptr<const Image> proxy; // The step applied to the preview proxy, if it was previewed
+};
+
+// What a full resolution render of one step needs: the nearest kept image
+// and every step after it, without their images. Holds its own references,
+// so it can run on another thread while the session keeps changing.
+struct RenderPlan
+{
+    unsigned long long id;
+    shared_ptr<const Image> base;
+    vector<EditStep> steps;
+};
+
+// The image the menu works on, kept decoded between menu options, with an
+// undo/redo history. Every step records its operations, which take a few
+// bytes; the images of steps far from the current one are dropped when the
+// history outgrows its budget and recomputed from the nearest kept image
+// if they are needed again. The loaded image and the current one are always kept.
+// In preview mode, edits only run on a small proxy of the image, and the full
+// resolution image of a step is computed when it is asked for.
+// An edit can be limited to a region; saving to the file last saved then
+// only rewrites the rows that changed since.
+class EditSession
+{
+public:
+    explicit EditSession(size_t memory_budget)
+        : budget_(memory_budget), position_(0), next_id_(0), preview_(false), shrink_(1), saved_id_(0) {}
+
+    /**
+     * Loads a BMP file as the starting point of a new history
+     * @param location BMP image filename
+     * @return true if a valid image was loaded
+     */
+    bool open(const string& location)
+    {
+        steps_.clear();
+        position_ = 0;
+        Image image = load_image(location);
+        if (image.empty())
+        {
+            return false;
+        }
+        EditStep base;
+        base.id = next_id_++;
+        base.label = "load " + location;
+        base.region = Rect();
+        base.image = make_shared<const Image>(move(image));
+        steps_.push_back(base);
+        return true;
+    }
+
+    bool empty() const { return steps_.empty(); }
+    bool can_undo() const { return position_ > 0; }
+    bool can_redo() const { return position_ + 1 < steps_.size(); }
+    const string& label() const { return steps_[position_].label; }
+    bool previewing() const { return preview_; }
+    void set_preview(bool preview) { preview_ = preview; }
+
+    /**
+     * Applies operations to the current image, discarding anything that could
+     * be redone. In preview mode they are only applied to the proxy.
+     * @param label  Description of the edit for the history
+     * @param ops    The operations, in order; only point operations if there is a region
+     * @param region The part of the image to edit (clipped to it), or 0 x 0 for all of it
+     * @return the new current image (its proxy in preview mode), or null if there is no image loaded
+     */
+    shared_ptr<const Image> apply(const string& label, const vector<Operation>& ops, const Rect& region = Rect())
+    {
+        shared_ptr<const Image> source = preview_ ? current_proxy() : current();
+        if (!source)
+        {
+            return source;
+        }
+        EditStep step;
+        step.id = next_id_++;
+        step.label = label;
+        step.ops = ops;
+        step.region = region;
+        shared_ptr<const Image> result = make_shared<const Image>(run_step(*source, preview_ ? proxy_step(step) : step));
+        if (result->empty())
+        {
+            // The edit failed (an enlarged size that doesn't fit, say); the history stays as it was
+            return shared_ptr<const Image>();
+        }
+        (preview_ ? step.proxy : step.image) = result;
+        steps_.resize(position_ + 1);
+        steps_.push_back(step);
+        position_++;
+        trim();
+        return preview_ ? step.proxy : step.image;
+    }
+
+    /**
+     * Steps back to the image before the last edit
+     * @return the new current image (its proxy in preview mode), or null if there is nothing to undo
+     */
+    shared_ptr<const Image> undo()
+    {
+        if (!can_undo())
+        {
+            return shared_ptr<const Image>();
+        }
+        position_--;
+        return preview_ ? current_proxy() : current();
+    }
+
+    /**
+     * Steps forward to the image after the next undone edit
+     * @return the new current image (its proxy in preview mode), or null if there is nothing to redo
+     */
+    shared_ptr<const Image> redo()
+    {
+        if (!can_redo())
+        {
+            return shared_ptr<const Image>();
+        }
+        position_++;
+        return preview_ ? current_proxy() : current();
+    }
+
+    /**
+     * Returns the current image, recomputing it from the nearest earlier kept
+     * image if it was dropped
+     * @return the current image, or null if there is no image loaded
+     */
+    shared_ptr<const Image> current()
+    {
+        if (steps_.empty())
+        {
+            return shared_ptr<const Image>();
+        }
+        if (!steps_[position_].image)
+        {
+            RenderPlan plan = render_plan();
+            shared_ptr<const Image> image = plan.base;
+            for (size_t i = 0; i < plan.steps.size(); i++)
+            {
+                image = make_shared<const Image>(run_step(*image, plan.steps[i]));
+            }
+            steps_[position_].image = image;
+            trim();
+        }
+        return steps_[position_].image;
+    }
+
+    /**
+     * Returns the current image at preview size, building the proxy of the
+     * loaded image and replaying edits on it as needed
+     * @return the current proxy, or null if there is no image loaded
+     */
+    shared_ptr<const Image> current_proxy()
+    {
+        if (steps_.empty())
+        {
+            return shared_ptr<const Image>();
+        }
+        if (!steps_[0].proxy)
+        {
+            steps_[0].proxy = make_shared<const Image>(build_proxy(*steps_[0].image, shrink_));
+        }
+        size_t kept = position_;
+        while (!steps_[kept].proxy)
+        {
+            kept--;
+        }
+        for (size_t i = kept + 1; i <= position_; i++)
+        {
+            steps_[i].proxy = make_shared<const Image>(run_step(*steps_[i - 1].proxy, proxy_step(steps_[i])));
+        }
+        trim();
+        return steps_[position_].proxy;
+    }
+
+    /**
+     * Describes how to compute the current image at full resolution without the session
+     * @return the plan, with no steps if the image is already kept
+     */
+    RenderPlan render_plan() const
+    {
+        RenderPlan plan;
+        plan.id = steps_.empty() ? 0 : steps_[position_].id;
+        if (steps_.empty())
+        {
+            return plan;
+        }
+        size_t kept = position_;
+        while (!steps_[kept].image)
+        {
+            kept--;
+        }
+        plan.base = steps_[kept].image;
+        for (size_t i = kept + 1; i <= position_; i++)
+        {
+            plan.steps.push_back(steps_[i]);
+            plan.steps.back().image.reset();
+            plan.steps.back().proxy.reset();
+        }
+        return plan;
+    }
+
+    /**
+     * Writes the current image (its proxy in preview mode) to a BMP file. If
+     * the file is unchanged since this session last saved to it, and every
+     * step between the one saved and the current one was limited to a
+     * region, only the rows those regions cover are rewritten.
+     * @param filename BMP file to write
+     * @return true if the image was written
+     */
+    bool write(const string& filename)
+    {
+        shared_ptr<const Image> image = preview_ ? current_proxy() : current();
+        if (!image)
+        {
+            return false;
+        }
+        bool written = false;
+        Rect dirty;
+        if (!preview_ && changed_since_save(filename, dirty))
+        {
+            written = dirty.height == 0 || write_image_rows(filename, *image, dirty.y, dirty.y + dirty.height);
+        }
+        if (!written && !write_image_fast(filename, *image))
+        {
+            saved_filename_.clear();
+            return false;
+        }
+        // A preview isn't the step's image, so the next save must write the whole file
+        saved_filename_.clear();
+        if (!preview_ && stat(filename.c_str(), &saved_stat_) == 0)
+        {
+            saved_filename_ = filename;
+            saved_id_ = steps_[position_].id;
+        }
+        return true;
+    }
 
-    // Fresh canvas
-    vector<vector<Pixel>> new_image(width, vector<Pixel>(height));
-    
-    for (int row = 0; row < width; row++)
+    /**
+     * Keeps a full resolution image rendered from a plan, if its step is still in the history
+     * @param id    The step the image belongs to
+     * @param image The rendered image
+     * @return nothing
+     */
+    void keep(unsigned long long id, const shared_ptr<const Image>& image)
     {
-        for (int col = 0; col < height; col++)
+        for (size_t i = 0; i < steps_.size(); i++)
         {
-            // Get the red, green and blue color values at each pixel location.
-            int red_color = image[row][col].red;
-            int green_color = image[row][col].green;
-            int blue_color = image[row][col].blue;
+            if (steps_[i].id == id && !steps_[i].image)
+            {
+                steps_[i].image = image;
+                trim();
+                return;
+            }
+        }
+    }
 
-            // Find the distance to the center                
-            double distance = sqrt(pow((col - width / 2), 2) + pow((row - height / 2), 2));
-            // cout << "\ndistance " << distance << "\n";
-            
-            double scaling_factor = (height - distance) / height;
-            // cout << "\nscaling " << scaling_factor << "\n";
+    /**
+     * Applies one step's operations
+     * @param image The image before the step
+     * @param ops   The step's operations
+     * @return the image after the step
+     */
+    static Image run_step(const Image& image, const vector<Operation>& ops)
+    {
+        // A single operation goes straight to its filter, which saves the pipeline's working copy
+        return ops.size() == 1 ? apply_operation(image, ops[0]) : run_pipeline(image, ops);
+    }
 
-            // Set the red, green and blue color values at each pixel location
-            new_image[row][col].red = red_color * scaling_factor;
-            new_image[row][col].green = green_color * scaling_factor;
-            new_image[row][col].blue = blue_color * scaling_factor;
+    /**
+     * Applies one step, to its region only if it has one
+     * @param image The image before the step
+     * @param step  The step
+     * @return the image after the step
+     */
+    static Image run_step(const Image& image, const EditStep& step)
+    {
+        if (step.region.width <= 0)
+        {
+            return run_step(image, step.ops);
+        }
+        Image edited = image;
+        Rect area = clip_region(step.region, edited.width(), edited.height());
+        if (area.width > 0)
+        {
+            filter_region(edited, step.ops, area);
         }
+        return edited;
     }
-    return new_image;
-}
-
-// Adds Clarendon effect to image (darks darker and lights lighter) by a scaling factor
-vector<vector<Pixel>> process_2(const vector<vector<Pixel>>& image, double scaling_factor)
-{
-    int width = image.size();
-    int height = image[0].size();
 
-    // Fresh canvas
-    vector<vector<Pixel>> new_image(width, vector<Pixel>(height));
-    
-    for (int row = 0; row < width; row++)
+private:
+    // Scales a step down to the proxy: the sizes given to resize steps and the step's region
+    EditStep proxy_step(const EditStep& step) const
     {
-        for (int col = 0; col < height; col++)
+        EditStep scaled = step;
+        scaled.ops = proxy_operations(step.ops);
+        if (step.region.width > 0)
         {
-            // Get the red, green and blue color values at each pixel location.
-            int red_color = image[row][col].red;
-            int green_color = image[row][col].green;
-            int blue_color = image[row][col].blue;
+            // Cover every proxy pixel that any pixel of the region shrinks into
+            scaled.region.x = step.region.x / shrink_;
+            scaled.region.y = step.region.y / shrink_;
+            scaled.region.width = (step.region.x + step.region.width + shrink_ - 1) / shrink_ - scaled.region.x;
+            scaled.region.height = (step.region.y + step.region.height + shrink_ - 1) / shrink_ - scaled.region.y;
+        }
+        return scaled;
+    }
 
-            // Average those values
-            double average_value = (red_color + green_color + blue_color) / 3;
+    /**
+     * Works out what changed since the last save, if it can be patched
+     * @param filename BMP file about to be written
+     * @param dirty    The region covering every step since the saved one (0 x 0 if none)
+     * @return true if the file still holds the saved step, has no other hard links and only regions changed since
+     */
+    bool changed_since_save(const string& filename, Rect& dirty) const
+    {
+        struct stat info;
+        if (filename != saved_filename_ || stat(filename.c_str(), &info) != 0 ||
+            info.st_ino != saved_stat_.st_ino || info.st_nlink != 1 || info.st_size != saved_stat_.st_size ||
+            info.st_mtim.tv_sec != saved_stat_.st_mtim.tv_sec || info.st_mtim.tv_nsec != saved_stat_.st_mtim.tv_nsec)
+        {
+            return false;
+        }
+        size_t saved = 0;
+        while (saved < steps_.size() && steps_[saved].id != saved_id_)
+        {
+            saved++;
+        }
+        if (saved == steps_.size())
+        {
+            return false;
+        }
+        // Undoing back past the saved step changes the same pixels as redoing it
+        dirty = Rect();
+        for (size_t i = min(saved, position_) + 1; i <= max(saved, position_); i++)
+        {
+            if (steps_[i].region.width <= 0)
+            {
+                return false;
+            }
+            dirty = union_region(dirty, steps_[i].region);
+        }
+        shared_ptr<const Image> image = steps_[position_].image;
+        dirty = clip_region(dirty, image->width(), image->height());
+        return true;
+    }
 
-            // If the cell is light, make it lighter
-            if (average_value >= 170)
+    // Scales the sizes given to resize steps down to the proxy
+    vector<Operation> proxy_operations(const vector<Operation>& ops) const
+    {
+        vector<Operation> scaled = ops;
+        for (size_t i = 0; i < scaled.size(); i++)
+        {
+            if (scaled[i].kind == OP_RESIZE)
             {
-                new_image[row][col].red = 255 - ((255 - red_color) * scaling_factor);
-                new_image[row][col].green = 255 - ((255 - green_color) * scaling_factor);
-                new_image[row][col].blue = 255 - ((255 - blue_color) * scaling_factor);
+                scaled[i].width = max(1, (scaled[i].width + shrink_ / 2) / shrink_);
+                scaled[i].height = max(1, (scaled[i].height + shrink_ / 2) / shrink_);
             }
-            else if (average_value < 90)
+        }
+        return scaled;
+    }
+
+    // Drops kept images and proxies, furthest from the current step first, until the history fits the budget
+    void trim()
+    {
+        while (true)
+        {
+            size_t bytes = 0;
+            size_t furthest = 0;
+            size_t furthest_distance = 0;
+            for (size_t i = 0; i < steps_.size(); i++)
             {
-                new_image[row][col].red = red_color * scaling_factor;
-                new_image[row][col].green = green_color * scaling_factor;
-                new_image[row][col].blue = blue_color * scaling_factor;
+                if (!steps_[i].image && !steps_[i].proxy)
+                {
+                    continue;
+                }
+                bytes += steps_[i].image ? steps_[i].image->size_bytes() : 0;
+                bytes += steps_[i].proxy ? steps_[i].proxy->size_bytes() : 0;
+                size_t distance = i > position_ ? i - position_ : position_ - i;
+                if (i != 0 && distance > furthest_distance)
+                {
+                    furthest = i;
+                    furthest_distance = distance;
+                }
             }
-            else
+            if (bytes <= budget_ || furthest_distance == 0)
             {
-                new_image[row][col].red = red_color;
-                new_image[row][col].green = green_color;
-                new_image[row][col].blue = blue_color;
+                return;
             }
+            steps_[furthest].image.reset();
+            steps_[furthest].proxy.reset();
         }
     }
-    return new_image;
-}
 
-// Grayscale image
-vector<vector<Pixel>> process_3(const vector<vector<Pixel>>& image)
+    size_t budget_;
+    vector<EditStep> steps_;
+    size_t position_; // Index of the step whose image is current
+    unsigned long long next_id_;
+    bool preview_;
+    int shrink_;      // How many times smaller the proxy is than the loaded image
+    string saved_filename_;        // File last written by write(), if it holds a full resolution image
+    unsigned long long saved_id_;  // The step written to it
+    struct stat saved_stat_;       // How it looked right after, to notice anything else writing it
+};
+
+// Saves the full resolution image of a previewed step on its own thread, so
+// the menu can keep previewing while it renders
+class BackgroundSave
 {
-    int width = image.size();
-    int height = image[0].size();
+public:
+    BackgroundSave() : busy_(false), done_(false), ok_(false) {}
 
-    // Fresh canvas
-    vector<vector<Pixel>> new_image(width, vector<Pixel>(height));
-    
-    for (int row = 0; row < width; row++)
+    ~BackgroundSave()
     {
-        for (int col = 0; col < height; col++)
+        if (worker_.joinable())
         {
-            // Get the red, green and blue color values at each pixel location.
-            int red_color = image[row][col].red;
-            int green_color = image[row][col].green;
-            int blue_color = image[row][col].blue;
-
-            // Average those values to get the grey value
-            double gray_value = (red_color + green_color + blue_color) / 3;
-
-            // Set new color values to all be our grey value
-            new_image[row][col].red = gray_value;
-            new_image[row][col].green = gray_value;
-            new_image[row][col].blue = gray_value;
+            worker_.join();
         }
     }
-    return new_image;
-}
 
-// Rotates image by 90 degrees clockwise (not counter-clockwise)
-vector<vector<Pixel>> process_4(const vector<vector<Pixel>>& image)
-{
-    int width = image.size();
-    int height = image[0].size();
+    bool busy() const { return busy_; }
+    bool done() const { return done_; }
 
-    // Fresh canvas
-    vector<vector<Pixel>> new_image(height, vector<Pixel>(width));
-    
-    for (int row = 0; row < width; row++)
+    /**
+     * Starts rendering a plan and writing the result. Call collect() first if busy().
+     * @param plan     The step to render
+     * @param filename BMP file to write it to
+     * @return nothing
+     */
+    void start(const RenderPlan& plan, const string& filename)
     {
-        for (int col = 0; col < height; col++)
+        plan_ = plan;
+        filename_ = filename;
+        image_.reset();
+        busy_ = true;
+        done_ = false;
+        worker_ = thread([this]()
         {
-            // Get the red, green and blue color values at each pixel location.
-            int red_color = image[row][col].red;
-            int green_color = image[row][col].green;
-            int blue_color = image[row][col].blue;
+            ScopedTrace trace("background_save", "menu");
+            shared_ptr<const Image> image = plan_.base;
+            for (size_t i = 0; image && i < plan_.steps.size(); i++)
+            {
+                image = make_shared<const Image>(EditSession::run_step(*image, plan_.steps[i]));
+            }
+            ok_ = image && write_image_fast(filename_, *image);
+            image_ = image;
+            done_ = true;
+        });
+    }
 
-            // Rotate the location of the r, g, b values:
-            new_image[col][(width-1) - row].red = red_color;
-            new_image[col][(width-1) - row].green = green_color;
-            new_image[col][(width-1) - row].blue = blue_color;
+    /**
+     * Waits for the save, reports it and hands the rendered image to the session
+     * @param session The session the plan came from
+     * @return true if the image was written
+     */
+    bool collect(EditSession& session)
+    {
+        worker_.join();
+        busy_ = false;
+        if (image_)
+        {
+            session.keep(plan_.id, image_);
+        }
+        image_.reset();
+        if (ok_)
+        {
+            cout << "Saved the full image to " << filename_ << "\n" << "\n";
+        }
+        else
+        {
+            cout << "There was an error saving " << filename_ << "\n";
         }
+        return ok_;
     }
-    return new_image;
-}
 
-// Rotates image by a specified number of multiples of 90 degrees clockwise
-vector<vector<Pixel>> process_5(const vector<vector<Pixel>>& image, int number)
+private:
+    BackgroundSave(const BackgroundSave&);
+    BackgroundSave& operator=(const BackgroundSave&);
+
+    thread worker_;
+    RenderPlan plan_;
+    string filename_;
+    shared_ptr<const Image> image_;
+    bool busy_;
+    atomic<bool> done_;
+    bool ok_;
+};
+
+/**
+ * Applies one menu edit to the session and writes the result. In preview
+ * mode the result written is the preview.
+ * @param session         The menu's editing session
+ * @param label           Description of the edit for the history
+ * @param ops             The operations to apply
+ * @param output_filename BMP file to write the edited image to
+ * @param region          The part of the image to edit, or 0 x 0 for all of it
+ * @return true if the edit was applied and written
+ */
+bool apply_menu_edit(EditSession& session, const string& label, const vector<Operation>& ops, const string& output_filename,
+                     const Rect& region = Rect())
 {
-    int angle = number * 90;
-    if (angle % 90 != 0)
-    {
-        cout << "Angle must be a multiple of 90 degrees.";
-    }
-    else if (angle % 360 == 0)
+    shared_ptr<const Image> image;
+    try
     {
-        return image;
+        image = session.apply(label, ops, region);
     }
-    else if (angle % 360 == 90)
+    catch (const bad_alloc&)
     {
-        vector<vector<Pixel>> new_image = process_4(image);
-        return new_image;
+        cout << "Not enough memory for this edit" << "\n";
+        return false;
     }
-    else if (angle % 360 == 180)
+    if (!image || !session.write(output_filename))
     {
-        vector<vector<Pixel>> new_image = process_4(process_4(image));
-        return new_image;
+        return false;
     }
-    else
+    if (session.previewing())
     {
-        vector<vector<Pixel>> new_image = process_4(process_4(process_4(image)));
-        return new_image;
+        cout << "Preview (" << image->width() << " x " << image->height()
+             << ") written; option 14 saves the full image" << "\n";
     }
-    return image;
+    return true;
 }
 
-// Enlarges the image in the x and y direction
-vector<vector<Pixel>> process_6(const vector<vector<Pixel>>& image, int x_scale, int y_scale)
+/**
+ * Applies a single operation as one menu edit (see above)
+ * @param session         The menu's editing session
+ * @param label           Description of the edit for the history
+ * @param op              The operation to apply
+ * @param output_filename BMP file to write the edited image to
+ * @return true if the edit was applied and written
+ */
+bool apply_menu_edit(EditSession& session, const string& label, const Operation& op, const string& output_filename)
 {
-    int width = image.size();
-    int height = image[0].size();
-    
-    // Calculates new dimensions based on user input
-    int new_width = width * y_scale;
-    int new_height = height * x_scale;
-    
-    // Fresh canvas
-    vector<vector<Pixel>> new_image(new_width, vector<Pixel>(new_height));
-    
-    for (int row = 0; row < new_width; row++)
-    {
-        for (int col = 0; col < new_height; col++)
-        {
-            int row_fractional = row / y_scale;
-            int col_fractional = col / x_scale;
-
-            // Get the red, green and blue color values at each pixel location and within scale
-            int red_color = image[row_fractional][col_fractional].red;
-            int green_color = image[row_fractional][col_fractional].green;
-            int blue_color = image[row_fractional][col_fractional].blue;
-
-            // Set the values according to scale
-            new_image[row][col].red = red_color;
-            new_image[row][col].green = green_color;
-            new_image[row][col].blue = blue_color;
-        }
-    }
-    return new_image;
+    return apply_menu_edit(session, label, vector<Operation>(1, op), output_filename);
 }
 
-// Convert image to high contrast (black and white only)
-vector<vector<Pixel>> process_7(const vector<vector<Pixel>>& image)
+int main(int argc, char* argv[])
 {
-    int width = image.size();
-    int height = image[0].size();
-    
-    // Fresh canvas
-    vector<vector<Pixel>> new_image(width, vector<Pixel>(height));
-    
-    for (int row = 0; row < width; row++)
+    // Pull out the options shared by every mode
+    vector<string> args;
+    int history_megabytes = 512;
+    for (int i = 1; i < argc; i++)
     {
-        for (int col = 0; col < height; col++)
+        string arg = argv[i];
+        if (arg == "--threads" && i + 1 < argc)
         {
-            // Get the red, green and blue color values at each pixel location.
-            int red_color = image[row][col].red;
-            int green_color = image[row][col].green;
-            int blue_color = image[row][col].blue;
-
-            // Finds gray value of pixel
-            double gray_value = (red_color + green_color + blue_color) / 3;
-
-            // Set the red, green and blue color values at each pixel location
-            if (gray_value >= 255 / 2)
-            {
-                new_image[row][col].red = 255;
-                new_image[row][col].green = 255;
-                new_image[row][col].blue = 255;
-            }
-            else
-            {
-                new_image[row][col].red = 0;
-                new_image[row][col].green = 0;
-                new_image[row][col].blue = 0;
-            }
+            // Number of threads filters run on (0 = one per hardware thread)
+            set_thread_count(atoi(argv[++i]));
+        }
+        else if (arg == "--simd" && i + 1 < argc)
+        {
+            // Highest instruction set for the point filters: scalar, ssse3 or avx2
+            string level = argv[++i];
+            SimdLevel requested = level == "scalar" ? SIMD_SCALAR : level == "ssse3" ? SIMD_SSSE3 : SIMD_AVX2;
+            set_simd_level(requested);
+        }
+        else if (arg == "--profile")
+        {
+            // Print time, bytes, pixels and allocations per stage on exit
+            profile_summary = true;
+        }
+        else if (arg == "--trace" && i + 1 < argc)
+        {
+            // Write every span as a Chrome trace (chrome://tracing or ui.perfetto.dev)
+            trace_file = argv[++i];
+        }
+        else if (arg == "--buffer-pool" && i + 1 < argc)
+        {
+            // MB of free image buffers kept for reuse (0 to return every buffer to the system)
+            buffer_pool().set_limit((size_t)max(0, atoi(argv[++i])) << 20);
+        }
+        else if (arg == "--history" && i + 1 < argc)
+        {
+            // MB of edited images the menu keeps for undo and redo
+            history_megabytes = max(0, atoi(argv[++i]));
+        }
+        else
+        {
+            args.push_back(arg);
         }
     }
-    return new_image;
-}
-
-// Lightens image by a scaling factor
-vector<vector<Pixel>> process_8(const vector<vector<Pixel>>& image, double scaling_factor) 
-{
-    int width = image.size();
-    int height = image[0].size();
-    
-    // Fresh canvas
-    vector<vector<Pixel>> new_image(width, vector<Pixel>(height));
-    
-    for (int row = 0; row < width; row++)
+    if (profile_summary || !trace_file.empty())
     {
-        for (int col = 0; col < height; col++)
-        {
-            // Get the red, green and blue color values at each pixel location.
-            int red_color = image[row][col].red;
-            int green_color = image[row][col].green;
-            int blue_color = image[row][col].blue;
+        profiling = true;
+        atexit(finish_profiling);
+    }
 
-            // Set the red, green and blue color values at each pixel location
-            new_image[row][col].red = (255 - ((255 - red_color) * scaling_factor));
-            new_image[row][col].green = (255 - ((255 - green_color) * scaling_factor));
-            new_image[row][col].blue = (255 - ((255 - blue_color) * scaling_factor));
-        }
+    // Non-interactive encoder benchmark: ./main --bench-encode image.bmp [runs]
+    if (args.size() >= 2 && args[0] == "--bench-encode")
+    {
+        int runs = args.size() >= 3 ? max(1, atoi(args[2].c_str())) : 5;
+        return benchmark_encoders(args[1], runs);
     }
-    return new_image;
-}
 
-// Darkens image by a scaling factor
+    // Checks the SIMD kernels against the scalar ones: ./main --self-test
+    if (!args.empty() && args[0] == "--self-test")
+    {
+        return run_self_test();
+    }
 
-vector<vector<Pixel>> process_9(const vector<vector<Pixel>>& image, double scaling_factor)
-{
-    int width = image.size();
-    int height = image[0].size();
-    
-    // Fresh canvas
-    vector<vector<Pixel>> new_image(width, vector<Pixel>(height));
-    
-    for (int row = 0; row < width; row++)
+    // Synthetic benchmark: ./main --benchmark [--sizes 1,12,50,200] [--runs 3] [--json benchmark.json] [--reference]
+    if (!args.empty() && args[0] == "--benchmark")
     {
-        for (int col = 0; col < height; col++)
+        BenchmarkOptions options;
+        if (!parse_benchmark_arguments(args, options))
         {
-            // Get the red, green and blue color values at each pixel location.
-            int red_color = image[row][col].red;
-            int green_color = image[row][col].green;
-            int blue_color = image[row][col].blue;
-
-            // Set the red, green and blue color values at each pixel location
-            new_image[row][col].red = red_color * scaling_factor;
-            new_image[row][col].green = green_color * scaling_factor;
-            new_image[row][col].blue = blue_color * scaling_factor;
+            cout << "Usage: main --benchmark [--sizes <MP>,<MP>,...] [--runs <runs>] [--seed <seed>] [--json <file>] [--scratch <directory>] [--reference]" << "\n";
+            return 1;
         }
+        return run_benchmark(options);
     }
-    return new_image;
-}
 
-// Converts image to only black, white, red, blue, and green
-vector<vector<Pixel>> process_10(const vector<vector<Pixel>>& image)
-{
-    int width = image.size();
-    int height = image[0].size();
-    
-    // Fresh canvas
-    vector<vector<Pixel>> new_image(width, vector<Pixel>(height));
-    
-    for (int row = 0; row < width; row++)
+    // Server mode: ./main --serve /tmp/image-editor.sock
+    if (args.size() >= 2 && args[0] == "--serve")
     {
-        for (int col = 0; col < height; col++)
-        {
-            // Get the red, green and blue color values at each pixel location.
-            int red_color = image[row][col].red;
-            int green_color = image[row][col].green;
-            int blue_color = image[row][col].blue;
-
-            // Get max/largest color number
-            int max_color = red_color;
-            
-            if (green_color > max_color)
-            {
-                max_color = green_color;
-            }
-            if (blue_color > max_color)
-            {
-                max_color = blue_color;
-            }
+        return run_server(args[1]);
+    }
 
-            // Set the red, green and blue color values at each pixel location
-            if (red_color + green_color + blue_color >= 550)
-            {
-                new_image[row][col].red = 255;
-                new_image[row][col].green = 255;
-                new_image[row][col].blue = 255;
-            }
-            else if (red_color + green_color + blue_color <= 150)
-            {
-                new_image[row][col].red = 0;
-                new_image[row][col].green = 0;
-                new_image[row][col].blue = 0;
-            }
-            else if (max_color == red_color)
-            {
-                new_image[row][col].red = 255;
-                new_image[row][col].green = 0;
-                new_image[row][col].blue = 0;
-            }
-            else if (max_color == green_color)
-            {
-                new_image[row][col].red = 0;
-                new_image[row][col].green = 255;
-                new_image[row][col].blue = 0;
-            }
-            else
-            {
-                new_image[row][col].red = 0;
-                new_image[row][col].green = 0;
-                new_image[row][col].blue = 255;
-            }
-            
+    // Non-interactive batch mode: ./main --op clarendon:0.3 --op rotate:1 -j 16 in/*.bmp -o out/
+    if (find(args.begin(), args.end(), "--op") != args.end())
+    {
+        BatchOptions options;
+        if (!parse_batch_arguments(args, options))
+        {
+            return 1;
         }
+        return run_batch(options);
     }
-    return new_image;
-}
-    
-int main()
-{
+
     cout << "CSPB 1300 Image Processing Application" << "\n"; // Welcome Statement
     bool is_menu_active = true; // Value for while loop menu
     
@@ -612,13 +8727,26 @@ int main()
     
     // Read in image from relative path:
     string sample_image_location = "./" + filename;
+
+    // Decode the image once; every menu option edits the resident copy
+    EditSession session((size_t)history_megabytes << 20);
+    session.open(sample_image_location);
     
     // Declaration of output file
     string output_filename = "";
+
+    // Full resolution render of a previewed edit, if one is being saved
+    BackgroundSave background_save;
     
     while (is_menu_active)
     {
         string chosen_option = "";
+
+        // Report a background save that finished while the last option ran
+        if (background_save.busy() && background_save.done())
+        {
+            background_save.collect(session);
+        }
         
         cout << "IMAGE PROCESSING MENU" << "\n";
         cout << "0) Change image (current: " + filename + ")" << "\n";
@@ -632,6 +8760,12 @@ int main()
         cout << "8) Lighten " << "\n";
         cout << "9) Darken " << "\n";
         cout << "10) Black, white, red, green, blue " << "\n";
+        cout << "11) Recipe (several operations in one pass) " << "\n";
+        cout << "12) Undo " << "\n";
+        cout << "13) Redo " << "\n";
+        cout << "14) Save current image " << "\n";
+        cout << "15) Preview mode (currently " << (session.previewing() ? "on" : "off") << ") " << "\n";
+        cout << "16) Recipe on a region " << "\n";
         
         cout << "\n" << "Enter menu selection (Q to quit): " << "\n";
         cin >> chosen_option;
@@ -639,6 +8773,11 @@ int main()
         if (chosen_option == "Q")
         {
             is_menu_active = false;
+            if (background_save.busy())
+            {
+                cout << "Waiting for the background save to finish..." << "\n";
+                background_save.collect(session);
+            }
             cout << "Quitting the application..." << "\n";
         }
         else if (chosen_option == "0")
@@ -646,6 +8785,7 @@ int main()
             cout << "Enter new input BMP filename: " << "\n";
             cin >> filename;
             sample_image_location = "./" + filename;
+            session.open(sample_image_location);
         }
         else if (chosen_option == "1")
         {
@@ -653,14 +8793,13 @@ int main()
             cout << "Enter output BMP filename: " << "\n";
             cin >> output_filename;
             
-            // Read in BMP image file into a 2D vector (using read_image function)
-            vector<vector<Pixel>> image = read_image(sample_image_location);
+            // Apply process_1 to the current image as one step of the history,
+            // parsed like a recipe step so its values are checked the same way
+            Operation op;
+            bool valid = parse_operation("vignette", op);
 
-            // Call process_1 function using the input 2D vector and returns a new 2D vector
-            vector<vector<Pixel>> new_image = process_1(image);
-            
-            // Write the resulting 2D vector to a new BMP image file (using write_image function)
-            bool image_created = write_image(output_filename, new_image);
+            // Write the resulting image to a new BMP image file (using write_image_fast function)
+            bool image_created = valid && apply_menu_edit(session, "vignette", op, output_filename);
             
             // Validates successful creation and error
             if (image_created)
@@ -682,14 +8821,13 @@ int main()
             cout << "Enter scaling factor: " << "\n";
             cin >> scaling_factor;
             
-            // Read in BMP image file into a 2D vector (using read_image function)
-            vector<vector<Pixel>> image = read_image(sample_image_location);
-            
-            // Call process_2
-            vector<vector<Pixel>> new_image = process_2(image, scaling_factor);
+            // Apply process_2 to the current image as one step of the history,
+            // parsed like a recipe step so its values are checked the same way
+            Operation op;
+            bool valid = parse_operation("clarendon:" + format_number(scaling_factor), op);
 
-            // Write the resulting 2D vector to a new BMP image file (using write_image function)
-            bool image_created = write_image(output_filename, new_image);
+            // Write the resulting image to a new BMP image file (using write_image_fast function)
+            bool image_created = valid && apply_menu_edit(session, "clarendon", op, output_filename);
             
             // Validates successful creation and error
             if (image_created)
@@ -707,14 +8845,13 @@ int main()
             cout << "Enter output BMP filename: " << "\n";
             cin >> output_filename;
             
-            // Read in BMP image file into a 2D vector (using read_image function)
-            vector<vector<Pixel>> image = read_image(sample_image_location);
-            
-            // Call process_3
-            vector<vector<Pixel>> new_image = process_3(image);
+            // Apply process_3 to the current image as one step of the history,
+            // parsed like a recipe step so its values are checked the same way
+            Operation op;
+            bool valid = parse_operation("grayscale", op);
 
-            // Write the resulting 2D vector to a new BMP image file (using write_image function)
-            bool image_created = write_image(output_filename, new_image);
+            // Write the resulting image to a new BMP image file (using write_image_fast function)
+            bool image_created = valid && apply_menu_edit(session, "grayscale", op, output_filename);
             
             // Validates successful creation and error
             if (image_created)
@@ -732,14 +8869,13 @@ int main()
             cout << "Enter output BMP filename: " << "\n";
             cin >> output_filename;
             
-            // Read in BMP image file into a 2D vector (using read_image function)
-            vector<vector<Pixel>> image = read_image(sample_image_location);
-            
-            // Call process_4
-            vector<vector<Pixel>> new_image = process_4(image);
+            // Apply process_4 to the current image as one step of the history,
+            // parsed like a recipe step so its values are checked the same way
+            Operation op;
+            bool valid = parse_operation("rotate90", op);
 
-            // Write the resulting 2D vector to a new BMP image file (using write_image function)
-            bool image_created = write_image(output_filename, new_image);
+            // Write the resulting image to a new BMP image file (using write_image_fast function)
+            bool image_created = valid && apply_menu_edit(session, "rotate 90", op, output_filename);
             
             // Validates successful creation and error
             if (image_created)
@@ -761,14 +8897,13 @@ int main()
             cout << "Enter number of 90 degree rotations: " << "\n";
             cin >> number_rotations;
             
-            // Read in BMP image file into a 2D vector (using read_image function)
-            vector<vector<Pixel>> image = read_image(sample_image_location);
-            
-            // Call process_5
-            vector<vector<Pixel>> new_image = process_5(image, number_rotations);
+            // Apply process_5 to the current image as one step of the history,
+            // parsed like a recipe step so its values are checked the same way
+            Operation op;
+            bool valid = parse_operation("rotate:" + to_string((int)number_rotations), op);
 
-            // Write the resulting 2D vector to a new BMP image file (using write_image function)
-            bool image_created = write_image(output_filename, new_image);
+            // Write the resulting image to a new BMP image file (using write_image_fast function)
+            bool image_created = valid && apply_menu_edit(session, "rotate", op, output_filename);
             
             // Validates successful creation and error
             if (image_created)
@@ -794,14 +8929,13 @@ int main()
             cout << "Enter Y scale: " << "\n";
             cin >> y_scale;
             
-            // Read in BMP image file into a 2D vector (using read_image function)
-            vector<vector<Pixel>> image = read_image(sample_image_location);
-            
-            // Call process_6
-            vector<vector<Pixel>> new_image = process_6(image, x_scale, y_scale);
+            // Apply process_6 to the current image as one step of the history,
+            // parsed like a recipe step so its values are checked the same way
+            Operation op;
+            bool valid = parse_operation("enlarge:" + to_string(x_scale) + ":" + to_string(y_scale), op);
 
-            // Write the resulting 2D vector to a new BMP image file (using write_image function)
-            bool image_created = write_image(output_filename, new_image);
+            // Write the resulting image to a new BMP image file (using write_image_fast function)
+            bool image_created = valid && apply_menu_edit(session, "enlarge", op, output_filename);
             
             // Validates successful creation and error
             if (image_created)
@@ -819,14 +8953,13 @@ int main()
             cout << "Enter output BMP filename: " << "\n";
             cin >> output_filename;
             
-            // Read in BMP image file into a 2D vector (using read_image function)
-            vector<vector<Pixel>> image = read_image(sample_image_location);
+            // Apply process_7 to the current image as one step of the history,
+            // parsed like a recipe step so its values are checked the same way
+            Operation op;
+            bool valid = parse_operation("high_contrast", op);
 
-            // Call process_1 function using the input 2D vector and returns a new 2D vector
-            vector<vector<Pixel>> new_image = process_7(image);
-            
-            // Write the resulting 2D vector to a new BMP image file (using write_image function)
-            bool image_created = write_image(output_filename, new_image);
+            // Write the resulting image to a new BMP image file (using write_image_fast function)
+            bool image_created = valid && apply_menu_edit(session, "high contrast", op, output_filename);
             
             // Validates successful creation and error
             if (image_created)
@@ -848,14 +8981,13 @@ int main()
             cout << "Enter scaling factor " << "\n";
             cin >> scaling_factor;
             
-            // Read in BMP image file into a 2D vector (using read_image function)
-            vector<vector<Pixel>> image = read_image(sample_image_location);
+            // Apply process_8 to the current image as one step of the history,
+            // parsed like a recipe step so its values are checked the same way
+            Operation op;
+            bool valid = parse_operation("lighten:" + format_number(scaling_factor), op);
 
-            // Call process_1 function using the input 2D vector and returns a new 2D vector
-            vector<vector<Pixel>> new_image = process_8(image, scaling_factor);
-            
-            // Write the resulting 2D vector to a new BMP image file (using write_image function)
-            bool image_created = write_image(output_filename, new_image);
+            // Write the resulting image to a new BMP image file (using write_image_fast function)
+            bool image_created = valid && apply_menu_edit(session, "lighten", op, output_filename);
             
             // Validates successful creation and error
             if (image_created)
@@ -877,14 +9009,13 @@ int main()
             cout << "Enter scaling factor " << "\n";
             cin >> scaling_factor;
             
-            // Read in BMP image file into a 2D vector (using read_image function)
-            vector<vector<Pixel>> image = read_image(sample_image_location);
+            // Apply process_9 to the current image as one step of the history,
+            // parsed like a recipe step so its values are checked the same way
+            Operation op;
+            bool valid = parse_operation("darken:" + format_number(scaling_factor), op);
 
-            // Call process_1 function using the input 2D vector and returns a new 2D vector
-            vector<vector<Pixel>> new_image = process_9(image, scaling_factor);
-            
-            // Write the resulting 2D vector to a new BMP image file (using write_image function)
-            bool image_created = write_image(output_filename, new_image);
+            // Write the resulting image to a new BMP image file (using write_image_fast function)
+            bool image_created = valid && apply_menu_edit(session, "darken", op, output_filename);
             
             // Validates successful creation and error
             if (image_created)
@@ -902,14 +9033,13 @@ int main()
             cout << "Enter output BMP filename: " << "\n";
             cin >> output_filename;
             
-            // Read in BMP image file into a 2D vector (using read_image function)
-            vector<vector<Pixel>> image = read_image(sample_image_location);
+            // Apply process_10 to the current image as one step of the history,
+            // parsed like a recipe step so its values are checked the same way
+            Operation op;
+            bool valid = parse_operation("five_color", op);
 
-            // Call process_1 function using the input 2D vector and returns a new 2D vector
-            vector<vector<Pixel>> new_image = process_10(image);
-            
-            // Write the resulting 2D vector to a new BMP image file (using write_image function)
-            bool image_created = write_image(output_filename, new_image);
+            // Write the resulting image to a new BMP image file (using write_image_fast function)
+            bool image_created = valid && apply_menu_edit(session, "five colour", op, output_filename);
             
             // Validates successful creation and error
             if (image_created)
@@ -921,6 +9051,127 @@ int main()
                 cout << "There was an error performing this operation" << "\n" ;
             }
         }
+        else if (chosen_option == "11")
+        {
+            cout << "Recipe selected" << "\n";
+            cout << "Enter output BMP filename: " << "\n";
+            cin >> output_filename;
+
+            string recipe = "";
+            cout << "Enter operations separated by commas (e.g. darken:0.8,clarendon:0.3,vignette): " << "\n";
+            cin >> recipe;
+
+            // Parse the whole recipe before touching the image
+            vector<Operation> ops;
+            bool image_created = false;
+            if (parse_recipe(recipe, ops))
+            {
+                // Run every operation as one step, fusing neighbouring point operations into one pass,
+                // and write the resulting image to a new BMP image file (using write_image_fast function)
+                image_created = apply_menu_edit(session, "recipe " + recipe, ops, output_filename);
+            }
+
+            // Validates successful creation and error
+            if (image_created)
+            {
+                cout << "Successfully applied recipe!" << "\n" << "\n";
+            }
+            else if (!image_created)
+            {
+                cout << "There was an error performing this operation" << "\n" ;
+            }
+        }
+        else if (chosen_option == "12" || chosen_option == "13")
+        {
+            // Undo and redo only move through the history; option 14 writes the result
+            bool undo = chosen_option == "12";
+            string step = session.empty() ? "" : session.label();
+            shared_ptr<const Image> image = undo ? session.undo() : session.redo();
+            if (image)
+            {
+                cout << (undo ? "Undid " + step : "Redid " + session.label()) << "\n" << "\n";
+            }
+            else
+            {
+                cout << (undo ? "Nothing to undo" : "Nothing to redo") << "\n" << "\n";
+            }
+        }
+        else if (chosen_option == "14")
+        {
+            cout << "Save current image selected" << "\n";
+            cout << "Enter output BMP filename: " << "\n";
+            cin >> output_filename;
+
+            if (session.previewing() && !session.empty())
+            {
+                // Render the full image on another thread; only one save runs at a time
+                if (background_save.busy())
+                {
+                    cout << "Waiting for the previous save to finish..." << "\n";
+                    background_save.collect(session);
+                }
+                background_save.start(session.render_plan(), output_filename);
+                cout << "Saving the full image in the background" << "\n" << "\n";
+                continue;
+            }
+
+            if (session.write(output_filename))
+            {
+                cout << "Successfully saved the current image!" << "\n" << "\n";
+            }
+            else
+            {
+                cout << "There was an error performing this operation" << "\n" ;
+            }
+        }
+        else if (chosen_option == "15")
+        {
+            // Preview mode edits a proxy of at most about a megapixel; option 14 renders the full image
+            session.set_preview(!session.previewing());
+            cout << "Preview mode " << (session.previewing() ? "on" : "off") << "\n" << "\n";
+        }
+        else if (chosen_option == "16")
+        {
+            cout << "Recipe on a region selected" << "\n";
+            cout << "Enter output BMP filename: " << "\n";
+            cin >> output_filename;
+
+            string region_text = "";
+            cout << "Enter the region as X,Y,WIDTH,HEIGHT (from the top left corner): " << "\n";
+            cin >> region_text;
+
+            string recipe = "";
+            cout << "Enter colour operations separated by commas (e.g. darken:0.8,clarendon:0.3,vignette): " << "\n";
+            cin >> recipe;
+
+            // Only colour operations keep every pixel where it was, so only they can be limited to a region
+            Rect region;
+            vector<Operation> ops;
+            bool image_created = false;
+            if (!parse_region(region_text, region))
+            {
+                cout << "Invalid region " << region_text << "\n";
+            }
+            else if (!parse_recipe(recipe, ops) || !all_of(ops.begin(), ops.end(), is_point_operation))
+            {
+                cout << "A region can only be used with colour operations (no rotating, enlarging or resizing)" << "\n";
+            }
+            else
+            {
+                // Saving over the file written last only rewrites the rows the region covers
+                image_created = apply_menu_edit(session, "recipe " + recipe + " on " + region_text, ops, output_filename, region);
+            }
+
+            // Validates successful creation and error
+            if (image_created)
+            {
+                cout << "Successfully applied recipe to the region!" << "\n" << "\n";
+            }
+            else if (!image_created)
+            {
+                cout << "There was an error performing this operation" << "\n" ;
+            }
+        }
     }
 
     return 0;